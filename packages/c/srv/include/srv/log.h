@@ -0,0 +1,69 @@
+#ifndef SRV_LOG_H
+#define SRV_LOG_H
+#include <atlogger/atlogger.h>
+#include <stdint.h>
+
+// The async sink holds at most LOG_SINK_SLOTS messages of up to LOG_SINK_MESSAGE_LEN bytes each (power of 2)
+#define LOG_SINK_SLOTS 256
+#define LOG_SINK_TAG_LEN 32
+#define LOG_SINK_MESSAGE_LEN 480
+
+// Release builds (NDEBUG) compile DEBUG logging out entirely, unless SRV_KEEP_DEBUG_LOGS is defined
+#if defined(NDEBUG) && !defined(SRV_KEEP_DEBUG_LOGS)
+#define LOG_MAX_COMPILED_LEVEL ATLOGGER_LOGGING_LEVEL_INFO
+#else
+#define LOG_MAX_COMPILED_LEVEL ATLOGGER_LOGGING_LEVEL_DEBUG
+#endif
+
+/**
+ * @brief Whether a message at level would be logged, use it to guard building expensive log arguments
+ *
+ * Folds to 0 at compile time for levels which are compiled out.
+ */
+#define log_enabled(level) ((level) <= LOG_MAX_COMPILED_LEVEL && (level) <= atlogger_get_logging_level())
+
+/**
+ * @brief Drop in replacement for atlogger_log which only evaluates its arguments when level is enabled
+ *
+ * Formatting work (and calls like cJSON_Print in the arguments) is skipped entirely when nobody will read it.
+ * Enabled messages go through log_sink_log, so they are queued rather than written while the sink is running.
+ */
+#define lazy_log(tag, level, ...)                                                                                      \
+  do {                                                                                                                 \
+    if (log_enabled(level)) {                                                                                          \
+      log_sink_log(tag, level, __VA_ARGS__);                                                                           \
+    }                                                                                                                  \
+  } while (0)
+
+/**
+ * @brief Start the background flusher, after which log_sink_log only formats into a ring buffer slot
+ *
+ * The sink is not inherited across fork(), a child process logs synchronously until it starts its own sink.
+ *
+ * @return 0 on success (or if already running), non-zero if the flusher thread could not be started
+ */
+int log_sink_start(void);
+
+/**
+ * @brief Write out everything still queued, then stop the flusher and go back to logging synchronously
+ */
+void log_sink_stop(void);
+
+/**
+ * @brief Log a message through the sink, or synchronously through atlogger_log when the sink isn't running
+ *
+ * Never blocks on I/O while the sink is running: if the ring buffer is full the message is dropped and counted.
+ * Messages longer than LOG_SINK_MESSAGE_LEN are written synchronously rather than truncated.
+ *
+ * @param tag the logger tag, copied (and truncated to LOG_SINK_TAG_LEN - 1 bytes)
+ * @param level the atlogger logging level of the message
+ * @param format printf style format string, followed by its arguments
+ */
+void log_sink_log(const char *tag, enum atlogger_logging_level level, const char *format, ...);
+
+/**
+ * @brief The number of messages dropped because the ring buffer was full, since the process started
+ */
+uint64_t log_sink_dropped(void);
+
+#endif
@@ -33,6 +33,8 @@ typedef struct {
   char *rvd_auth_string;
   char *session_aes_key_string;
   char *session_aes_iv_string;
+
+  int stats_fd; // datagram socket to send session stats to (see srv/stats.h), -1 to log them instead
 } srv_params_t;
 
 /**
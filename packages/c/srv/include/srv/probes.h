@@ -0,0 +1,43 @@
+#ifndef SRV_PROBES_H
+#define SRV_PROBES_H
+
+/*
+ * USDT (sys/sdt.h) probes, for finding latency outliers with perf or bpftrace without turning on DEBUG logging, e.g.
+ *   bpftrace -e 'usdt:./sshnpd:srv:chunk_recv { @start[tid] = nsecs; }
+ *                usdt:./sshnpd:srv:chunk_forwarded /@start[tid]/ { @us = hist((nsecs - @start[tid]) / 1000); }'
+ *
+ * Provider srv (srv and every srv session sshnpd forks):
+ *   chunk_recv(bool is_side_a, int len)             a side read a chunk from its socket
+ *   chunk_transform_start(bool is_side_a, int len)  before the chunk is encrypted or decrypted
+ *   chunk_transform_done(bool is_side_a, int res)   after, res is non-zero on error
+ *   chunk_send(bool is_side_a, int res)             each send to the other side, res is the bytes sent or an error
+ *   chunk_forwarded(bool is_side_a, int unsent)     done sending the chunk, unsent is 0 unless a send failed
+ *   session_open(uint64_t session)                  a socket to socket session has connected both sides
+ *   session_close(uint64_t session)                 and has finished
+ *   control_recv(int len)                           run_srv_daemon_side_multi read from the control socket
+ *   control_message(char *type)                     and parsed a request of type from it
+ *
+ * Provider sshnpd:
+ *   handler_start(char *type, char *notification_id) a queued notification is being handled
+ *   stage(char *name)                                 a request moves on to the next stage, as in --trace
+ *   handler_done(char *type)                          the notification has been handled (in the daemon, not srv)
+ *
+ * Probes are only compiled in when the SRV_ENABLE_USDT CMake option is on, which needs sys/sdt.h (systemtap-sdt-dev
+ * or systemtap-sdt-devel). Each one is then a single nop until a tracer attaches. Otherwise the macros expand to
+ * nothing and their arguments aren't evaluated, so arguments must not have side effects.
+ */
+
+#ifdef SRV_ENABLE_USDT
+#include <sys/sdt.h>
+#define usdt_probe1(provider, name, a) DTRACE_PROBE1(provider, name, a)
+#define usdt_probe2(provider, name, a, b) DTRACE_PROBE2(provider, name, a, b)
+#else
+#define usdt_probe1(provider, name, a)                                                                                 \
+  do {                                                                                                                 \
+  } while (0)
+#define usdt_probe2(provider, name, a, b)                                                                              \
+  do {                                                                                                                 \
+  } while (0)
+#endif
+
+#endif
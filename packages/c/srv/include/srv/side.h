@@ -4,6 +4,7 @@
 #include <netdb.h>
 #include <srv/params.h>
 #include <srv/srv.h>
+#include <srv/stats.h>
 
 /**
  * @brief input structure for the side_t type
@@ -22,7 +23,8 @@ typedef struct _side_hints_t {
  *
  * The first 5 parameters represent the predefined values that are set from the side_hints_t input.
  * is_side_a, is_server, host, port, and transformer.
- * The next 3 parameters are set dynamically during initialization.
+ * The next 4 parameters are set dynamically during initialization, stats being left NULL for the caller to point at
+ * a srv_session_stats_t if it wants the side's traffic counted.
  * The last 3 parameters are used to store server state.
  */
 typedef struct _side_t {
@@ -37,6 +39,7 @@ typedef struct _side_t {
   mbedtls_net_context socket; // NB: free this with mbedtls_net_free
   struct _side_t *other;
   int main_pipe[2];
+  srv_side_stats_t *stats;
 
   // Server state (null when is_server is false)
   mbedtls_net_context **connections;
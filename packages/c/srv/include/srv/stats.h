@@ -0,0 +1,179 @@
+#ifndef SRV_STATS_H
+#define SRV_STATS_H
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Per chunk forward latency buckets: bucket 0 counts chunks forwarded in under 1 us, bucket i those under 2^i us, and
+// the last bucket everything slower (over 4 s)
+#define SRV_LATENCY_BUCKETS 24
+
+// The signal which makes srv report on every live session
+#define SRV_STATS_SIGNAL SIGUSR1
+
+/**
+ * @brief Traffic through one side of a session, i.e. what it read from its socket and forwarded to the other side
+ *
+ * Only the side's own thread writes to it, with relaxed atomics, so a reporter can read it while traffic flows.
+ *
+ * @param bytes_in bytes read from this side's socket
+ * @param bytes_out bytes written to the other side's socket
+ * @param chunks reads which returned data, each one is transformed and forwarded as a chunk
+ * @param recv_calls calls to recv on this side's socket
+ * @param send_calls calls to send on the other side's socket, more than chunks when sends are short
+ * @param transform_ns time spent encrypting or decrypting chunks
+ * @param latency per chunk forward latency, from the read returning to the last byte being sent, see
+ * SRV_LATENCY_BUCKETS
+ */
+typedef struct _srv_side_stats {
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t chunks;
+  uint64_t recv_calls;
+  uint64_t send_calls;
+  uint64_t transform_ns;
+  uint64_t latency[SRV_LATENCY_BUCKETS];
+} srv_side_stats_t;
+
+/**
+ * @brief The traffic of one socket to socket session, registered so that it can be reported on demand
+ *
+ * @param id a number identifying the session within this srv process
+ * @param started_ns when the session started, see srv_stats_now_ns
+ * @param sides [0] is side a (the local host and port), [1] is side b (the rvd)
+ * @param next the next live session in the registry
+ */
+typedef struct _srv_session_stats {
+  uint64_t id;
+  int64_t started_ns;
+  srv_side_stats_t sides[2];
+  struct _srv_session_stats *next;
+} srv_session_stats_t;
+
+/**
+ * @brief A snapshot of a session's traffic, sent as a single datagram to the daemon which spawned srv
+ *
+ * Both ends are the same binary (srv is forked, not executed), so the struct is sent as is.
+ *
+ * @param pid the srv process the session belongs to
+ * @param session the session's id within that process
+ * @param closed true for the final report of a session, false for one made on demand
+ * @param duration_ns how long the session had been running
+ * @param sides as in srv_session_stats_t
+ */
+typedef struct _srv_stats_report {
+  pid_t pid;
+  uint64_t session;
+  bool closed;
+  int64_t duration_ns;
+  srv_side_stats_t sides[2];
+} srv_stats_report_t;
+
+/**
+ * @brief The monotonic clock in nanoseconds
+ */
+int64_t srv_stats_now_ns(void);
+
+/**
+ * @brief Count a recv call, and the chunk it returned if len > 0
+ */
+void srv_side_stats_received(srv_side_stats_t *stats, size_t len);
+
+/**
+ * @brief Count a send call which wrote len bytes
+ */
+void srv_side_stats_sent(srv_side_stats_t *stats, size_t len);
+
+/**
+ * @brief Add the time taken to transform a chunk
+ */
+void srv_side_stats_transformed(srv_side_stats_t *stats, int64_t elapsed_ns);
+
+/**
+ * @brief Record how long a chunk took to forward, from being read to being completely sent
+ */
+void srv_side_stats_forwarded(srv_side_stats_t *stats, int64_t elapsed_ns);
+
+/**
+ * @brief Copy stats which may still be being updated
+ *
+ * @param stats the stats to copy
+ * @param copy where to copy them to
+ */
+void srv_side_stats_snapshot(const srv_side_stats_t *stats, srv_side_stats_t *copy);
+
+/**
+ * @brief Estimate a quantile of the forward latency
+ *
+ * @param stats the stats, which should not be being updated (e.g. a snapshot)
+ * @param q the quantile, between 0 and 1
+ * @return int64_t the upper bound in us of the bucket the quantile falls in, 0 if no chunks were forwarded, or -1 if it
+ * falls in the last bucket, which has no upper bound
+ */
+int64_t srv_side_stats_quantile_us(const srv_side_stats_t *stats, double q);
+
+/**
+ * @brief Describe one side's traffic in a single line (without a newline), e.g. for logging
+ *
+ * @param stats the stats, which should not be being updated (e.g. a snapshot)
+ * @param buf the buffer to write to
+ * @param len the size of buf, the description is truncated to fit
+ * @return int the length of the full description, as snprintf
+ */
+int srv_side_stats_format(const srv_side_stats_t *stats, char *buf, size_t len);
+
+/**
+ * @brief Zero a session's stats and register it, so that it is included in on demand reports
+ *
+ * @param session the session, which must stay valid until srv_session_stats_finish
+ */
+void srv_session_stats_start(srv_session_stats_t *session);
+
+/**
+ * @brief Unregister a session and report its totals
+ *
+ * @param session the session
+ * @param report_fd a datagram socket to send the report to, or -1 to log it
+ */
+void srv_session_stats_finish(srv_session_stats_t *session, int report_fd);
+
+/**
+ * @brief Take a snapshot of a session as a report
+ *
+ * @param session the session
+ * @param closed whether this is the session's final report
+ * @param report the report to fill in
+ */
+void srv_session_stats_report(const srv_session_stats_t *session, bool closed, srv_stats_report_t *report);
+
+/**
+ * @brief Log a report at INFO level, one line per side
+ *
+ * @param tag the logger tag to log with
+ * @param report the report
+ */
+void srv_stats_log_report(const char *tag, const srv_stats_report_t *report);
+
+/**
+ * @brief Send a report without blocking, or raising SIGPIPE if the daemon has gone away
+ *
+ * @param fd a datagram socket connected to the daemon
+ * @param report the report
+ * @return int 0 on success, otherwise errno
+ */
+int srv_stats_send_report(int fd, const srv_stats_report_t *report);
+
+/**
+ * @brief Report on every live session whenever SRV_STATS_SIGNAL arrives
+ *
+ * Blocks SRV_STATS_SIGNAL in the calling thread and starts a thread which waits for it, so this must be called before
+ * any other threads are started, or they would take the signal's default action (terminating srv) instead.
+ *
+ * @param report_fd a datagram socket to send the reports to, or -1 to log them
+ * @return int 0 on success (or if already started), otherwise the error from pthread_create
+ */
+int srv_stats_start_reporter(int report_fd);
+
+#endif
@@ -0,0 +1,238 @@
+#include "srv/log.h"
+#include <atlogger/atlogger.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG "log sink"
+
+#if (LOG_SINK_SLOTS & (LOG_SINK_SLOTS - 1)) != 0
+#error "LOG_SINK_SLOTS must be a power of 2"
+#endif
+
+// A bounded multi-producer single-consumer ring (Vyukov's queue): each slot's sequence number says whose turn it is,
+// so producers only contend on a single compare-and-swap of enqueue_pos and never wait for the consumer
+typedef struct log_slot {
+  size_t sequence;
+  enum atlogger_logging_level level;
+  char tag[LOG_SINK_TAG_LEN];
+  char message[LOG_SINK_MESSAGE_LEN];
+} log_slot;
+
+static log_slot slots[LOG_SINK_SLOTS];
+static size_t enqueue_pos;
+static size_t dequeue_pos; // only touched by the flusher
+static uint64_t dropped;
+static bool running;
+static bool stopping;
+static pthread_t flusher;
+// The flusher blocks on wake while the ring is empty, producers only take wake_lock to signal it if it is idle
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static bool idle;
+static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+
+static void reset_ring(void) {
+  for (size_t i = 0; i < LOG_SINK_SLOTS; i++) {
+    __atomic_store_n(&slots[i].sequence, i, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&enqueue_pos, 0, __ATOMIC_RELAXED);
+  dequeue_pos = 0;
+}
+
+// The flusher thread doesn't survive fork(), so the child has to log synchronously (or start its own sink)
+static void after_fork_in_child(void) {
+  __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+  __atomic_store_n(&stopping, false, __ATOMIC_RELAXED);
+  __atomic_store_n(&idle, false, __ATOMIC_RELAXED);
+  // The parent's flusher may have held wake_lock at the time of the fork
+  pthread_mutex_init(&wake_lock, NULL);
+  pthread_cond_init(&wake, NULL);
+  reset_ring();
+}
+
+// Called after publishing a message. The fence pairs with the one in wait_for_messages: either the flusher sees the
+// message before it blocks, or we see it idle and wake it.
+static void wake_flusher(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&idle, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+  }
+}
+
+static bool has_message(void) {
+  const log_slot *slot = &slots[dequeue_pos & (LOG_SINK_SLOTS - 1)];
+  return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == dequeue_pos + 1;
+}
+
+// Blocks the flusher until a message is published or the sink is stopped
+static void wait_for_messages(void) {
+  pthread_mutex_lock(&wake_lock);
+  __atomic_store_n(&idle, true, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (!has_message() && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    pthread_cond_wait(&wake, &wake_lock);
+  }
+  __atomic_store_n(&idle, false, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&wake_lock);
+}
+
+// exit(1) on a fatal error anywhere should still write out the messages explaining it
+static void register_hooks(void) {
+  pthread_atfork(NULL, NULL, after_fork_in_child);
+  atexit(log_sink_stop);
+}
+
+// Returns false if the ring is full
+static bool enqueue(const char *tag, enum atlogger_logging_level level, const char *message, size_t message_len) {
+  size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+  log_slot *slot;
+  for (;;) {
+    slot = &slots[pos & (LOG_SINK_SLOTS - 1)];
+    size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      // on failure pos is reloaded with the current enqueue_pos
+      if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->level = level;
+  strncpy(slot->tag, tag, LOG_SINK_TAG_LEN - 1);
+  slot->tag[LOG_SINK_TAG_LEN - 1] = '\0';
+  memcpy(slot->message, message, message_len + 1);
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Writes out everything currently queued, returns the number of messages written
+static size_t drain(void) {
+  size_t written = 0;
+  for (;;) {
+    log_slot *slot = &slots[dequeue_pos & (LOG_SINK_SLOTS - 1)];
+    size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (sequence != dequeue_pos + 1) {
+      // empty, or the producer which owns the next slot hasn't finished copying into it yet
+      break;
+    }
+    atlogger_log(slot->tag, slot->level, "%s", slot->message);
+    __atomic_store_n(&slot->sequence, dequeue_pos + LOG_SINK_SLOTS, __ATOMIC_RELEASE);
+    dequeue_pos++;
+    written++;
+  }
+  return written;
+}
+
+static void *flush_loop(void *arg) {
+  (void)arg;
+  uint64_t reported_dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+
+  for (;;) {
+    bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+    size_t written = drain();
+
+    uint64_t now_dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (now_dropped != reported_dropped) {
+      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_WARN, "dropped %llu log messages (%llu in total)\n",
+                   (unsigned long long)(now_dropped - reported_dropped), (unsigned long long)now_dropped);
+      reported_dropped = now_dropped;
+      written++;
+    }
+
+    if (written > 0) {
+      // The data path used to fflush after every read, now only this thread ever waits for the console
+      fflush(stdout);
+      fflush(stderr);
+    }
+    if (stop) {
+      // stopping was set before this pass began, so everything logged before log_sink_stop has been written
+      break;
+    }
+    if (written == 0) {
+      wait_for_messages();
+    }
+  }
+  return NULL;
+}
+
+int log_sink_start(void) {
+  if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  pthread_once(&hooks_once, register_hooks);
+
+  reset_ring();
+  __atomic_store_n(&stopping, false, __ATOMIC_RELAXED);
+  int res = pthread_create(&flusher, NULL, flush_loop, NULL);
+  if (res != 0) {
+    atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to start the log flusher (%d), logging synchronously\n",
+                 res);
+    return res;
+  }
+  __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void log_sink_stop(void) {
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  // New messages go straight to atlogger from here on, the flusher drains what is already queued
+  __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&wake_lock);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&wake_lock);
+  pthread_join(flusher, NULL);
+  // Pick up anything from a producer which saw the sink running just before we stopped it
+  drain();
+  fflush(stdout);
+}
+
+void log_sink_log(const char *tag, enum atlogger_logging_level level, const char *format, ...) {
+  char message[LOG_SINK_MESSAGE_LEN];
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+
+  if ((size_t)len < sizeof(message)) {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+      atlogger_log(tag, level, "%s", message);
+    } else if (enqueue(tag, level, message, (size_t)len)) {
+      wake_flusher();
+    } else {
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+
+  // Too long for a slot (e.g. DEBUG dumps of whole envelopes), write it synchronously rather than lose the end of it
+  char *long_message = malloc((size_t)len + 1);
+  if (long_message == NULL) {
+    atlogger_log(tag, level, "%s...\n", message);
+    return;
+  }
+  va_start(args, format);
+  vsnprintf(long_message, (size_t)len + 1, format, args);
+  va_end(args);
+  atlogger_log(tag, level, "%s", long_message);
+  free(long_message);
+}
+
+uint64_t log_sink_dropped(void) { return __atomic_load_n(&dropped, __ATOMIC_RELAXED); }
@@ -1,4 +1,6 @@
+#include "srv/log.h"
 #include "srv/srv.h"
+#include "srv/stats.h"
 #include <atchops/base64.h>
 #include <atlogger/atlogger.h>
 #include <netdb.h>
@@ -19,11 +21,15 @@ int main(int argc, char **argv) {
   }
 
   atlogger_set_logging_level(INFO);
-  atlogger_log(TAG, INFO, "running srv\n");
+  // Before any other thread starts, so that they all leave SRV_STATS_SIGNAL to the reporter
+  srv_stats_start_reporter(params.stats_fd);
+  log_sink_start();
+  lazy_log(TAG, INFO, "running srv\n");
 
   // 3. Call the run function
   int res = run_srv(&params);
 
-  atlogger_log(TAG, INFO, "srv completing with code %d\n", res);
+  lazy_log(TAG, INFO, "srv completing with code %d\n", res);
+  log_sink_stop();
   return res;
 }
@@ -10,6 +10,7 @@ void apply_default_values_to_srv_params(srv_params_t *params) {
   params->multi = 0;
   params->rv_auth = 0;
   params->rv_e2ee = 0;
+  params->stats_fd = -1;
 }
 
 int parse_srv_params(srv_params_t *params, int argc, const char **argv, srv_env_t *environment) {
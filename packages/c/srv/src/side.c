@@ -1,4 +1,6 @@
 #include "srv/side.h"
+#include "srv/log.h"
+#include "srv/probes.h"
 #include "srv/srv.h"
 #include <atchops/base64.h>
 #include <atlogger/atlogger.h>
@@ -20,31 +22,32 @@ int srv_side_init(const side_hints_t *hints, side_t *side) {
   // this function set
   memcpy(side, hints, sizeof(side_hints_t));
   mbedtls_net_init(&side->socket);
+  side->stats = NULL;
 
   // Convert port to string
   char service[MAX_PORT_LEN];
   snprintf(service, MAX_PORT_LEN, "%d", side->port);
 
   if (side->is_server == 0) {
-    atlogger_log(TAG, INFO, "Doing tcp connect to %s:%s\n", side->host, service);
+    lazy_log(TAG, INFO, "Doing tcp connect to %s:%s\n", side->host, service);
     int res = mbedtls_net_connect(&side->socket, side->host, service, MBEDTLS_NET_PROTO_TCP);
     if (res != 0) {
       mbedtls_net_free(&side->socket);
       if (res == MBEDTLS_ERR_NET_SOCKET_FAILED) {
-        atlogger_log(TAG, ERROR, "Failed: tcp connect - socket failed\n");
+        lazy_log(TAG, ERROR, "Failed: tcp connect - socket failed\n");
       } else if (res == MBEDTLS_ERR_NET_UNKNOWN_HOST) {
-        atlogger_log(TAG, ERROR, "Failed: tcp connect - unknown host\n");
+        lazy_log(TAG, ERROR, "Failed: tcp connect - unknown host\n");
       } else if (res == MBEDTLS_ERR_NET_CONNECT_FAILED) {
-        atlogger_log(TAG, ERROR, "Failed: tcp connect - connect failed\n");
+        lazy_log(TAG, ERROR, "Failed: tcp connect - connect failed\n");
       }
       return res;
     }
   } else {
-    atlogger_log(TAG, INFO, "Doing tcp bind\n");
+    lazy_log(TAG, INFO, "Doing tcp bind\n");
     int res = mbedtls_net_bind(&side->socket, side->host, service, MBEDTLS_NET_PROTO_TCP);
     if (res != 0) {
       mbedtls_net_free(&side->socket);
-      atlogger_log(TAG, ERROR, "Failed: tcp bind\n");
+      lazy_log(TAG, ERROR, "Failed: tcp bind\n");
       return res;
     }
   }
@@ -76,24 +79,35 @@ void *srv_side_handle(void *side) {
   if (s->is_server == 0) {
     size_t len;
     int res;
+    int64_t received_ns = 0;
     while ((res = mbedtls_net_recv(&s->socket, buffer, READ_LEN)) > 0) {
+      usdt_probe2(srv, chunk_recv, s->is_side_a, res);
+      if (s->stats != NULL) {
+        received_ns = srv_stats_now_ns();
+        srv_side_stats_received(s->stats, (size_t)res);
+      }
       if (res < 0) {
-        atlogger_log(tag, ERROR, "Error reading data: %d", len);
+        lazy_log(tag, ERROR, "Error reading data: %d", len);
         break;
       } else {
         len = res;
       }
-      fflush(stdout);
       if (s->transformer != NULL) {
         output = malloc(BUFFER_LEN * sizeof(unsigned char));
         if (output == NULL) {
-          atlogger_log(tag, ERROR, "Error allocating memory for output: %d", len);
+          lazy_log(tag, ERROR, "Error allocating memory for output: %d", len);
           break;
         }
         memset(output, 0, BUFFER_LEN * sizeof(unsigned char));
+        int64_t transform_began_ns = s->stats != NULL ? srv_stats_now_ns() : 0;
+        usdt_probe2(srv, chunk_transform_start, s->is_side_a, (int)len);
         res = (int)s->transformer->transform(s->transformer, len, buffer, output);
+        usdt_probe2(srv, chunk_transform_done, s->is_side_a, res);
+        if (s->stats != NULL) {
+          srv_side_stats_transformed(s->stats, srv_stats_now_ns() - transform_began_ns);
+        }
         if (res != 0) {
-          atlogger_log(tag, ERROR, "Error decrypting buffer and storing in output: %d", len);
+          lazy_log(tag, ERROR, "Error decrypting buffer and storing in output: %d", len);
           free(output);
           break;
         }
@@ -105,18 +119,30 @@ void *srv_side_handle(void *side) {
       if (s->other->is_server == 0) {
         while (len > 0) {
           res = mbedtls_net_send(&s->other->socket, buffer, len);
+          usdt_probe2(srv, chunk_send, s->is_side_a, res);
           if (res < 0) {
-            atlogger_log(tag, ERROR, "Error sending data: %d", res);
+            lazy_log(tag, ERROR, "Error sending data: %d", res);
             break;
           } else {
             len -= res;
+            if (s->stats != NULL) {
+              srv_side_stats_sent(s->stats, (size_t)res);
+            }
           }
         }
+        usdt_probe2(srv, chunk_forwarded, s->is_side_a, (int)len);
+        if (s->stats != NULL) {
+          srv_side_stats_forwarded(s->stats, srv_stats_now_ns() - received_ns);
+        }
       } else {
         halt_if_cant_bind_local_port();
       }
       memset(buffer, 0, BUFFER_LEN * sizeof(unsigned char));
     }
+    if (s->stats != NULL && res <= 0) {
+      // the read which ended the loop
+      srv_side_stats_received(s->stats, 0);
+    }
     if (output)
       free(output);
     free(buffer);
@@ -125,7 +151,7 @@ void *srv_side_handle(void *side) {
   }
 
   // Notify the main thread that we are done so it will know to clean up
-  atlogger_log(tag, DEBUG, "Exiting side thread\n");
+  lazy_log(tag, DEBUG, "Exiting side thread\n");
   pthread_t t = pthread_self();
   write(s->main_pipe[1], &t, sizeof(pthread_t));
 
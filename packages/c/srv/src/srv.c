@@ -1,6 +1,9 @@
 #include "srv/srv.h"
+#include "srv/log.h"
 #include "srv/params.h"
+#include "srv/probes.h"
 #include "srv/side.h"
+#include "srv/stats.h"
 #include <atchops/base64.h>
 #include <atlogger/atlogger.h>
 #include <pthread.h>
@@ -28,7 +31,7 @@ int run_srv(srv_params_t *params) {
       res = run_srv_daemon_side_multi(params);
     }
   } else {
-    atlogger_log("srv - bind", ATLOGGER_LOGGING_LEVEL_ERROR, "--local-bind-port is disabled\n");
+    lazy_log("srv - bind", ATLOGGER_LOGGING_LEVEL_ERROR, "--local-bind-port is disabled\n");
     exit(1);
 
     // atlogger_log(TAG, INFO, "Starting server to socket srv\n");
@@ -58,11 +61,11 @@ int run_srv_daemon_side_single(srv_params_t *params) {
     res = create_encrypter_and_decrypter(params->session_aes_key_string, params->session_aes_iv_string, &encrypter,
                                          &decrypter);
     if (res != 0) {
-      atlogger_log(TAG, ERROR, "run_srv_daemon_side_single: Error creating new encrypter and decrypter: %d\n", res);
+      lazy_log(TAG, ERROR, "run_srv_daemon_side_single: Error creating new encrypter and decrypter: %d\n", res);
     }
   }
 
-  atlogger_log(TAG, INFO, "Starting socket to socket srv\n");
+  lazy_log(TAG, INFO, "Starting socket to socket srv\n");
   res = socket_to_socket(params, params->rvd_auth_string, &encrypter, &decrypter, false);
 
   if (params->rv_e2ee == 1) {
@@ -85,7 +88,7 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
     res = create_encrypter_and_decrypter(params->session_aes_key_string, params->session_aes_iv_string, &encrypter,
                                          &decrypter);
     if (res != 0) {
-      atlogger_log(TAG, ERROR, "run_srv_daemon_side_multi: Error creating new encrypter and decrypter: %d\n", res);
+      lazy_log(TAG, ERROR, "run_srv_daemon_side_multi: Error creating new encrypter and decrypter: %d\n", res);
     }
   }
 
@@ -98,27 +101,27 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
     hints_control.transformer = &decrypter;
   }
 
-  atlogger_log(TAG, INFO, "Initializing connection for control side\n");
+  lazy_log(TAG, INFO, "Initializing connection for control side\n");
   res = srv_side_init(&hints_control, &control_side);
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Failed to initialize connection for control side\n");
+    lazy_log(TAG, ERROR, "Failed to initialize connection for control side\n");
     return res;
   }
 
   // send the auth string to the other side
   if (params->rv_auth == 1) {
-    atlogger_log(TAG, DEBUG, "Sending auth string: %s\n", (unsigned char *)params->rvd_auth_string);
+    lazy_log(TAG, DEBUG, "Sending auth string: %s\n", (unsigned char *)params->rvd_auth_string);
     int len = strlen(params->rvd_auth_string);
 
     int slen = mbedtls_net_send(&control_side.socket, (unsigned char *)params->rvd_auth_string, len);
     slen += mbedtls_net_send(&control_side.socket, (unsigned char *)"\n", 1);
     if (slen != len + 1) {
-      atlogger_log(TAG, ERROR, "Failed to send auth string\n");
+      lazy_log(TAG, ERROR, "Failed to send auth string\n");
       return -1;
     }
   }
 
-  atlogger_log(TAG, INFO, "Starting recv loop\n");
+  lazy_log(TAG, INFO, "Starting recv loop\n");
 
   // signal to sshnpd that we are done
   fprintf(stderr, "%s\n", SRV_COMPLETION_STRING);
@@ -132,8 +135,9 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
 
   size_t len;
   while ((res = mbedtls_net_recv(&control_side.socket, buffer, 4096)) > 0) {
+    usdt_probe1(srv, control_recv, res);
     if (res < 0) {
-      atlogger_log("srv - control (side b)", ERROR, "Error reading data: %d", len);
+      lazy_log("srv - control (side b)", ERROR, "Error reading data: %d", len);
       goto exit;
     } else {
       len = res;
@@ -156,13 +160,13 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
 
     char *messagetype = NULL, *new_session_aes_key_string = NULL, *new_session_aes_iv_string = NULL;
 
-    atlogger_log(TAG, INFO, "requests buffer is: %s\n", buffer);
+    lazy_log(TAG, DEBUG, "requests buffer is: %s\n", buffer);
 
     // First, check if the buffer contains just one or more requests
     size_t nrequests = 0;
     res = process_multiple_requests((char *)buffer, &requests, &nrequests);
     if (res != 0) {
-      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Failed to find any request from: %s\n", buffer);
+      lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Failed to find any request from: %s\n", buffer);
       goto exit;
     }
 
@@ -170,33 +174,34 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
       // Now process each of those requests
       res = parse_control_message(requests[i], &messagetype, &new_session_aes_key_string, &new_session_aes_iv_string);
       if (res != 0) {
-        atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Failed to find request type, aes key and/or iv from: %s\n",
-                     requests[i]);
+        lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Failed to find request type, aes key and/or iv from: %s\n",
+                 requests[i]);
         goto exit;
       }
-      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "\tRECV: %s:%s:%s\n", messagetype, new_session_aes_key_string,
-                   new_session_aes_iv_string);
+      lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "\tRECV: %s:%s:%s\n", messagetype, new_session_aes_key_string,
+               new_session_aes_iv_string);
+      usdt_probe1(srv, control_message, messagetype);
 
       if (strcmp(messagetype, "connect") == 0) {
         chunked_transformer_t *new_socket_encrypter = malloc(sizeof(chunked_transformer_t));
         chunked_transformer_t *new_socket_decrypter = malloc(sizeof(chunked_transformer_t));
         if (new_socket_encrypter == NULL || new_socket_decrypter == NULL) {
-          atlogger_log(TAG, ERROR, "Failed to allocate memory for new enc/dec\n");
+          lazy_log(TAG, ERROR, "Failed to allocate memory for new enc/dec\n");
           free(new_socket_encrypter);
           free(new_socket_decrypter);
           goto exit;
         }
-        atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG,
-                     "run_srv_daemon_side_multi\n Control socket received %s request - \n creating new socketToSocket "
-                     "connection\n",
-                     messagetype);
+        lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG,
+                 "run_srv_daemon_side_multi\n Control socket received %s request - \n creating new socketToSocket "
+                 "connection\n",
+                 messagetype);
 
         bool no_encrypt =
             strcmp(new_session_aes_key_string, "no") == 0 && strcmp("new_session_aes_iv_string", "encrypt") == 0;
         if (no_encrypt) {
-          atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_WARN,
-                       "Socket connector requested no encryption!\n\tOnly disable encryption if you know what you "
-                       "are doing!\n");
+          lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_WARN,
+                   "Socket connector requested no encryption!\n\tOnly disable encryption if you know what you "
+                   "are doing!\n");
         }
 
         if (!no_encrypt) {
@@ -204,12 +209,12 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
           res = create_encrypter_and_decrypter(new_session_aes_key_string, new_session_aes_iv_string,
                                                new_socket_encrypter, new_socket_decrypter);
         }
-        atlogger_log(TAG, INFO, "Starting socket to socket srv\n");
+        lazy_log(TAG, INFO, "Starting socket to socket srv\n");
 
         pthread_t sts_thread;
         socket_to_socket_params_t *sts_thread_params = malloc(sizeof(socket_to_socket_params_t));
         if (sts_thread_params == NULL) {
-          atlogger_log(TAG, ERROR, "Failed to allocate memory for thread parameters\n");
+          lazy_log(TAG, ERROR, "Failed to allocate memory for thread parameters\n");
           if (!no_encrypt) {
             free(new_socket_encrypter);
             free(new_socket_decrypter);
@@ -225,7 +230,7 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
 
         res = pthread_create(&sts_thread, NULL, run_socket_to_socket, (void *)sts_thread_params);
         if (res != 0) {
-          atlogger_log(TAG, ERROR, "Failed to create thread: %d\n", res);
+          lazy_log(TAG, ERROR, "Failed to create thread: %d\n", res);
           if (!no_encrypt) {
             free(new_socket_encrypter);
             free(new_socket_decrypter);
@@ -237,7 +242,7 @@ int run_srv_daemon_side_multi(srv_params_t *params) {
         pthread_detach(sts_thread);
 
       } else {
-        atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Unknown request to control socket: %s\n", requests[i]);
+        lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Unknown request to control socket: %s\n", requests[i]);
       }
     }
     // Clean buffer for next iteration and free previous requests
@@ -268,52 +273,58 @@ int socket_to_socket(const srv_params_t *params, const char *auth_string, chunke
     hints_a.transformer = encrypter;
     hints_b.transformer = decrypter;
   }
-  atlogger_log(TAG, INFO, "Initializing connection for side a\n");
+  lazy_log(TAG, INFO, "Initializing connection for side a\n");
   int res = srv_side_init(&hints_a, &sides[0]);
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Failed to initialize connection for side a\n");
+    lazy_log(TAG, ERROR, "Failed to initialize connection for side a\n");
     return res;
   }
 
-  atlogger_log(TAG, INFO, "Initializing connection for side b\n");
+  lazy_log(TAG, INFO, "Initializing connection for side b\n");
   res = srv_side_init(&hints_b, &sides[1]);
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Failed to initialize connection for side b\n");
+    lazy_log(TAG, ERROR, "Failed to initialize connection for side b\n");
     return res;
   }
 
   int fds[2], tidx;
   int exit_res = 0;
   pthread_t threads[2], tid;
+  srv_session_stats_t stats;
   bool cancel_first = false;
   pipe(fds);
 
   srv_link_sides(&sides[0], &sides[1], fds);
 
-  atlogger_log(TAG, INFO, "Starting threads\n");
+  lazy_log(TAG, INFO, "Starting threads\n");
   // send the auth string to side b
   if (params->rv_auth == 1) {
-    atlogger_log(TAG, INFO, "Sending auth string\n");
+    lazy_log(TAG, INFO, "Sending auth string\n");
     int len = strlen(auth_string);
 
     int slen = mbedtls_net_send(&sides[1].socket, (unsigned char *)auth_string, len);
     slen += mbedtls_net_send(&sides[1].socket, (unsigned char *)"\n", 1);
     if (slen != len + 1) {
-      atlogger_log(TAG, ERROR, "Failed to send auth string\n");
+      lazy_log(TAG, ERROR, "Failed to send auth string\n");
       return -1;
     }
   }
 
+  srv_session_stats_start(&stats);
+  sides[0].stats = &stats.sides[0];
+  sides[1].stats = &stats.sides[1];
+  usdt_probe1(srv, session_open, stats.id);
+
   res = pthread_create(&threads[0], NULL, srv_side_handle, &sides[0]);
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Failed to create thread: 0\n");
+    lazy_log(TAG, ERROR, "Failed to create thread: 0\n");
     exit_res = res;
     goto exit;
   }
 
   res = pthread_create(&threads[1], NULL, srv_side_handle, &sides[1]);
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Failed to create thread: 1\n");
+    lazy_log(TAG, ERROR, "Failed to create thread: 1\n");
     cancel_first = true;
     exit_res = res;
     goto cancel;
@@ -331,7 +342,7 @@ int socket_to_socket(const srv_params_t *params, const char *auth_string, chunke
   // Wait for any pthread to exit
   read(fds[0], &tid, sizeof(pthread_t));
 
-  atlogger_log(TAG, DEBUG, "Joining exited thread\n");
+  lazy_log(TAG, DEBUG, "Joining exited thread\n");
 
   // When a thread exits, join it.
   res = pthread_join(tid, (void *)&retval);
@@ -347,16 +358,18 @@ cancel:
   }
 
   // Then cancel the other thread
-  atlogger_log(TAG, DEBUG, "Cancelling remaining open thread: %d\n", tidx);
+  lazy_log(TAG, DEBUG, "Cancelling remaining open thread: %d\n", tidx);
   if (pthread_cancel(threads[tidx]) != 0) {
-    atlogger_log(TAG, WARN, "Failed to cancel thread: %d\n", tidx);
+    lazy_log(TAG, WARN, "Failed to cancel thread: %d\n", tidx);
   } else {
-    atlogger_log(TAG, DEBUG, "Canceled thread: %d\n", tidx);
+    lazy_log(TAG, DEBUG, "Canceled thread: %d\n", tidx);
   }
 
 exit:
   close(fds[0]);
   close(fds[1]);
+  usdt_probe1(srv, session_close, stats.id);
+  srv_session_stats_finish(&stats, params->stats_fd);
 
   if (params->rv_e2ee == 1) {
     mbedtls_aes_free(&encrypter->aes_ctr.ctx);
@@ -381,7 +394,7 @@ int server_to_socket(const srv_params_t *params, const char *auth_string, chunke
 int create_encrypter_and_decrypter(const char *session_aes_key_string, const char *session_aes_iv_string,
                                    chunked_transformer_t *encrypter, chunked_transformer_t *decrypter) {
   int res = 0;
-  atlogger_log(TAG, INFO, "Configuring encrypter/decrypter for srv\n");
+  lazy_log(TAG, INFO, "Configuring encrypter/decrypter for srv\n");
 
   // Temporary buffer for decoding the key
   unsigned char aes_key[AES_256_KEY_BYTES];
@@ -392,14 +405,14 @@ int create_encrypter_and_decrypter(const char *session_aes_key_string, const cha
                               AES_256_KEY_BYTES, &aes_key_len);
 
   if (res != 0 || aes_key_len != AES_256_KEY_BYTES) {
-    atlogger_log(TAG, ERROR, "Error decoding session_aes_key_string\n");
+    lazy_log(TAG, ERROR, "Error decoding session_aes_key_string\n");
     return res;
   }
 
   mbedtls_aes_init(&encrypter->aes_ctr.ctx); // FREE
   res = mbedtls_aes_setkey_enc(&encrypter->aes_ctr.ctx, aes_key, AES_256_KEY_BITS);
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Error setting encryption key\n");
+    lazy_log(TAG, ERROR, "Error setting encryption key\n");
     mbedtls_aes_free(&encrypter->aes_ctr.ctx);
     return res;
   }
@@ -407,7 +420,7 @@ int create_encrypter_and_decrypter(const char *session_aes_key_string, const cha
   mbedtls_aes_init(&decrypter->aes_ctr.ctx); // FREE
   res = mbedtls_aes_setkey_enc(&decrypter->aes_ctr.ctx, aes_key, AES_256_KEY_BITS);
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Error setting decryption key\n");
+    lazy_log(TAG, ERROR, "Error setting decryption key\n");
     mbedtls_aes_free(&encrypter->aes_ctr.ctx);
     mbedtls_aes_free(&decrypter->aes_ctr.ctx);
     return res;
@@ -418,7 +431,7 @@ int create_encrypter_and_decrypter(const char *session_aes_key_string, const cha
   res = atchops_base64_decode((unsigned char *)session_aes_iv_string, strlen(session_aes_iv_string),
                               encrypter->aes_ctr.nonce_counter, AES_BLOCK_LEN, &iv_len);
   if (res != 0 || iv_len != AES_BLOCK_LEN) {
-    atlogger_log(TAG, ERROR, "Error decoding session_aes_iv_string\n");
+    lazy_log(TAG, ERROR, "Error decoding session_aes_iv_string\n");
     mbedtls_aes_free(&encrypter->aes_ctr.ctx);
     mbedtls_aes_free(&decrypter->aes_ctr.ctx);
     return res;
@@ -452,7 +465,7 @@ int aes_ctr_crypt_stream(const chunked_transformer_t *self, size_t len, const un
       mbedtls_aes_crypt_ctr(&state->ctx, len, &state->nc_off, state->nonce_counter, state->stream_block, input, output);
 
   if (res != 0) {
-    atlogger_log(TAG, ERROR, "Failed to crypt chunk\n");
+    lazy_log(TAG, ERROR, "Failed to crypt chunk\n");
     return res;
   }
 
@@ -471,7 +484,7 @@ static int process_multiple_requests(char *original, char **requests[], size_t *
     // realloc memory to save a new pointer
     temp_requests = realloc(temp_requests, (temp_count + 1) * sizeof(char *));
     if (!temp_requests) {
-      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "process_multiple_requests: Failed to allocate memory\n");
+      lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "process_multiple_requests: Failed to allocate memory\n");
       goto exit;
     }
 
@@ -510,7 +523,7 @@ static int parse_control_message(char *original, char **message_type, char **new
   for (int i = 0; i < 3; i++) {
     temp = strtok_r(saveptr, ":", &saveptr);
     if (temp == NULL) {
-      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to parse message type\n");
+      lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to parse message type\n");
       goto exit;
     }
     if (i == 0)
@@ -0,0 +1,231 @@
+#include "srv/stats.h"
+#include "srv/log.h"
+#include <atlogger/atlogger.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TAG "srv - stats"
+
+// A daemon which has gone away mustn't take srv down with SIGPIPE, where there is no MSG_NOSIGNAL the daemon sets
+// SO_NOSIGPIPE on the socket instead
+#ifdef MSG_NOSIGNAL
+#define STATS_SEND_FLAGS (MSG_NOSIGNAL | MSG_DONTWAIT)
+#else
+#define STATS_SEND_FLAGS MSG_DONTWAIT
+#endif
+
+// The live sessions, for on demand reports
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static srv_session_stats_t *registry;
+static uint64_t next_session_id;
+
+static bool reporter_started;
+static int reporter_fd = -1;
+
+static void *reporter_loop(void *arg);
+static void add(uint64_t *counter, uint64_t n);
+
+int64_t srv_stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void srv_side_stats_received(srv_side_stats_t *stats, size_t len) {
+  add(&stats->recv_calls, 1);
+  if (len > 0) {
+    add(&stats->chunks, 1);
+    add(&stats->bytes_in, len);
+  }
+}
+
+void srv_side_stats_sent(srv_side_stats_t *stats, size_t len) {
+  add(&stats->send_calls, 1);
+  add(&stats->bytes_out, len);
+}
+
+void srv_side_stats_transformed(srv_side_stats_t *stats, int64_t elapsed_ns) {
+  add(&stats->transform_ns, elapsed_ns > 0 ? (uint64_t)elapsed_ns : 0);
+}
+
+void srv_side_stats_forwarded(srv_side_stats_t *stats, int64_t elapsed_ns) {
+  // The bucket is the bit length of the latency in us
+  uint64_t us = elapsed_ns > 0 ? (uint64_t)elapsed_ns / 1000 : 0;
+  size_t bucket = 0;
+  while (us > 0 && bucket < SRV_LATENCY_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  add(&stats->latency[bucket], 1);
+}
+
+void srv_side_stats_snapshot(const srv_side_stats_t *stats, srv_side_stats_t *copy) {
+  copy->bytes_in = __atomic_load_n(&stats->bytes_in, __ATOMIC_RELAXED);
+  copy->bytes_out = __atomic_load_n(&stats->bytes_out, __ATOMIC_RELAXED);
+  copy->chunks = __atomic_load_n(&stats->chunks, __ATOMIC_RELAXED);
+  copy->recv_calls = __atomic_load_n(&stats->recv_calls, __ATOMIC_RELAXED);
+  copy->send_calls = __atomic_load_n(&stats->send_calls, __ATOMIC_RELAXED);
+  copy->transform_ns = __atomic_load_n(&stats->transform_ns, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < SRV_LATENCY_BUCKETS; i++) {
+    copy->latency[i] = __atomic_load_n(&stats->latency[i], __ATOMIC_RELAXED);
+  }
+}
+
+int64_t srv_side_stats_quantile_us(const srv_side_stats_t *stats, double q) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < SRV_LATENCY_BUCKETS; i++) {
+    total += stats->latency[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  // The rank of the quantile, rounded up
+  uint64_t rank = (uint64_t)(q * (double)total);
+  if ((double)rank < q * (double)total) {
+    rank++;
+  }
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < SRV_LATENCY_BUCKETS - 1; i++) {
+    seen += stats->latency[i];
+    if (seen >= rank) {
+      return (int64_t)1 << i;
+    }
+  }
+  return -1;
+}
+
+int srv_side_stats_format(const srv_side_stats_t *stats, char *buf, size_t len) {
+  char quantiles[3][24];
+  const double qs[3] = {0.5, 0.99, 1.0};
+  for (size_t i = 0; i < 3; i++) {
+    int64_t us = srv_side_stats_quantile_us(stats, qs[i]);
+    if (us < 0) {
+      snprintf(quantiles[i], sizeof(quantiles[i]), ">%lld us", (long long)1 << (SRV_LATENCY_BUCKETS - 2));
+    } else {
+      snprintf(quantiles[i], sizeof(quantiles[i]), "<%lld us", (long long)us);
+    }
+  }
+  return snprintf(buf, len,
+                  "%llu bytes in, %llu bytes out, %llu chunks, %llu recv and %llu send calls, %.2f ms transforming, "
+                  "forward latency p50 %s p99 %s max %s",
+                  (unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out,
+                  (unsigned long long)stats->chunks, (unsigned long long)stats->recv_calls,
+                  (unsigned long long)stats->send_calls, stats->transform_ns / 1e6, quantiles[0], quantiles[1],
+                  quantiles[2]);
+}
+
+void srv_session_stats_start(srv_session_stats_t *session) {
+  memset(session, 0, sizeof(srv_session_stats_t));
+  session->started_ns = srv_stats_now_ns();
+
+  pthread_mutex_lock(&registry_lock);
+  session->id = ++next_session_id;
+  session->next = registry;
+  registry = session;
+  pthread_mutex_unlock(&registry_lock);
+}
+
+void srv_session_stats_finish(srv_session_stats_t *session, int report_fd) {
+  pthread_mutex_lock(&registry_lock);
+  for (srv_session_stats_t **p = &registry; *p != NULL; p = &(*p)->next) {
+    if (*p == session) {
+      *p = session->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+
+  srv_stats_report_t report;
+  srv_session_stats_report(session, true, &report);
+  if (report_fd < 0 || srv_stats_send_report(report_fd, &report) != 0) {
+    srv_stats_log_report(TAG, &report);
+  }
+}
+
+void srv_session_stats_report(const srv_session_stats_t *session, bool closed, srv_stats_report_t *report) {
+  memset(report, 0, sizeof(srv_stats_report_t));
+  report->pid = getpid();
+  report->session = session->id;
+  report->closed = closed;
+  report->duration_ns = srv_stats_now_ns() - session->started_ns;
+  srv_side_stats_snapshot(&session->sides[0], &report->sides[0]);
+  srv_side_stats_snapshot(&session->sides[1], &report->sides[1]);
+}
+
+void srv_stats_log_report(const char *tag, const srv_stats_report_t *report) {
+  if (!log_enabled(ATLOGGER_LOGGING_LEVEL_INFO)) {
+    return;
+  }
+  char line[320];
+  lazy_log(tag, ATLOGGER_LOGGING_LEVEL_INFO, "srv %d session %llu %s after %.1f s\n", (int)report->pid,
+           (unsigned long long)report->session, report->closed ? "closed" : "running", report->duration_ns / 1e9);
+  srv_side_stats_format(&report->sides[0], line, sizeof(line));
+  lazy_log(tag, ATLOGGER_LOGGING_LEVEL_INFO, "  local to rvd: %s\n", line);
+  srv_side_stats_format(&report->sides[1], line, sizeof(line));
+  lazy_log(tag, ATLOGGER_LOGGING_LEVEL_INFO, "  rvd to local: %s\n", line);
+}
+
+int srv_stats_send_report(int fd, const srv_stats_report_t *report) {
+  if (send(fd, report, sizeof(srv_stats_report_t), STATS_SEND_FLAGS) < 0) {
+    return errno;
+  }
+  return 0;
+}
+
+int srv_stats_start_reporter(int report_fd) {
+  if (reporter_started) {
+    return 0;
+  }
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SRV_STATS_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  reporter_fd = report_fd;
+  pthread_t thread;
+  int res = pthread_create(&thread, NULL, reporter_loop, NULL);
+  if (res != 0) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to start the stats reporter (%d)\n", res);
+    return res;
+  }
+  pthread_detach(thread);
+  reporter_started = true;
+  return 0;
+}
+
+static void *reporter_loop(void *arg) {
+  (void)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SRV_STATS_SIGNAL);
+
+  for (;;) {
+    int sig;
+    if (sigwait(&set, &sig) != 0) {
+      continue;
+    }
+    // Reports are taken under the lock, so a session can't finish (and go out of scope) while it is being read
+    pthread_mutex_lock(&registry_lock);
+    for (srv_session_stats_t *session = registry; session != NULL; session = session->next) {
+      srv_stats_report_t report;
+      srv_session_stats_report(session, false, &report);
+      if (reporter_fd < 0 || srv_stats_send_report(reporter_fd, &report) != 0) {
+        srv_stats_log_report(TAG, &report);
+      }
+    }
+    pthread_mutex_unlock(&registry_lock);
+  }
+  return NULL;
+}
+
+// Each counter only has one writer, the atomic just keeps concurrent snapshots from reading torn values
+static void add(uint64_t *counter, uint64_t n) { __atomic_fetch_add(counter, n, __ATOMIC_RELAXED); }
@@ -0,0 +1,165 @@
+#include <srv/stats.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int counters_test();
+int latency_buckets_test();
+int quantile_test();
+int format_test();
+int report_test();
+
+int main() {
+  int ret = 0;
+
+  if (counters_test()) {
+    printf("counters test failed\n");
+    ret++;
+  }
+  if (latency_buckets_test()) {
+    printf("latency buckets test failed\n");
+    ret++;
+  }
+  if (quantile_test()) {
+    printf("quantile test failed\n");
+    ret++;
+  }
+  if (format_test()) {
+    printf("format test failed\n");
+    ret++;
+  }
+  if (report_test()) {
+    printf("report test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+// a short send counts as another send call, and the read which hits EOF as a recv call without a chunk
+int counters_test() {
+  srv_side_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  srv_side_stats_received(&stats, 64);
+  srv_side_stats_sent(&stats, 40);
+  srv_side_stats_sent(&stats, 24);
+  srv_side_stats_transformed(&stats, 1500);
+  srv_side_stats_received(&stats, 0);
+
+  if (stats.bytes_in != 64 || stats.bytes_out != 64 || stats.chunks != 1) {
+    return 1;
+  }
+  if (stats.recv_calls != 2 || stats.send_calls != 2 || stats.transform_ns != 1500) {
+    return 1;
+  }
+  return 0;
+}
+
+int latency_buckets_test() {
+  srv_side_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  srv_side_stats_forwarded(&stats, 999);                 // under 1 us
+  srv_side_stats_forwarded(&stats, 1000);                // 1 us
+  srv_side_stats_forwarded(&stats, 3000);                // 3 us, under 4 us
+  srv_side_stats_forwarded(&stats, 60LL * 1000000000LL); // a minute, past the last bound
+
+  if (stats.latency[0] != 1 || stats.latency[1] != 1 || stats.latency[2] != 1) {
+    return 1;
+  }
+  if (stats.latency[SRV_LATENCY_BUCKETS - 1] != 1) {
+    return 1;
+  }
+  return 0;
+}
+
+int quantile_test() {
+  srv_side_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  if (srv_side_stats_quantile_us(&stats, 0.5) != 0) {
+    return 1;
+  }
+  // 99 chunks under 16 us, one under 1024 us
+  for (int i = 0; i < 99; i++) {
+    srv_side_stats_forwarded(&stats, 10000);
+  }
+  srv_side_stats_forwarded(&stats, 1000000);
+
+  if (srv_side_stats_quantile_us(&stats, 0.5) != 16 || srv_side_stats_quantile_us(&stats, 0.99) != 16) {
+    return 1;
+  }
+  if (srv_side_stats_quantile_us(&stats, 1.0) != 1024) {
+    return 1;
+  }
+  srv_side_stats_forwarded(&stats, 60LL * 1000000000LL);
+  if (srv_side_stats_quantile_us(&stats, 1.0) != -1) {
+    return 1;
+  }
+  return 0;
+}
+
+int format_test() {
+  srv_side_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  srv_side_stats_received(&stats, 100);
+  srv_side_stats_sent(&stats, 100);
+  srv_side_stats_forwarded(&stats, 10000);
+
+  char line[320];
+  int len = srv_side_stats_format(&stats, line, sizeof(line));
+  if (len <= 0 || (size_t)len >= sizeof(line)) {
+    return 1;
+  }
+  if (strstr(line, "100 bytes in, 100 bytes out, 1 chunks") == NULL || strstr(line, "p50 <16 us") == NULL) {
+    printf("%s\n", line);
+    return 1;
+  }
+  // truncated, but still terminated
+  char short_line[16];
+  if (srv_side_stats_format(&stats, short_line, sizeof(short_line)) != len || strlen(short_line) != 15) {
+    return 1;
+  }
+  return 0;
+}
+
+// a finished session is sent whole as one datagram, and sessions get distinct ids
+int report_test() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0) {
+    return 1;
+  }
+  int ret = 1;
+
+  srv_session_stats_t first, second;
+  srv_session_stats_start(&first);
+  srv_session_stats_start(&second);
+  if (first.id == second.id) {
+    goto exit;
+  }
+  srv_side_stats_received(&first.sides[0], 10);
+  srv_side_stats_sent(&first.sides[0], 10);
+  srv_side_stats_received(&first.sides[1], 20);
+  srv_side_stats_sent(&first.sides[1], 20);
+  srv_session_stats_finish(&first, fds[1]);
+  srv_session_stats_finish(&second, fds[1]);
+
+  srv_stats_report_t report;
+  if (recv(fds[0], &report, sizeof(report), 0) != sizeof(report)) {
+    goto exit;
+  }
+  if (report.pid != getpid() || report.session != first.id || !report.closed || report.duration_ns < 0) {
+    goto exit;
+  }
+  if (report.sides[0].bytes_out != 10 || report.sides[1].bytes_out != 20) {
+    goto exit;
+  }
+  if (recv(fds[0], &report, sizeof(report), 0) != sizeof(report) || report.session != second.id) {
+    goto exit;
+  }
+  ret = 0;
+exit:
+  close(fds[0]);
+  close(fds[1]);
+  return ret;
+}
@@ -0,0 +1,42 @@
+#ifndef ADDRESS_CACHE_H
+#define ADDRESS_CACHE_H
+
+#include <time.h>
+
+// How long a cached atServer address is trusted without looking it up again first
+#define ATSERVER_ADDRESS_CACHE_TTL_SECONDS (24 * 60 * 60)
+
+/**
+ * @brief Read the atServer address cached for atsign under storage_path
+ *
+ * The cache is a single line, "host port stored_at", in <storage_path>/<atsign>.atserver_address.
+ *
+ * @param storage_path the directory given by --storage-path
+ * @param atsign the atsign the address belongs to
+ * @param host set to the cached host, which the caller must free
+ * @param port set to the cached port
+ * @param stored_at set to when the address was cached, so the caller can decide whether it is fresh enough
+ * @return int 0 on success, non-zero if there is no (valid) cached address
+ */
+int atserver_address_cache_load(const char *storage_path, const char *atsign, char **host, int *port,
+                                time_t *stored_at);
+
+/**
+ * @brief Atomically replace the atServer address cached for atsign, creating storage_path if needed
+ *
+ * @param storage_path the directory given by --storage-path
+ * @param atsign the atsign the address belongs to
+ * @param host the atServer host
+ * @param port the atServer port
+ * @param now the time to record the address as cached at
+ * @return int 0 on success, non-zero on error
+ */
+int atserver_address_cache_store(const char *storage_path, const char *atsign, const char *host, int port,
+                                 time_t now);
+
+/**
+ * @brief Forget the atServer address cached for atsign, e.g. once it turns out to be wrong
+ */
+void atserver_address_cache_remove(const char *storage_path, const char *atsign);
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef ATCLIENT_POOL_H
+#define ATCLIENT_POOL_H
+
+#include "sshnpd/backoff.h"
+#include "sshnpd/contention.h"
+#include <atclient/atclient.h>
+#include <atclient/atkeys.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A fixed size pool of independently PKAM authenticated worker atclients
+ *
+ * Each atclient is owned by at most one thread at a time. Callers check a client out, talk to the atServer with it,
+ * and check it back in, so concurrent handlers no longer serialize on a single connection.
+ *
+ * @param clients the atclient connections owned by the pool
+ * @param in_use whether clients[i] is currently checked out
+ * @param size the number of clients in the pool
+ * @param lock protects in_use, backoffs and retry_at
+ * @param available signalled whenever a client is checked back in
+ * @param backoffs the reconnect backoff of clients[i], only updated by whoever has clients[i] checked out
+ * @param retry_at the monotonic time in ms before which clients[i] isn't reconnected or checked out
+ * @param checked_out_at the monotonic time in us at which clients[i] was checked out, for the hold time metric
+ * @param held_by the contention site index of whoever has clients[i] checked out
+ * @param contention wait and hold times per call site, protected by lock
+ * @param report_at the monotonic time in ms at which the maintainer next logs and resets contention
+ * @param atsign the atsign used to (re)authenticate each client
+ * @param atkeys the atkeys used to (re)authenticate each client
+ * @param auth_options the atServer address to (re)authenticate against, saves a root server lookup per connection. A
+ * client whose last reconnect failed asks the root server instead, in case the atServer has moved
+ * @param maintainer a background thread which reconnects idle clients, so requests don't pay for PKAM
+ * @param wake signalled to stop the maintainer
+ * @param running false once atclient_pool_free has been called
+ */
+typedef struct _atclient_pool {
+  atclient *clients;
+  bool *in_use;
+  size_t size;
+
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+
+  backoff *backoffs;
+  int64_t *retry_at;
+  int64_t *checked_out_at;
+  size_t *held_by;
+  contention_stats contention;
+  int64_t report_at;
+
+  const char *atsign;
+  const atclient_atkeys *atkeys;
+  atclient_authenticate_options *auth_options;
+
+  pthread_t maintainer;
+  pthread_cond_t wake;
+  bool running;
+} atclient_pool;
+
+// How often the maintainer checks the idle clients
+#define ATCLIENT_POOL_MAINTENANCE_INTERVAL_MS 30000
+// How often the maintainer logs which call sites held the pool connections the longest
+#define ATCLIENT_POOL_REPORT_INTERVAL_MS (5 * 60 * 1000)
+// Checkouts held for longer than this are warned about, they keep requests waiting for a connection
+#define ATCLIENT_POOL_LONG_HOLD_MS 2000
+// Reconnect backoff bounds for each client
+#define ATCLIENT_POOL_BACKOFF_BASE_MS 1000
+#define ATCLIENT_POOL_BACKOFF_MAX_MS 60000
+
+/**
+ * @brief Initialize the pool, PKAM authenticate every client in it, and start the maintainer thread
+ *
+ * @param pool the pool to initialize
+ * @param size the number of atclient connections to open
+ * @param atsign the atsign to authenticate as (must outlive the pool)
+ * @param atkeys the atkeys to authenticate with (must outlive the pool)
+ * @param auth_options where to find the atServer, or NULL to look it up every time (must outlive the pool)
+ * @return int 0 on success, non-zero on error (the pool is left uninitialized on error)
+ */
+int atclient_pool_init(atclient_pool *pool, size_t size, const char *atsign, const atclient_atkeys *atkeys,
+                       atclient_authenticate_options *auth_options);
+
+/**
+ * @brief Change the atServer address which clients reconnect to, e.g. after the atServer has moved
+ *
+ * @param pool the pool
+ * @param auth_options the new address, or NULL to look it up every time (must outlive the pool, and so must the
+ * previous one, as a reconnect on another thread may still be using it)
+ */
+void atclient_pool_set_auth_options(atclient_pool *pool, atclient_authenticate_options *auth_options);
+
+/**
+ * @brief Check out any free client, blocking until one becomes available
+ *
+ * The client is reconnected first if its connection has dropped. Clients backing off after a failed reconnect are
+ * skipped, they are left to the maintainer, and if every free client is backing off this fails straight away rather
+ * than blocking the caller on a PKAM attempt. How long the caller waited, and then held the client for, is recorded
+ * against site.
+ *
+ * @param pool the pool to check a client out of
+ * @param site a string literal naming the caller, e.g. "notify_queue"
+ * @return atclient* the checked out client, or NULL if it could not be (re)connected or every free one is backing off
+ */
+atclient *atclient_pool_checkout(atclient_pool *pool, const char *site);
+
+/**
+ * @brief Return a client to the pool, and wake up one waiting thread
+ *
+ * @param pool the pool which owns client
+ * @param client a client previously returned by atclient_pool_checkout
+ */
+void atclient_pool_checkin(atclient_pool *pool, atclient *client);
+
+/**
+ * @brief Stop the maintainer thread, then disconnect and free every client in the pool
+ *
+ * @param pool the pool to free
+ */
+void atclient_pool_free(atclient_pool *pool);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef BACKGROUND_JOBS_H
 #define BACKGROUND_JOBS_H
 
+#include "sshnpd/atclient_pool.h"
 #include "sshnpd/params.h"
 #include <atclient/atclient.h>
 #include <atclient/atkey.h>
@@ -10,13 +11,14 @@
 /**
  * @brief a struct which gets passed to refresh_device_entry as a void pointer
  *
- * @param atclient the atclient context to use to send the device entry
+ * @param pool the pool of atclient connections to use to send the device entry
+ * @param refresh_lock the mutex refresh_cond waits with, hold it while changing should_run
+ * @param refresh_cond the refresh thread sleeps on this until the next deadline, signal it after clearing should_run
  * @param params the sshnpd_params which provide the device name and manager (list)
- * @param fds a pair of file descriptors to communicate with the main thread
  */
 struct refresh_device_entry_params {
-  atclient *atclient;
-  pthread_mutex_t *atclient_lock;
+  atclient_pool *pool;
+  pthread_mutex_t *refresh_lock;
   pthread_cond_t *refresh_cond;
   const sshnpd_params *params;
   const char *payload;
@@ -0,0 +1,50 @@
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+#include <stdint.h>
+
+/**
+ * @brief Capped exponential backoff with full jitter
+ *
+ * Each failed attempt doubles the ceiling, starting from base_ms, up to max_ms. The delay actually used is picked at
+ * random between 0 and that ceiling, so that many devices which lost their atServer at the same moment don't all
+ * reconnect in lockstep.
+ *
+ * @param base_ms the ceiling after the first failure
+ * @param max_ms the largest ceiling
+ * @param attempts the number of consecutive failures so far
+ * @param seed the rand_r state for the jitter
+ */
+typedef struct _backoff {
+  int64_t base_ms;
+  int64_t max_ms;
+  unsigned int attempts;
+  unsigned int seed;
+} backoff;
+
+/**
+ * @brief Initialize a backoff with no failures recorded
+ *
+ * @param backoff the backoff to initialize
+ * @param base_ms the ceiling after the first failure
+ * @param max_ms the largest ceiling
+ * @param seed the seed for the jitter, e.g. derived from the time and pid
+ */
+void backoff_init(backoff *backoff, int64_t base_ms, int64_t max_ms, unsigned int seed);
+
+/**
+ * @brief Record a failure and get how long to wait before the next attempt
+ *
+ * @param backoff the backoff to advance
+ * @return int64_t the delay in milliseconds, between 0 and the current ceiling
+ */
+int64_t backoff_next_ms(backoff *backoff);
+
+/**
+ * @brief Record a success, so the next failure starts again from base_ms
+ *
+ * @param backoff the backoff to reset
+ */
+void backoff_reset(backoff *backoff);
+
+#endif
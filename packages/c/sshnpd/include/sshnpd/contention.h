@@ -0,0 +1,103 @@
+#ifndef CONTENTION_H
+#define CONTENTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Call sites past this many share the last slot
+#define CONTENTION_MAX_SITES 8
+
+/**
+ * @brief How one call site has been using a shared resource
+ *
+ * @param name a string literal naming the call site, e.g. "notify_queue"
+ * @param acquisitions how many times it acquired the resource
+ * @param contended how many of those it had to wait for another holder first
+ * @param wait_us the total time it spent waiting, in microseconds
+ * @param max_wait_us the longest it waited
+ * @param hold_us the total time it held the resource, in microseconds
+ * @param max_hold_us the longest it held the resource
+ * @param long_holds how many holds went over the contention_stats' long_hold_us
+ */
+typedef struct _contention_site {
+  const char *name;
+  uint64_t acquisitions;
+  uint64_t contended;
+  int64_t wait_us;
+  int64_t max_wait_us;
+  int64_t hold_us;
+  int64_t max_hold_us;
+  uint64_t long_holds;
+} contention_site;
+
+/**
+ * @brief Wait, hold and contention statistics for a shared resource, per call site
+ *
+ * Does no locking of its own, the owner of the resource updates it while holding its own lock.
+ *
+ * @param sites the call sites seen so far
+ * @param len the number of sites
+ * @param long_hold_us holds longer than this are counted as long, and reported by contention_stats_released
+ */
+typedef struct _contention_stats {
+  contention_site sites[CONTENTION_MAX_SITES];
+  size_t len;
+  int64_t long_hold_us;
+} contention_stats;
+
+/**
+ * @brief Initialize empty statistics
+ *
+ * @param stats the statistics to initialize
+ * @param long_hold_us the threshold above which a hold counts as long
+ */
+void contention_stats_init(contention_stats *stats, int64_t long_hold_us);
+
+/**
+ * @brief Find a call site, adding it if it hasn't been seen before
+ *
+ * @param stats the statistics
+ * @param name a string literal naming the call site
+ * @return size_t the site's index, to pass to contention_stats_acquired and contention_stats_released
+ */
+size_t contention_stats_site(contention_stats *stats, const char *name);
+
+/**
+ * @brief Record that a call site acquired the resource
+ *
+ * @param stats the statistics
+ * @param site the index of the call site
+ * @param wait_us how long it waited for the resource
+ * @param contended whether it had to wait for another holder
+ */
+void contention_stats_acquired(contention_stats *stats, size_t site, int64_t wait_us, bool contended);
+
+/**
+ * @brief Record that a call site released the resource
+ *
+ * @param stats the statistics
+ * @param site the index of the call site
+ * @param hold_us how long it held the resource
+ * @return true if the hold was longer than long_hold_us
+ */
+bool contention_stats_released(contention_stats *stats, size_t site, int64_t hold_us);
+
+/**
+ * @brief Zero every site's statistics, keeping the sites, e.g. after reporting an interval
+ */
+void contention_stats_reset(contention_stats *stats);
+
+/**
+ * @brief Log the sites which held the resource the longest in total, then the rest, one line each at INFO level
+ *
+ * Sites which didn't acquire the resource are left out.
+ *
+ * @param stats the statistics
+ * @param tag the logger tag to log with
+ * @param resource what the resource is called in the log, e.g. "pool connection"
+ * @param interval_s how many seconds the statistics cover
+ */
+void contention_stats_log(const contention_stats *stats, const char *tag, const char *resource, long interval_s);
+
+#endif
@@ -2,7 +2,12 @@
 #define SSH_KEY_UTIL_H
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 
 enum supported_key_prefix {
   SKP_NONE,
@@ -14,12 +19,82 @@ enum supported_key_prefix {
 
 #define SUPPORTED_KEY_PREFIX_LEN 5
 
-typedef struct {
-  FILE *authkeys_file;
-  char *authkeys_filename;
-  char *permissions; // not required for deauthorize
-  char *key;
-} authkeys_params;
+// Queued keys are written out once this many are pending, even if authorized_keys_flush isn't called
+#define AUTHORIZED_KEYS_MAX_BATCH 64
 
-int authorize_ssh_public_key(authkeys_params *params);
+/**
+ * @brief An in memory index of the keys in an authorized_keys file, so checking for a key doesn't rescan the file
+ *
+ * Keys are identified by a 64 bit hash of their base64 key material, so the same key with different options or a
+ * different comment is still a duplicate. New keys are queued and appended in a single write() to an O_APPEND
+ * descriptor, so a batch lands in the file whole or not at all, even alongside other writers.
+ *
+ * The index is reloaded when the file changes underneath it. On Linux an inotify watch on the parent directory
+ * (which survives editors replacing the file) says when to look, elsewhere every lookup compares stat() results.
+ *
+ * @param filename the path to the authorized_keys file
+ * @param fd the file, opened for appending unless read_only
+ * @param read_only the file could only be opened for reading, so keys can be looked up but not added
+ * @param inotify_fd a non-blocking inotify descriptor watching the parent directory, -1 if unavailable
+ * @param hashes an open addressing set of key hashes, 0 marks an empty slot
+ * @param len the number of hashes in the set
+ * @param capacity the number of slots in hashes, a power of two
+ * @param ends_with_newline false if the file's last line is unterminated, so the next append has to start a new line
+ * @param dev the device of the file that was last loaded
+ * @param ino the inode of the file that was last loaded
+ * @param size the size of the file after the last load or write
+ * @param mtime the modification time of the file after the last load or write
+ * @param pending the lines queued by authorized_keys_add
+ * @param pending_len the length of pending in bytes
+ * @param pending_keys the number of keys in pending
+ */
+typedef struct _authorized_keys {
+  char *filename;
+  int fd;
+  bool read_only;
+  int inotify_fd;
+  uint64_t *hashes;
+  size_t len;
+  size_t capacity;
+  bool ends_with_newline;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  char *pending;
+  size_t pending_len;
+  size_t pending_keys;
+} authorized_keys;
+
+/**
+ * @brief Open an authorized_keys file and load its keys
+ *
+ * @param keys the index to initialize
+ * @param filename the path to the authorized_keys file, which must already exist
+ * @return int 0 on success, otherwise errno (or 1) on error
+ */
+int authorized_keys_init(authorized_keys *keys, const char *filename);
+
+/**
+ * @brief Queue a key to be appended, unless the file (or the queue) already has it
+ *
+ * @param keys the index
+ * @param permissions options to put in front of the key, may be empty
+ * @param key the public key line, e.g. "ssh-ed25519 AAAA... comment"
+ * @param added set to true if the key was queued, false if it was a duplicate
+ * @return int 0 on success, non-zero if the key couldn't be parsed or queued, or the file is read only
+ */
+int authorized_keys_add(authorized_keys *keys, const char *permissions, const char *key, bool *added);
+
+/**
+ * @brief Append every queued key to the file in a single write
+ *
+ * @return int 0 on success (including when nothing was queued), non-zero on error, in which case the keys stay queued
+ */
+int authorized_keys_flush(authorized_keys *keys);
+
+/**
+ * @brief Flush anything still queued and free the index
+ */
+void authorized_keys_free(authorized_keys *keys);
 #endif
@@ -1,10 +1,14 @@
 #ifndef HANDLE_NPT_REQUEST_H
 #define HANDLE_NPT_REQUEST_H
+#include "sshnpd/atclient_pool.h"
+#include "sshnpd/notify_queue.h"
 #include "sshnpd/params.h"
+#include "sshnpd/replay_filter.h"
+#include "sshnpd/request_trace.h"
+#include "sshnpd/session_table.h"
 #include <atclient/monitor.h>
-#include <pthread.h>
 
-void handle_npt_request(atclient *atclient, pthread_mutex_t *atclient_lock, sshnpd_params *params,
-                        bool *is_child_process, atclient_monitor_response *message,
-                        atchops_rsa_key_private_key signing_key);
+void handle_npt_request(atclient_pool *pool, notify_queue *queue, replay_filter *replays, session_table *sessions,
+                        sshnpd_params *params, bool *is_child_process, atclient_monitor_response *message,
+                        atchops_rsa_key_private_key signing_key, request_trace *trace);
 #endif
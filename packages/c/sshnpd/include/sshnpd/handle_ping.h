@@ -1,8 +1,7 @@
 #ifndef HANDLE_PING_H
 #define HANDLE_PING_H
+#include "sshnpd/notify_queue.h"
 #include "sshnpd/params.h"
 #include <atclient/monitor.h>
-#include <pthread.h>
-void handle_ping(sshnpd_params *params, atclient_monitor_response *message, char *ping_response, atclient *atclient,
-                 pthread_mutex_t *atclient_lock);
+void handle_ping(sshnpd_params *params, atclient_monitor_response *message, char *ping_response, notify_queue *queue);
 #endif
@@ -1,7 +1,7 @@
 #ifndef HANDLE_SSHPUBLICKEY_H
 #define HANDLE_SSHPUBLICKEY_H
+#include "sshnpd/file_utils.h"
 #include "sshnpd/params.h"
 #include <atclient/monitor.h>
-void handle_sshpublickey(sshnpd_params *params, atclient_monitor_response *message, FILE *authkeys_file,
-                         char *authkeys_filename);
+void handle_sshpublickey(sshnpd_params *params, atclient_monitor_response *message, authorized_keys *authkeys);
 #endif
@@ -1,32 +1,171 @@
 #ifndef HANDLER_COMMONS_H
 #define HANDLER_COMMONS_H
+#include "sshnpd/atclient_pool.h"
+#include "sshnpd/notify_queue.h"
 #include "sshnpd/params.h"
+#include "sshnpd/replay_filter.h"
+#include "sshnpd/session_table.h"
 #include <atclient/monitor.h>
 #include <atcommons/json.h>
-#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #define BYTES(x) (sizeof(unsigned char) * x)
 
-int verify_envelope_signature_from(cJSON *envelope, char *requesting_atsign, atclient *atclient,
-                                   pthread_mutex_t *atclient_lock);
+/**
+ * @brief The fields of a signed request envelope which every request type shares
+ *
+ * Filled in one pass over the parsed envelope by decode_ssh_request / decode_npt_request. The strings point into the
+ * cJSON tree they were decoded from, so they are only valid until it is deleted.
+ *
+ * @param payload the payload object, kept because the signature is verified over its serialized form
+ * @param signature the base64 signature of the payload
+ * @param hashing_algo e.g. "sha256"
+ * @param signing_algo e.g. "rsa2048"
+ * @param session_id the client's id for this session
+ * @param timestamp when the client created the request in epoch millis, 0 if it didn't say
+ * @param authenticate_to_rvd whether to authenticate to the relay with client_nonce and rvd_nonce
+ * @param encrypt_rvd_traffic whether to encrypt the relayed traffic with a key for client_ephemeral_pk
+ * @param client_nonce NULL if not given
+ * @param rvd_nonce NULL if not given
+ * @param client_ephemeral_pk NULL if not given
+ * @param client_ephemeral_pk_type NULL if not given
+ */
+typedef struct _request_envelope {
+  cJSON *payload;
+  char *signature;
+  char *hashing_algo;
+  char *signing_algo;
+  char *session_id;
+  int64_t timestamp;
+  bool authenticate_to_rvd;
+  bool encrypt_rvd_traffic;
+  char *client_nonce;
+  char *rvd_nonce;
+  char *client_ephemeral_pk;
+  char *client_ephemeral_pk_type;
+} request_envelope;
+
+/**
+ * @brief A decoded ssh_request: connect the relay at host:port to the local sshd
+ */
+typedef struct _ssh_request {
+  request_envelope envelope;
+  char *host;
+  uint16_t port;
+} ssh_request;
+
+/**
+ * @brief A decoded npt_request: connect the relay at rvd_host:rvd_port to requested_host:requested_port
+ */
+typedef struct _npt_request {
+  request_envelope envelope;
+  char *rvd_host;
+  uint16_t rvd_port;
+  char *requested_host;
+  uint16_t requested_port;
+} npt_request;
+
+int verify_envelope_signature_from(request_envelope *envelope, char *requesting_atsign, atclient_pool *pool);
 int verify_envelope_signature(atchops_rsa_key_public_key *publickey, const unsigned char *payload,
                               unsigned char *signature, const char *hashing_algo, const char *signing_algo);
 
-enum payload_type { payload_type_ssh, payload_type_npt };
-
 cJSON *extract_envelope_from_notification(atclient_monitor_response *message);
 
-int verify_envelope_contents(cJSON *envelope, enum payload_type type);
+/**
+ * @brief Validate an ssh_request envelope and decode it, visiting each field once
+ *
+ * @param json the parsed envelope, which must outlive request
+ * @param request the request to fill
+ * @return int 0 on success, non-zero if the envelope is missing a required field or has one of the wrong type
+ */
+int decode_ssh_request(cJSON *json, ssh_request *request);
+
+/**
+ * @brief Validate an npt_request envelope and decode it, visiting each field once
+ *
+ * @param json the parsed envelope, which must outlive request
+ * @param request the request to fill
+ * @return int 0 on success, non-zero if the envelope is missing a required field or has one of the wrong type
+ */
+int decode_npt_request(cJSON *json, npt_request *request);
 
-int verify_payload_contents(cJSON *payload, enum payload_type type);
+/**
+ * @brief Check whether a request is older than params->request_max_age
+ *
+ * Uses the notification's epoch, and the payload's timestamp when one is given.
+ * Timestamps in the future are never considered stale, so small clock differences can only let a request through.
+ *
+ * @param params the sshnpd params, providing request_max_age
+ * @param message the monitor message carrying the request
+ * @param timestamp the payload's timestamp in epoch millis, or 0 to only check the notification epoch
+ * @return true if the request should be dropped
+ */
+bool is_request_stale(sshnpd_params *params, atclient_monitor_response *message, int64_t timestamp);
 
-int create_rvd_auth_string(cJSON *payload, atchops_rsa_key_private_key *signing_key, char **rvd_auth_string);
+/**
+ * @brief Check whether the request's sessionId has already been handled recently
+ *
+ * @param replays the filter of recently handled sessionIds
+ * @param session_id the request's sessionId
+ * @return true if the request is a duplicate and should be dropped
+ */
+bool is_request_replayed(replay_filter *replays, const char *session_id);
 
-int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key,
+/**
+ * @brief Remember the request's sessionId, call once the request has been verified
+ *
+ * @param replays the filter of recently handled sessionIds
+ * @param session_id the request's sessionId
+ */
+void remember_request(replay_filter *replays, const char *session_id);
+
+/**
+ * @brief Check the requester's session limits, and tell them why if they can't start another session right now
+ *
+ * @param sessions the table of live sessions
+ * @param session_id the request's sessionId
+ * @param queue the outbound notification queue
+ * @param params the sshnpd params
+ * @param requesting_atsign the atSign which sent the request
+ * @return true if the session may be started
+ */
+bool admit_session(session_table *sessions, const char *session_id, notify_queue *queue, sshnpd_params *params,
+                   const char *requesting_atsign);
+
+int create_rvd_auth_string(request_envelope *envelope, atchops_rsa_key_private_key *signing_key,
+                           char **rvd_auth_string);
+
+int setup_rvd_session_encryption(request_envelope *envelope, unsigned char **session_aes_key,
                                  unsigned char **session_aes_key_base64, unsigned char **session_iv,
                                  unsigned char **session_iv_base64);
 
-int send_success_payload(cJSON *payload, atclient *atclient, pthread_mutex_t *atclient_lock, sshnpd_params *params,
+/**
+ * @brief Tell the requester that the device is too busy to handle their request, so they can fail fast and retry
+ *
+ * Sent as a plain string on the same {sessionId}.{device} key the final response would have used.
+ *
+ * @param message the monitor message carrying the shed request
+ * @param queue the outbound notification queue
+ * @param params the sshnpd params, providing the device name and atSign
+ * @return int 0 if the response was queued, non-zero otherwise
+ */
+int send_busy_response(atclient_monitor_response *message, notify_queue *queue, sshnpd_params *params);
+
+/**
+ * @brief Send the requester a plain string error on the {sessionId}.{device} key, in place of the final response
+ *
+ * @param identifier the request's sessionId
+ * @param queue the outbound notification queue
+ * @param params the sshnpd params, providing the device name and atSign
+ * @param requesting_atsign the atSign to send the error to
+ * @param error the error message
+ * @return int 0 if the response was queued, non-zero otherwise
+ */
+int send_error_response(const char *identifier, notify_queue *queue, sshnpd_params *params,
+                        const char *requesting_atsign, const char *error);
+
+int send_success_payload(const char *identifier, notify_queue *queue, sshnpd_params *params,
                          unsigned char *session_aes_key_base64, unsigned char *session_iv_base64,
                          atchops_rsa_key_private_key *signing_key, char *requesting_atsign);
 #endif
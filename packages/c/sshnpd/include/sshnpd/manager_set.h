@@ -0,0 +1,53 @@
+#ifndef MANAGER_SET_H
+#define MANAGER_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief An open addressing hash set of the manager atSigns allowed to talk to this device
+ *
+ * Built once at startup from params.manager_list, and read only afterwards, so lookups need no locking. atSigns are
+ * case insensitive, so the set keeps lower cased copies of the managers, with the leading '@' added where it was left
+ * off (e.g. --manager alice), and compares case insensitively.
+ *
+ * @param slots the normalized atSigns in the set, NULL for an empty slot
+ * @param hashes the hash of slots[i], to skip most string compares
+ * @param capacity the number of slots, always a power of two
+ * @param len the number of atSigns in the set
+ */
+typedef struct _manager_set {
+  char **slots;
+  uint32_t *hashes;
+  size_t capacity;
+  size_t len;
+} manager_set;
+
+/**
+ * @brief Build the set from a list of atSigns
+ *
+ * @param set the set to initialize
+ * @param managers the atSigns to allow, with or without the leading '@'
+ * @param managers_len the number of atSigns in managers
+ * @return int 0 on success, non-zero on error
+ */
+int manager_set_init(manager_set *set, char **managers, size_t managers_len);
+
+/**
+ * @brief Check whether atsign is one of the managers
+ *
+ * @param set the set to search
+ * @param atsign the atSign to look for, including the '@', e.g. notification.from
+ * @return true if atsign is in the set, ignoring case
+ */
+bool manager_set_contains(const manager_set *set, const char *atsign);
+
+/**
+ * @brief Free the memory owned by the set
+ *
+ * @param set the set to free
+ */
+void manager_set_free(manager_set *set);
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters, each one a single time series. The per type ones are in the same order as enum notification_key.
+enum metric_counter {
+  METRIC_NOTIFICATIONS_SSHPUBLICKEY,
+  METRIC_NOTIFICATIONS_PING,
+  METRIC_NOTIFICATIONS_SSH_REQUEST,
+  METRIC_NOTIFICATIONS_NPT_REQUEST,
+  METRIC_NOTIFICATIONS_UNAUTHORIZED,
+  METRIC_NOTIFICATIONS_SHED,
+  METRIC_REQUESTS_ACCEPTED,
+  METRIC_REQUESTS_REJECTED_BAD_ENVELOPE,
+  METRIC_REQUESTS_REJECTED_STALE,
+  METRIC_REQUESTS_REJECTED_REPLAYED,
+  METRIC_REQUESTS_REJECTED_BAD_SIGNATURE,
+  METRIC_REQUESTS_REJECTED_NOT_PERMITTED,
+  METRIC_REQUESTS_REJECTED_SESSION_LIMIT,
+  METRIC_REQUESTS_FAILED,
+  METRIC_RECONNECTS_MONITOR,
+  METRIC_RECONNECTS_DECRYPT,
+  METRIC_RECONNECTS_POOL,
+  METRIC_RECONNECT_FAILURES_MONITOR,
+  METRIC_RECONNECT_FAILURES_DECRYPT,
+  METRIC_RECONNECT_FAILURES_POOL,
+  METRIC_POOL_CONTENDED,
+  METRIC_SRV_SESSIONS_CLOSED,
+  METRIC_SRV_BYTES_TO_RVD,
+  METRIC_SRV_BYTES_TO_LOCAL,
+  METRIC_COUNTERS, // the number of counters
+};
+
+// Gauges, set by whoever owns the value
+enum metric_gauge {
+  METRIC_LIVE_SESSIONS,
+  METRIC_QUEUED_REQUESTS,
+  METRIC_GAUGES, // the number of gauges
+};
+
+// Histograms of durations, see METRICS_HISTOGRAM_BOUNDS_US for the buckets. The handler ones are in the same order as
+// enum notification_key.
+enum metric_histogram {
+  METRIC_HANDLER_SSHPUBLICKEY,
+  METRIC_HANDLER_PING,
+  METRIC_HANDLER_SSH_REQUEST,
+  METRIC_HANDLER_NPT_REQUEST,
+  METRIC_POOL_WAIT,
+  METRIC_POOL_HOLD,
+  METRIC_HISTOGRAMS, // the number of histograms
+};
+
+// The upper bounds of the histogram buckets in microseconds, there is also a +Inf bucket
+#define METRICS_HISTOGRAM_BOUNDS_US                                                                                    \
+  {1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000}
+#define METRICS_HISTOGRAM_BUCKETS 12
+
+/**
+ * @brief Serves the metrics in Prometheus' text format to anyone who connects
+ *
+ * Requests are answered one at a time on a background thread. A request starting with "GET " gets an HTTP response,
+ * e.g. from curl --unix-socket, anything else (including nothing at all) gets the bare text, e.g. from nc -U.
+ *
+ * @param unix_fd the listening unix socket, -1 if not listening on one
+ * @param tcp_fd the listening loopback TCP socket, -1 if not listening on one
+ * @param stop_pipe written to by metrics_server_stop to wake the server thread up
+ * @param socket_path the path unix_fd is bound to, unlinked when the server stops
+ * @param thread the server thread
+ * @param running whether thread has been started and not yet stopped
+ */
+typedef struct _metrics_server {
+  int unix_fd;
+  int tcp_fd;
+  int stop_pipe[2];
+  char *socket_path;
+  pthread_t thread;
+  bool running;
+} metrics_server;
+
+/**
+ * @brief Add one to a counter, safe to call from any thread
+ */
+void metrics_inc(enum metric_counter counter);
+
+/**
+ * @brief Add n to a counter, safe to call from any thread
+ */
+void metrics_add(enum metric_counter counter, uint64_t n);
+
+/**
+ * @brief Set a gauge, safe to call from any thread
+ */
+void metrics_set(enum metric_gauge gauge, int64_t value);
+
+/**
+ * @brief Record a duration in a histogram, safe to call from any thread
+ *
+ * @param histogram the histogram
+ * @param duration_us the duration in microseconds, negative durations are counted as 0
+ */
+void metrics_observe_us(enum metric_histogram histogram, int64_t duration_us);
+
+/**
+ * @brief The current time on the monotonic clock, in microseconds, for timing what goes into a histogram
+ */
+int64_t metrics_now_us();
+
+/**
+ * @brief Write every metric in Prometheus' text exposition format
+ *
+ * @param out the stream to write to
+ * @return int 0 on success, non-zero if the metrics couldn't be written
+ */
+int metrics_write(FILE *out);
+
+/**
+ * @brief Start serving the metrics
+ *
+ * @param server the server to start
+ * @param socket_path the unix socket to listen on, replacing any stale one, or NULL to not listen on one
+ * @param port the loopback TCP port to listen on, or 0 to not listen on one
+ * @return int 0 on success (including when there is nothing to listen on), non-zero on error
+ */
+int metrics_server_start(metrics_server *server, const char *socket_path, int port);
+
+/**
+ * @brief Stop the server thread, close its sockets and remove the unix socket
+ */
+void metrics_server_stop(metrics_server *server);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef NOTIFY_QUEUE_H
+#define NOTIFY_QUEUE_H
+
+#include "sshnpd/atclient_pool.h"
+#include <atclient/atkey.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Maximum number of notifications waiting to be sent before notify_queue_push starts rejecting them
+#define NOTIFY_QUEUE_MAX_DEPTH 256
+// Maximum number of notifications the sender sends on one checked out connection before checking it back in
+#define NOTIFY_QUEUE_BATCH_SIZE 16
+
+/**
+ * @brief Called by the sender thread once a queued notification has been sent (or has failed to send)
+ *
+ * @param ret the result of atclient_notify, 0 on success
+ * @param atkey the atkey which was notified
+ * @param ctx the callback_ctx passed to notify_queue_push
+ */
+typedef void(notify_queue_callback)(int ret, const atclient_atkey *atkey, void *ctx);
+
+typedef struct _notify_job {
+  atclient_atkey atkey;
+  char *value;
+  notify_queue_callback *callback;
+  void *callback_ctx;
+  struct _notify_job *next;
+} notify_job;
+
+/**
+ * @brief An outbound notification queue, drained by a dedicated sender thread
+ *
+ * Handlers push a notification and return straight away, the sender takes every queued notification (up to
+ * NOTIFY_QUEUE_BATCH_SIZE at a time), sends them on a single connection checked out of the pool, and reports each
+ * result through the job's callback.
+ *
+ * @param pool the pool of atclients to send the notifications with
+ * @param head the next job to send
+ * @param tail the last job queued
+ * @param depth the number of queued jobs
+ * @param lock protects the job list, depth and running
+ * @param not_empty signalled when a job is pushed, or the queue is stopped
+ * @param running false once notify_queue_stop has been called
+ * @param sender the sender thread
+ */
+typedef struct _notify_queue {
+  atclient_pool *pool;
+
+  notify_job *head;
+  notify_job *tail;
+  size_t depth;
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  bool running;
+
+  pthread_t sender;
+} notify_queue;
+
+/**
+ * @brief Initialize the queue and start its sender thread
+ *
+ * @param queue the queue to start
+ * @param pool the pool of atclients to send notifications with (must outlive the queue)
+ * @return int 0 on success, non-zero on error
+ */
+int notify_queue_start(notify_queue *queue, atclient_pool *pool);
+
+/**
+ * @brief Queue an update notification of value to atkey
+ *
+ * On success the queue takes ownership of the contents of atkey, and resets atkey to an empty key, so it is still
+ * safe (and required) for the caller to atclient_atkey_free it.
+ *
+ * @param queue the queue to push to
+ * @param atkey the atkey to notify
+ * @param value the value to notify, copied by the queue
+ * @param callback called from the sender thread once the notification was sent, may be NULL
+ * @param callback_ctx passed through to callback
+ * @return int 0 on success, non-zero if the queue is full or stopped
+ */
+int notify_queue_push(notify_queue *queue, atclient_atkey *atkey, const char *value, notify_queue_callback *callback,
+                      void *callback_ctx);
+
+/**
+ * @brief Stop accepting new notifications, wait for the queued ones to be sent, then join the sender thread
+ *
+ * @param queue the queue to stop
+ */
+void notify_queue_stop(notify_queue *queue);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef SSHNPD_PARAMS_H
 #define SSHNPD_PARAMS_H
 
+#include "sshnpd/permitopen.h"
 #include <argparse/argparse.h>
 #include <getopt.h>
 #include <stdbool.h>
@@ -25,7 +26,9 @@ struct _sshnpd_params {
 
   size_t permitopen_len;
   char **permitopen_hosts;
-  uint16_t *permitopen_ports; // 0 = '*'
+  uint16_t *permitopen_ports;     // 0 = '*'
+  uint16_t *permitopen_port_ends; // the same as permitopen_ports, unless the rule is a port range
+  permitopen_index permitopen_index;
   char *permitopen_str;
   bool should_free_permitopen_str;
 
@@ -41,6 +44,20 @@ struct _sshnpd_params {
 
   char *key_file;
   char *storage_path;
+  char *startup_profile; // file to append a JSON line of startup timings to, "-" for stderr
+  char *trace_file;      // file to write request traces to in Chrome trace event format, NULL to not trace
+  int trace_sample;      // trace one in every trace_sample ssh and npt requests
+  char *metrics_socket;  // unix socket to serve metrics on, NULL for none
+  int metrics_port;      // loopback port to serve metrics on, 0 for none
+
+  int request_max_age; // seconds, 0 = accept requests of any age
+
+  int max_sessions;            // live srv sessions across all requesters, 0 = unlimited
+  int max_sessions_per_atsign; // live srv sessions per requesting atSign, 0 = unlimited
+  int session_rate;            // new sessions per minute per requesting atSign, 0 = unlimited
+  int session_burst;           // new sessions a requesting atSign may start at once before session_rate applies
+
+  int srv_stats_fd; // not an option: set by main to where forked srv processes report their traffic, -1 for nowhere
 };
 typedef struct _sshnpd_params sshnpd_params;
 
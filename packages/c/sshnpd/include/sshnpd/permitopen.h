@@ -10,6 +10,16 @@
 int parse_permitopen(char *input, char ***permitopen_hosts, uint16_t **permitopen_ports, size_t *permitopen_len,
                      bool is_logger_available);
 
+/**
+ * @brief Like parse_permitopen, but also accepts port ranges (e.g. 10.0.0.0/8:8000-8100)
+ *
+ * @param permitopen_ports set to the first port of each rule, 0 for '*'
+ * @param permitopen_port_ends set to the last port of each rule, the same as the first unless it is a range
+ * @return int 0 on success, non-zero on error
+ */
+int parse_permitopen_ranges(char *input, char ***permitopen_hosts, uint16_t **permitopen_ports,
+                            uint16_t **permitopen_port_ends, size_t *permitopen_len, bool is_logger_available);
+
 struct _permitopen_params {
   char *requested_host;
   uint16_t requested_port;
@@ -21,5 +31,90 @@ struct _permitopen_params {
 
 typedef struct _permitopen_params permitopen_params;
 
+/**
+ * @brief Check a host and port against each rule in turn (exact hosts and '*' only)
+ *
+ * The daemon checks requests against a permitopen_index, this is the simple reference implementation.
+ */
 bool should_permitopen(struct _permitopen_params *params);
+
+typedef struct _permitopen_port_range {
+  uint16_t first;
+  uint16_t last;
+} permitopen_port_range;
+
+/**
+ * @brief A sorted list of non-overlapping port ranges
+ */
+typedef struct _permitopen_port_set {
+  permitopen_port_range *ranges;
+  size_t len;
+} permitopen_port_set;
+
+/**
+ * @brief An open addressing slot mapping a lower cased host, or a "*.suffix" wildcard, to its permitted ports
+ */
+typedef struct _permitopen_host_entry {
+  char *host; // NULL marks an empty slot
+  permitopen_port_set ports;
+} permitopen_host_entry;
+
+/**
+ * @brief A node of the binary trie of IPv4 CIDR rules, ports is empty unless a rule's prefix ends here
+ */
+typedef struct _permitopen_cidr_node {
+  struct _permitopen_cidr_node *children[2];
+  permitopen_port_set ports;
+} permitopen_cidr_node;
+
+/**
+ * @brief The --permit-open rules compiled for lookup, so checking a request doesn't scan every rule
+ *
+ * Rules are matched as follows:
+ * - '*' hosts go into a single port set
+ * - exact hosts and "*.example.com" wildcards go into a hash table keyed on the lower cased host, a requested host
+ *   is looked up as is, then as each of its wildcard suffixes
+ * - IPv4 CIDR ranges (e.g. 10.0.0.0/8) go into a prefix trie, matched against IPv4 literals only. Hostnames are never
+ *   resolved to match them: a lookup would block the main loop, and srv resolves the name again itself, so a low TTL
+ *   name could pass the check and then point somewhere else
+ * Ports can be a single port, a range (e.g. 8000-8100) or '*'.
+ *
+ * @param hosts the hash table of exact and wildcard hosts
+ * @param hosts_capacity the number of slots in hosts, a power of two
+ * @param any_host the ports permitted on any host
+ * @param cidr_root the root of the CIDR trie, NULL if there are no CIDR rules
+ */
+typedef struct _permitopen_index {
+  permitopen_host_entry *hosts;
+  size_t hosts_capacity;
+  permitopen_port_set any_host;
+  permitopen_cidr_node *cidr_root;
+} permitopen_index;
+
+/**
+ * @brief Compile the rules produced by parse_permitopen_ranges into an index
+ *
+ * @param index the index to initialize
+ * @param hosts the host of each rule
+ * @param ports the first port of each rule, 0 for '*'
+ * @param port_ends the last port of each rule, or NULL if there are no ranges
+ * @param len the number of rules
+ * @return int 0 on success, non-zero on error (e.g. a malformed CIDR range)
+ */
+int permitopen_index_init(permitopen_index *index, char **hosts, uint16_t *ports, uint16_t *port_ends, size_t len);
+
+/**
+ * @brief Check whether a connection to host:port is permitted
+ *
+ * @param index the compiled rules
+ * @param host the requested host
+ * @param port the requested port
+ * @return true if some rule permits it
+ */
+bool permitopen_index_allows(permitopen_index *index, const char *host, uint16_t port);
+
+/**
+ * @brief Free everything allocated by permitopen_index_init
+ */
+void permitopen_index_free(permitopen_index *index);
 #endif
@@ -0,0 +1,74 @@
+#ifndef REPLAY_FILTER_H
+#define REPLAY_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Minimum time a sessionId is remembered for
+#define REPLAY_FILTER_MIN_WINDOW_SECONDS 600
+// Number of sessionIds each generation can hold
+#define REPLAY_FILTER_CAPACITY 512
+
+/**
+ * @brief A bounded set of recently seen request ids (e.g. sessionIds), used to drop redelivered requests
+ *
+ * Only a 64 bit hash of each id is kept. Ids go into the current generation, and every window_seconds (or sooner,
+ * if it fills up) the current generation becomes the previous one and the old previous one is forgotten. So an id is
+ * remembered for at least one window, and never more than two, in a fixed amount of memory.
+ *
+ * @param generations two open addressing tables of id hashes, 0 marks an empty slot
+ * @param len the number of ids in each generation
+ * @param current the index of the generation ids are inserted into
+ * @param capacity the number of slots in each generation, a power of two
+ * @param window_seconds how long each generation stays current
+ * @param rotated_at when the current generation became current
+ */
+typedef struct _replay_filter {
+  uint64_t *generations[2];
+  size_t len[2];
+  int current;
+  size_t capacity;
+  int window_seconds;
+  time_t rotated_at;
+} replay_filter;
+
+/**
+ * @brief Initialize an empty filter
+ *
+ * @param filter the filter to initialize
+ * @param capacity the number of ids each generation can hold, rounded up to a power of two
+ * @param window_seconds how long each generation stays current
+ * @param now the current time
+ * @return int 0 on success, non-zero on error
+ */
+int replay_filter_init(replay_filter *filter, size_t capacity, int window_seconds, time_t now);
+
+/**
+ * @brief Check whether id has been inserted recently
+ *
+ * @param filter the filter to search
+ * @param id the id to look for
+ * @param now the current time, used to expire old generations
+ * @return true if id was inserted within the last window
+ */
+bool replay_filter_contains(replay_filter *filter, const char *id, time_t now);
+
+/**
+ * @brief Remember id
+ *
+ * @param filter the filter to insert into
+ * @param id the id to remember
+ * @param now the current time, used to expire old generations
+ */
+void replay_filter_insert(replay_filter *filter, const char *id, time_t now);
+
+/**
+ * @brief Free the memory owned by the filter
+ *
+ * @param filter the filter to free
+ */
+void replay_filter_free(replay_filter *filter);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef REQUEST_QUEUE_H
+#define REQUEST_QUEUE_H
+
+#include "sshnpd/sshnpd.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Number of priority classes, class 0 is the most important
+#define REQUEST_QUEUE_CLASSES 3
+
+// The daemon's priority classes for notifications
+#define REQUEST_CLASS_CONNECT 0 // ssh_request, npt_request and sshpublickey
+#define REQUEST_CLASS_PING 1
+#define REQUEST_CLASS_OTHER 2
+
+/**
+ * @brief Bounded FIFO queues of pending requests, one per priority class
+ *
+ * Items are always popped from the most important non-empty class. Each class has its own depth limit, and all
+ * classes together share max_total. When that is reached, a new item may push out the newest item of a less important
+ * class, so under overload the least important work is shed first. The queue never frees the items it holds.
+ *
+ * @param items ring buffers of items, one per class
+ * @param capacity the depth limit of each class
+ * @param head the index of the oldest item in each class
+ * @param len the number of items in each class
+ * @param total the number of items across all classes
+ * @param max_total the limit on total
+ */
+typedef struct _request_queue {
+  void **items[REQUEST_QUEUE_CLASSES];
+  size_t capacity[REQUEST_QUEUE_CLASSES];
+  size_t head[REQUEST_QUEUE_CLASSES];
+  size_t len[REQUEST_QUEUE_CLASSES];
+  size_t total;
+  size_t max_total;
+} request_queue;
+
+/**
+ * @brief Initialize an empty queue
+ *
+ * @param queue the queue to initialize
+ * @param capacity the depth limit of each class
+ * @param max_total the limit on the number of items across all classes
+ * @return int 0 on success, non-zero on error
+ */
+int request_queue_init(request_queue *queue, const size_t capacity[REQUEST_QUEUE_CLASSES], size_t max_total);
+
+/**
+ * @brief Queue an item
+ *
+ * @param queue the queue to push to
+ * @param cls the priority class of item
+ * @param item the item to queue
+ * @param shed set to an item of a less important class which was dropped to make room, or NULL, the caller owns it
+ * @param shed_cls set to the class of *shed
+ * @return true if item was queued, false if it was rejected (the caller still owns it)
+ */
+bool request_queue_push(request_queue *queue, int cls, void *item, void **shed, int *shed_cls);
+
+/**
+ * @brief Take the oldest item of the most important non-empty class
+ *
+ * @param queue the queue to pop from
+ * @param cls set to the class of the returned item, may be NULL
+ * @return void* the item, or NULL if the queue is empty
+ */
+void *request_queue_pop(request_queue *queue, int *cls);
+
+/**
+ * @brief The priority class a notification is queued in
+ *
+ * Someone is waiting on connection requests. A client sends its public key just before its ssh_request, so keys share
+ * the connect class: first in first out within a class means the key is added (and flushed) before the request is
+ * handled, and a key is never shed to make room for less important work.
+ *
+ * @param key the notification's key
+ * @return int one of the REQUEST_CLASS_ values
+ */
+int request_class_of(enum notification_key key);
+
+/**
+ * @brief Free the memory owned by the queue, any items still queued are not freed
+ *
+ * @param queue the queue to free
+ */
+void request_queue_free(request_queue *queue);
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef REQUEST_TRACE_H
+#define REQUEST_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Spans past this many are not recorded
+#define REQUEST_TRACE_MAX_SPANS 16
+// Long enough for a notification id, which is a uuid
+#define REQUEST_TRACE_ID_LEN 64
+
+/**
+ * @brief One timed stage of handling a request
+ *
+ * @param name a string literal naming the stage, e.g. "verify_signature"
+ * @param began_us when the stage began, in microseconds on the monotonic clock
+ * @param ended_us when the stage ended, in microseconds on the monotonic clock
+ */
+typedef struct _request_span {
+  const char *name;
+  int64_t began_us;
+  int64_t ended_us;
+} request_span;
+
+/**
+ * @brief The trace context carried by an ssh or npt request from the monitor read until it has been answered
+ *
+ * Every function taking a request_trace accepts NULL, and does nothing unless the request was sampled, so the
+ * handlers can call them unconditionally.
+ *
+ * @param sampled whether this request is being traced
+ * @param id a number identifying the request in the trace, shown as its own track
+ * @param name the kind of request, e.g. "ssh_request"
+ * @param notification_id the id of the notification which carried the request
+ * @param began_us when the request was received
+ * @param ended_us when handling the request finished
+ * @param spans the stages recorded so far
+ * @param len the number of stages recorded
+ * @param current_name the stage begun by request_trace_begin which hasn't ended yet, NULL if none
+ * @param current_began_us when the current stage began
+ */
+typedef struct _request_trace {
+  bool sampled;
+  uint64_t id;
+  const char *name;
+  char notification_id[REQUEST_TRACE_ID_LEN];
+  int64_t began_us;
+  int64_t ended_us;
+  request_span spans[REQUEST_TRACE_MAX_SPANS];
+  size_t len;
+  const char *current_name;
+  int64_t current_began_us;
+} request_trace;
+
+/**
+ * @brief Writes finished request traces to a file in Chrome's trace event format, for chrome://tracing or Perfetto
+ *
+ * The file is a JSON array of complete ("X") events which is only closed by request_tracer_close. The trace viewers
+ * accept it without the closing bracket, so a trace from a daemon which was killed can still be loaded.
+ *
+ * @param file the trace file, NULL when tracing is off
+ * @param sample_every trace one in every sample_every requests
+ * @param requests the number of requests seen, to pick which ones to sample
+ * @param events the number of events written, so each one after the first is preceded by a comma
+ * @param pid the process id to attribute the events to
+ */
+typedef struct _request_tracer {
+  FILE *file;
+  int sample_every;
+  uint64_t requests;
+  uint64_t events;
+  int pid;
+} request_tracer;
+
+/**
+ * @brief Start writing request traces to path
+ *
+ * @param tracer the tracer to initialize
+ * @param path the file to write to, truncating it, or NULL to leave tracing off
+ * @param sample_every trace one in every sample_every requests, at least 1
+ * @return int 0 on success (including when path is NULL), otherwise errno (or 1) on error
+ */
+int request_tracer_open(request_tracer *tracer, const char *path, int sample_every);
+
+/**
+ * @brief Close the trace file, a closed (or never opened) tracer traces nothing
+ */
+void request_tracer_close(request_tracer *tracer);
+
+/**
+ * @brief The current time on the monotonic clock in microseconds, or 0 if tracer isn't tracing
+ *
+ * For timing what happens before a request_trace exists, e.g. the monitor read which delivered the request.
+ */
+int64_t request_tracer_now_us(const request_tracer *tracer);
+
+/**
+ * @brief Set up the trace context for a request, deciding whether it is sampled
+ *
+ * @param tracer the tracer
+ * @param trace the trace to initialize
+ * @param name a string literal naming the kind of request
+ * @param notification_id the id of the notification which carried the request, copied
+ * @param received_us when the request was received, from request_tracer_now_us
+ */
+void request_trace_start(request_tracer *tracer, request_trace *trace, const char *name, const char *notification_id,
+                         int64_t received_us);
+
+/**
+ * @brief Record a stage which was timed by the caller
+ */
+void request_trace_span(request_trace *trace, const char *name, int64_t began_us, int64_t ended_us);
+
+/**
+ * @brief End the current stage, if there is one, and begin a new one
+ *
+ * @param trace the trace, may be NULL
+ * @param name a string literal naming the stage
+ */
+void request_trace_begin(request_trace *trace, const char *name);
+
+/**
+ * @brief End the current stage, does nothing if there isn't one
+ */
+void request_trace_end(request_trace *trace);
+
+/**
+ * @brief End the current stage and write the request and its stages to the trace file
+ */
+void request_trace_finish(request_tracer *tracer, request_trace *trace);
+
+/**
+ * @brief Write a finished trace as trace events, one for the whole request and one for each stage
+ *
+ * @param out the stream to write to
+ * @param trace the finished trace
+ * @param pid the process id to attribute the events to
+ * @param first whether these are the first events in the array, otherwise they are preceded by a comma
+ * @return int 0 on success, non-zero if the events couldn't be written
+ */
+int request_trace_write(FILE *out, const request_trace *trace, int pid, bool first);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+enum session_admission {
+  SESSION_ADMITTED,
+  SESSION_RATE_LIMITED,      // the requester has started too many sessions recently
+  SESSION_REQUESTER_AT_MAX,  // the requester has too many live sessions
+  SESSION_TABLE_AT_MAX,      // the device has too many live sessions
+};
+
+/**
+ * @brief Per requesting atSign state: how many live sessions it has, and its token bucket of new sessions
+ *
+ * @param atsign the requesting atSign (owned)
+ * @param live the number of live sessions started for this atSign
+ * @param tokens how many more sessions this atSign may start right now
+ * @param refilled_at when tokens was last topped up
+ */
+typedef struct _session_requester {
+  char *atsign;
+  int live;
+  double tokens;
+  time_t refilled_at;
+} session_requester;
+
+/**
+ * @brief A live session, i.e. a forked srv process which hasn't been reaped yet
+ *
+ * @param pid the pid of the srv process
+ * @param requester the index of the requesting atSign in session_table.requesters
+ */
+typedef struct _session_entry {
+  pid_t pid;
+  size_t requester;
+} session_entry;
+
+/**
+ * @brief The live srv sessions, and the limits on starting new ones
+ *
+ * Only ever used by the main process, so it needs no locking. Requesters are never forgotten, they are bounded by the
+ * manager list since requests from anyone else are dropped before reaching the handlers.
+ *
+ * @param requesters the atSigns which have requested sessions
+ * @param requesters_len the number of requesters
+ * @param sessions the live sessions
+ * @param sessions_len the number of live sessions
+ * @param sessions_cap the number of sessions the sessions array can hold
+ * @param max_sessions the limit on sessions_len, 0 for no limit
+ * @param max_per_requester the limit on each requester's live sessions, 0 for no limit
+ * @param rate_per_minute how many tokens each requester regains per minute, 0 for no rate limit
+ * @param burst the most tokens a requester can hold
+ */
+typedef struct _session_table {
+  session_requester *requesters;
+  size_t requesters_len;
+  session_entry *sessions;
+  size_t sessions_len;
+  size_t sessions_cap;
+  int max_sessions;
+  int max_per_requester;
+  int rate_per_minute;
+  int burst;
+} session_table;
+
+/**
+ * @brief Initialize an empty table
+ *
+ * @param table the table to initialize
+ * @param max_sessions the limit on live sessions, 0 for no limit
+ * @param max_per_requester the limit on each requesting atSign's live sessions, 0 for no limit
+ * @param rate_per_minute how many new sessions per minute each requesting atSign may start, 0 for no limit
+ * @param burst how many new sessions a requesting atSign may start at once
+ * @return int 0 on success, non-zero on error
+ */
+int session_table_init(session_table *table, int max_sessions, int max_per_requester, int rate_per_minute, int burst);
+
+/**
+ * @brief Check whether atsign may start a new session now, and if so take one of its tokens
+ *
+ * @param table the table to check
+ * @param atsign the requesting atSign
+ * @param now the current time
+ * @return enum session_admission SESSION_ADMITTED, or why the session must not be started
+ */
+enum session_admission session_table_admit(session_table *table, const char *atsign, time_t now);
+
+/**
+ * @brief Record a newly started session, call after a successful fork
+ *
+ * @param table the table to add to
+ * @param pid the pid of the srv process
+ * @param atsign the requesting atSign
+ * @return int 0 on success, non-zero on error
+ */
+int session_table_add(session_table *table, pid_t pid, const char *atsign);
+
+/**
+ * @brief Forget a session, call once its srv process has been reaped
+ *
+ * @param table the table to remove from
+ * @param pid the pid of the reaped process
+ * @return true if pid was a live session
+ */
+bool session_table_remove(session_table *table, pid_t pid);
+
+/**
+ * @brief Free the memory owned by the table
+ *
+ * @param table the table to free
+ */
+void session_table_free(session_table *table);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SRV_REPORTS_H
+#define SRV_REPORTS_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Where forked srv processes send their sessions' traffic stats back to the daemon
+ *
+ * A unix datagram socket pair, so each srv_stats_report_t arrives whole however many srv processes share it. srv
+ * reports every session as it closes, and every live session when sent SRV_STATS_SIGNAL. A report which can't be
+ * sent straight away (the daemon is behind) is logged by srv instead.
+ *
+ * @param fds fds[0] is read by the daemon, fds[1] is inherited by srv processes to send on, both non-blocking
+ */
+typedef struct _srv_reports {
+  int fds[2];
+} srv_reports;
+
+/**
+ * @brief Create the socket pair
+ *
+ * fds[0] is closed in forked children, so only the daemon reads reports.
+ *
+ * @param reports the reports channel to open
+ * @return int 0 on success, otherwise errno
+ */
+int srv_reports_open(srv_reports *reports);
+
+/**
+ * @brief Read and log every report which has arrived, adding the traffic of closed sessions to the metrics
+ *
+ * @param reports the reports channel
+ * @return int the number of reports read
+ */
+int srv_reports_drain(srv_reports *reports);
+
+/**
+ * @brief Close the socket pair
+ */
+void srv_reports_close(srv_reports *reports);
+
+#endif
@@ -23,6 +23,9 @@
 #define SSHNP_NS "sshnp"
 #define SSHNP_NS_LEN 5
 
+// Number of worker atclient connections used for outbound atServer operations
+#define WORKER_POOL_SIZE 3
+
 enum notification_key {
   NK_NONE,
   NK_SSHPUBLICKEY,
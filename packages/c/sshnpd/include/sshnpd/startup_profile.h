@@ -0,0 +1,110 @@
+#ifndef STARTUP_PROFILE_H
+#define STARTUP_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Phases past this many are not recorded
+#define STARTUP_PROFILE_MAX_PHASES 32
+
+/**
+ * @brief One timed step of startup
+ *
+ * @param name a string literal naming the step, e.g. "load_atkeys"
+ * @param began_us when the step began, in microseconds on the monotonic clock
+ * @param ended_us when the step ended, in microseconds on the monotonic clock
+ */
+typedef struct _startup_phase {
+  const char *name;
+  int64_t began_us;
+  int64_t ended_us;
+} startup_phase;
+
+/**
+ * @brief Where the time goes between sshnpd starting and being ready to handle requests
+ *
+ * Phases are recorded in the order they end. They may overlap, e.g. the connections which are authenticated
+ * concurrently each record their own phase.
+ *
+ * @param began_us when the process started being timed
+ * @param ended_us when the process was ready, 0 until startup_profile_finish is called
+ * @param phases the recorded phases
+ * @param len the number of phases recorded
+ * @param current_name the name of the phase begun by startup_profile_begin which hasn't ended yet, NULL if none
+ * @param current_began_us when the current phase began
+ */
+typedef struct _startup_profile {
+  int64_t began_us;
+  int64_t ended_us;
+  startup_phase phases[STARTUP_PROFILE_MAX_PHASES];
+  size_t len;
+  const char *current_name;
+  int64_t current_began_us;
+} startup_profile;
+
+/**
+ * @brief The current time on the monotonic clock, in microseconds
+ */
+int64_t startup_profile_now_us();
+
+/**
+ * @brief Start timing startup
+ *
+ * @param profile the profile to initialize
+ * @param now_us the time startup began, from startup_profile_now_us
+ */
+void startup_profile_init(startup_profile *profile, int64_t now_us);
+
+/**
+ * @brief End the current phase, if there is one, and begin a new one
+ *
+ * @param profile the profile
+ * @param name a string literal naming the phase
+ * @param now_us the time the phase began (and the previous one ended)
+ */
+void startup_profile_begin(startup_profile *profile, const char *name, int64_t now_us);
+
+/**
+ * @brief End the current phase, does nothing if there isn't one
+ */
+void startup_profile_end(startup_profile *profile, int64_t now_us);
+
+/**
+ * @brief Record a phase which was timed elsewhere, e.g. on another thread
+ */
+void startup_profile_add(startup_profile *profile, const char *name, int64_t began_us, int64_t ended_us);
+
+/**
+ * @brief End the current phase and mark startup as complete
+ */
+void startup_profile_finish(startup_profile *profile, int64_t now_us);
+
+/**
+ * @brief Write the profile as a single line of JSON
+ *
+ * e.g. {"version":"5.2.0","startedAt":1700000000,"totalMs":812.345,"phases":[{"name":"parse_params","startMs":0.012,
+ * "durationMs":0.204},...]} where startMs is relative to when startup began
+ *
+ * @param profile the profile, which should be finished
+ * @param out the stream to write to
+ * @param version the sshnpd version, so reports can be compared across releases
+ * @param started_at the wall clock time startup began
+ * @return int 0 on success, non-zero if the line couldn't be written
+ */
+int startup_profile_write(const startup_profile *profile, FILE *out, const char *version, time_t started_at);
+
+/**
+ * @brief Append the profile to path as a line of JSON (see startup_profile_write), "-" writes it to stderr
+ *
+ * @return int 0 on success, non-zero on error
+ */
+int startup_profile_append(const startup_profile *profile, const char *path, const char *version, time_t started_at);
+
+/**
+ * @brief Log the duration of every phase at DEBUG level
+ */
+void startup_profile_log(const startup_profile *profile);
+
+#endif
@@ -0,0 +1,110 @@
+#include "sshnpd/address_cache.h"
+#include "srv/log.h"
+#include <atlogger/atlogger.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOGGER_TAG "ADDRESS CACHE"
+// Long enough for any hostname, plus the port and timestamp
+#define ADDRESS_CACHE_LINE_LEN 320
+
+// The caller frees the returned path
+static char *cache_path(const char *storage_path, const char *atsign, const char *suffix) {
+  size_t len = strlen(storage_path) + strlen(atsign) + strlen(".atserver_address") + strlen(suffix) + 2;
+  char *path = malloc(len);
+  if (path != NULL) {
+    snprintf(path, len, "%s/%s.atserver_address%s", storage_path, atsign, suffix);
+  }
+  return path;
+}
+
+int atserver_address_cache_load(const char *storage_path, const char *atsign, char **host, int *port,
+                                time_t *stored_at) {
+  int ret = 1;
+  char *path = cache_path(storage_path, atsign, "");
+  if (path == NULL) {
+    return 1;
+  }
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to open %s: %s\n", path, strerror(errno));
+    }
+    goto exit;
+  }
+
+  char line[ADDRESS_CACHE_LINE_LEN];
+  char cached_host[ADDRESS_CACHE_LINE_LEN];
+  int cached_port;
+  long long cached_at;
+  if (fgets(line, sizeof(line), file) == NULL ||
+      sscanf(line, "%319s %d %lld", cached_host, &cached_port, &cached_at) != 3 || cached_port <= 0 ||
+      cached_port > 65535) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Ignoring malformed atServer address cache %s\n", path);
+    goto close_file;
+  }
+
+  *host = strdup(cached_host);
+  if (*host == NULL) {
+    goto close_file;
+  }
+  *port = cached_port;
+  *stored_at = (time_t)cached_at;
+  ret = 0;
+
+close_file:
+  fclose(file);
+exit:
+  free(path);
+  return ret;
+}
+
+int atserver_address_cache_store(const char *storage_path, const char *atsign, const char *host, int port,
+                                 time_t now) {
+  int ret = 1;
+  if (mkdir(storage_path, 0700) != 0 && errno != EEXIST) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to create %s: %s\n", storage_path, strerror(errno));
+    return 1;
+  }
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+  char *path = cache_path(storage_path, atsign, "");
+  char *tmp_path = cache_path(storage_path, atsign, suffix);
+  if (path == NULL || tmp_path == NULL) {
+    goto exit;
+  }
+
+  // Write a temporary file and rename it over the cache, so a crash never leaves a half written cache behind
+  FILE *file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to create %s: %s\n", tmp_path, strerror(errno));
+    goto exit;
+  }
+  bool written = fprintf(file, "%s %d %lld\n", host, port, (long long)now) > 0;
+  if (fclose(file) != 0 || !written || rename(tmp_path, path) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to write %s: %s\n", path, strerror(errno));
+    unlink(tmp_path);
+    goto exit;
+  }
+  ret = 0;
+
+exit:
+  free(path);
+  free(tmp_path);
+  return ret;
+}
+
+void atserver_address_cache_remove(const char *storage_path, const char *atsign) {
+  char *path = cache_path(storage_path, atsign, "");
+  if (path != NULL) {
+    unlink(path);
+    free(path);
+  }
+}
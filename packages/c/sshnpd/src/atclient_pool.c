@@ -0,0 +1,322 @@
+#include "sshnpd/atclient_pool.h"
+#include "srv/log.h"
+#include "sshnpd/backoff.h"
+#include "sshnpd/metrics.h"
+#include <atclient/atclient.h>
+#include <atclient/connection.h>
+#include <atlogger/atlogger.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOGGER_TAG "atclient_pool"
+
+static void *atclient_pool_maintainer(void *pool);
+static int ensure_connected(atclient_pool *pool, atclient *client);
+static size_t index_of(atclient_pool *pool, atclient *client);
+static int64_t monotonic_ms();
+
+int atclient_pool_init(atclient_pool *pool, size_t size, const char *atsign, const atclient_atkeys *atkeys,
+                       atclient_authenticate_options *auth_options) {
+  int ret = 0;
+
+  pool->size = size;
+  pool->atsign = atsign;
+  pool->atkeys = atkeys;
+  pool->auth_options = auth_options;
+  pool->running = true;
+
+  pool->clients = malloc(sizeof(atclient) * size);
+  pool->in_use = calloc(size, sizeof(bool));
+  pool->backoffs = malloc(sizeof(backoff) * size);
+  pool->retry_at = calloc(size, sizeof(int64_t));
+  pool->checked_out_at = calloc(size, sizeof(int64_t));
+  pool->held_by = calloc(size, sizeof(size_t));
+  if (pool->clients == NULL || pool->in_use == NULL || pool->backoffs == NULL || pool->retry_at == NULL ||
+      pool->checked_out_at == NULL || pool->held_by == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the atclient pool\n");
+    free(pool->clients);
+    free(pool->in_use);
+    free(pool->backoffs);
+    free(pool->retry_at);
+    free(pool->checked_out_at);
+    free(pool->held_by);
+    return 1;
+  }
+  contention_stats_init(&pool->contention, (int64_t)ATCLIENT_POOL_LONG_HOLD_MS * 1000);
+  pool->report_at = monotonic_ms() + ATCLIENT_POOL_REPORT_INTERVAL_MS;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->available, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+
+  size_t i;
+  for (i = 0; i < size; i++) {
+    backoff_init(pool->backoffs + i, ATCLIENT_POOL_BACKOFF_BASE_MS, ATCLIENT_POOL_BACKOFF_MAX_MS,
+                 (unsigned int)time(NULL) ^ (unsigned int)getpid() ^ (unsigned int)i);
+    atclient_init(pool->clients + i);
+    ret = atclient_pkam_authenticate(pool->clients + i, atsign, atkeys, auth_options, NULL);
+    if (ret != 0) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to authenticate pool connection %lu\n", i);
+      i++; // free this client too
+      goto cancel;
+    }
+  }
+
+  ret = pthread_create(&pool->maintainer, NULL, atclient_pool_maintainer, pool);
+  if (ret != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to start the atclient pool maintainer\n");
+    goto cancel;
+  }
+
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Authenticated %lu pool connections\n", size);
+  return 0;
+
+cancel:
+  while (i-- > 0) {
+    atclient_connection_disconnect(&pool->clients[i].atserver_connection);
+    atclient_free(pool->clients + i);
+  }
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->available);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->held_by);
+  free(pool->checked_out_at);
+  free(pool->retry_at);
+  free(pool->backoffs);
+  free(pool->in_use);
+  free(pool->clients);
+  return ret;
+}
+
+atclient *atclient_pool_checkout(atclient_pool *pool, const char *site) {
+  int64_t wait_began = metrics_now_us();
+  int ret = pthread_mutex_lock(&pool->lock);
+  if (ret != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get a lock on the atclient pool\n");
+    return NULL;
+  }
+
+  size_t site_index = contention_stats_site(&pool->contention, site);
+  bool contended = false;
+  atclient *client = NULL;
+  while (client == NULL) {
+    bool backing_off = false;
+    int64_t now = monotonic_ms();
+    for (size_t i = 0; i < pool->size; i++) {
+      if (!pool->in_use[i] && now < pool->retry_at[i]) {
+        // Its last reconnect failed, the maintainer will try again once its backoff is over
+        backing_off = true;
+      } else if (!pool->in_use[i]) {
+        pool->in_use[i] = true;
+        pool->checked_out_at[i] = metrics_now_us();
+        pool->held_by[i] = site_index;
+        contention_stats_acquired(&pool->contention, site_index, pool->checked_out_at[i] - wait_began, contended);
+        client = pool->clients + i;
+        break;
+      }
+    }
+    if (client == NULL && backing_off) {
+      // Don't wait for the busy ones either, the atServer is most likely unreachable
+      break;
+    }
+    if (client == NULL) {
+      contended = true;
+      pthread_cond_wait(&pool->available, &pool->lock);
+    }
+  }
+
+  ret = pthread_mutex_unlock(&pool->lock);
+  if (ret != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release atclient pool lock\n");
+    exit(1);
+  }
+  if (client == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "%s: every idle pool connection is waiting to reconnect\n",
+             site);
+    return NULL;
+  }
+  metrics_observe_us(METRIC_POOL_WAIT, pool->checked_out_at[index_of(pool, client)] - wait_began);
+  if (contended) {
+    metrics_inc(METRIC_POOL_CONTENDED);
+  }
+
+  if (ensure_connected(pool, client) != 0) {
+    atclient_pool_checkin(pool, client);
+    return NULL;
+  }
+
+  return client;
+}
+
+void atclient_pool_set_auth_options(atclient_pool *pool, atclient_authenticate_options *auth_options) {
+  __atomic_store_n(&pool->auth_options, auth_options, __ATOMIC_RELEASE);
+}
+
+void atclient_pool_checkin(atclient_pool *pool, atclient *client) {
+  size_t index = index_of(pool, client);
+  if (index == pool->size) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Tried to check in an atclient not owned by the pool\n");
+    return;
+  }
+
+  if (pthread_mutex_lock(&pool->lock) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get a lock on the atclient pool\n");
+    exit(1);
+  }
+
+  pool->in_use[index] = false;
+  int64_t hold_us = metrics_now_us() - pool->checked_out_at[index];
+  const char *site = pool->contention.sites[pool->held_by[index]].name;
+  bool long_hold = contention_stats_released(&pool->contention, pool->held_by[index], hold_us);
+  pthread_cond_signal(&pool->available);
+
+  if (pthread_mutex_unlock(&pool->lock) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release atclient pool lock\n");
+    exit(1);
+  }
+  metrics_observe_us(METRIC_POOL_HOLD, hold_us);
+  if (long_hold) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "%s held a pool connection for %ld ms\n", site,
+             (long)(hold_us / 1000));
+  }
+}
+
+void atclient_pool_free(atclient_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->running = false;
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  if (pthread_join(pool->maintainer, NULL) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to join the atclient pool maintainer\n");
+  }
+
+  for (size_t i = 0; i < pool->size; i++) {
+    atclient_connection_disconnect(&pool->clients[i].atserver_connection);
+    atclient_free(pool->clients + i);
+  }
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->available);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->held_by);
+  free(pool->checked_out_at);
+  free(pool->retry_at);
+  free(pool->backoffs);
+  free(pool->in_use);
+  free(pool->clients);
+}
+
+static void *atclient_pool_maintainer(void *void_pool) {
+  atclient_pool *pool = void_pool;
+
+  if (pthread_mutex_lock(&pool->lock) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get a lock on the atclient pool\n");
+    return NULL;
+  }
+
+  while (pool->running) {
+    // Wake up for the next maintenance pass, or sooner if a client's reconnect backoff runs out before then
+    int64_t now = monotonic_ms();
+    int64_t sleep_ms = ATCLIENT_POOL_MAINTENANCE_INTERVAL_MS;
+    for (size_t i = 0; i < pool->size; i++) {
+      if (pool->retry_at[i] > now && pool->retry_at[i] - now < sleep_ms) {
+        sleep_ms = pool->retry_at[i] - now;
+      }
+    }
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += sleep_ms / 1000;
+    wake.tv_nsec += (sleep_ms % 1000) * 1000000;
+    if (wake.tv_nsec >= 1000000000) {
+      wake.tv_sec++;
+      wake.tv_nsec -= 1000000000;
+    }
+    int wait_ret = 0;
+    while (pool->running && wait_ret != ETIMEDOUT) {
+      wait_ret = pthread_cond_timedwait(&pool->wake, &pool->lock, &wake);
+    }
+
+    if (monotonic_ms() >= pool->report_at) {
+      // Log a copy, so checkouts don't wait on the console
+      contention_stats interval = pool->contention;
+      contention_stats_reset(&pool->contention);
+      pool->report_at = monotonic_ms() + ATCLIENT_POOL_REPORT_INTERVAL_MS;
+      pthread_mutex_unlock(&pool->lock);
+      contention_stats_log(&interval, LOGGER_TAG, "pool connection", ATCLIENT_POOL_REPORT_INTERVAL_MS / 1000);
+      pthread_mutex_lock(&pool->lock);
+    }
+
+    // Reserve each idle client in turn and reconnect it if needed, without holding the lock while doing network I/O
+    for (size_t i = 0; i < pool->size && pool->running; i++) {
+      if (pool->in_use[i] || monotonic_ms() < pool->retry_at[i]) {
+        continue;
+      }
+      pool->in_use[i] = true;
+      pthread_mutex_unlock(&pool->lock);
+
+      ensure_connected(pool, pool->clients + i);
+
+      pthread_mutex_lock(&pool->lock);
+      pool->in_use[i] = false;
+      pthread_cond_signal(&pool->available);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Must only be called by whoever has client reserved
+static int ensure_connected(atclient_pool *pool, atclient *client) {
+  if (atclient_is_connected(client)) {
+    return 0;
+  }
+
+  size_t index = index_of(pool, client);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO,
+           "Pool connection %lu is not connected, attempting to reconnect\n", index);
+  metrics_inc(METRIC_RECONNECTS_POOL);
+  // Checkouts and the maintainer read retry_at under the lock, which isn't held while we PKAM
+  pthread_mutex_lock(&pool->lock);
+  bool failed_before = pool->backoffs[index].attempts > 0;
+  pthread_mutex_unlock(&pool->lock);
+  // If the last attempt failed the atServer may have moved, so let at_c ask the root server where it is now
+  atclient_authenticate_options *auth_options =
+      failed_before ? NULL : __atomic_load_n(&pool->auth_options, __ATOMIC_ACQUIRE);
+  int ret = atclient_pkam_authenticate(client, pool->atsign, pool->atkeys, auth_options, NULL);
+  if (ret != 0) {
+    metrics_inc(METRIC_RECONNECT_FAILURES_POOL);
+    pthread_mutex_lock(&pool->lock);
+    int64_t delay = backoff_next_ms(pool->backoffs + index);
+    pool->retry_at[index] = monotonic_ms() + delay;
+    pthread_mutex_unlock(&pool->lock);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+             "Failed to reconnect to the atServer, the pool will try again in %ld ms\n", (long)delay);
+    return ret;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  backoff_reset(pool->backoffs + index);
+  pool->retry_at[index] = 0;
+  pthread_mutex_unlock(&pool->lock);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Reconnected to the atServer!\n");
+  return 0;
+}
+
+static size_t index_of(atclient_pool *pool, atclient *client) {
+  if (client < pool->clients || client >= pool->clients + pool->size) {
+    return pool->size;
+  }
+  return (size_t)(client - pool->clients);
+}
+
+static int64_t monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -1,3 +1,4 @@
+#include "srv/log.h"
 #include "sshnpd/params.h"
 #include <atclient/atkey.h>
 #include <atclient/connection.h>
@@ -5,6 +6,7 @@
 #include <atlogger/atlogger.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <sshnpd/background_jobs.h>
 #include <sshnpd/sshnpd.h>
 #include <stddef.h>
@@ -12,12 +14,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 const int64_t THIRTY_DAYS_MS = (int64_t)30 * 24 * 60 * 60 * 1000;
 
 #define LOGGER_TAG "refresh_device_entry"
 
+#define REFRESH_INTERVAL_SECONDS (60 * 60) // once an hour
+// Each refresh is pushed back by up to this much, so managers drift apart instead of refreshing in one burst
+#define REFRESH_JITTER_SECONDS (5 * 60)
+// How many managers to refresh on one checked out atclient before checking it back in
+#define REFRESH_BATCH_SIZE 8
+// A manager whose refresh failed is retried after REFRESH_RETRY_SECONDS times its consecutive failures, up to the max
+#define REFRESH_RETRY_SECONDS 10
+#define REFRESH_MAX_RETRY_SECONDS (5 * 60)
+
+typedef struct {
+  time_t deadline;
+  bool username_pending;
+  unsigned int failures;
+} manager_refresh_state;
+
+static int refresh_manager(atclient *atclient, struct refresh_device_entry_params *params, size_t index,
+                           manager_refresh_state *state);
+
 void *refresh_device_entry(void *void_refresh_device_entry_params) {
   struct refresh_device_entry_params *params = void_refresh_device_entry_params;
 
@@ -40,20 +61,6 @@ void *refresh_device_entry(void *void_refresh_device_entry_params) {
            params->params->atsign);
 
   int ret = 0;
-  if (params->params->hide) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO,
-                 "--hide enabled, deleting any existing username entries for this device\n");
-  } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Saving username entries for this device\n");
-  }
-  ret = pthread_mutex_lock(params->atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Failed to lock the atclient for initial device entry refresh\n");
-    *params->should_run = 0;
-    pthread_exit(NULL);
-  }
-
   size_t index;
   for (index = 0; index < num_managers; index++) {
     // device_info
@@ -64,8 +71,8 @@ void *refresh_device_entry(void *void_refresh_device_entry_params) {
     ret = atclient_atkey_from_string(infokeys + index, atkey_buffer);
 
     if (ret != 0) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create device_info atkey for %s\n",
-                   params->params->manager_list[index]);
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create device_info atkey for %s\n",
+               params->params->manager_list[index]);
       break;
     }
 
@@ -81,8 +88,8 @@ void *refresh_device_entry(void *void_refresh_device_entry_params) {
     snprintf(atkey_buffer, buffer_len, "%s%s", params->params->manager_list[index], username_key_base);
     ret = atclient_atkey_from_string(usernamekeys + index, atkey_buffer);
     if (ret != 0) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create username atkey for %s\n",
-                   params->params->manager_list[index]);
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create username atkey for %s\n",
+               params->params->manager_list[index]);
       break;
     }
 
@@ -91,89 +98,153 @@ void *refresh_device_entry(void *void_refresh_device_entry_params) {
     atclient_atkey_metadata_set_is_encrypted(metadata2, true);
     atclient_atkey_metadata_set_ttr(metadata2, -1);
     atclient_atkey_metadata_set_ccd(metadata2, true);
-    if (params->params->hide) {
-      ret = atclient_delete(params->atclient, usernamekeys + index, NULL, NULL);
-      if (ret != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to delete username atkey for %s\n",
-                     params->params->manager_list[index]);
-        break;
-      }
-    } else {
-      ret = atclient_put_shared_key(params->atclient, usernamekeys + index, params->username, NULL, NULL);
-      if (ret != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to put username atkey for %s\n",
-                     params->params->manager_list[index]);
-        break;
-      }
-    }
   }
 
   if (ret != 0) {
     *params->should_run = 0;
+    pthread_exit(NULL);
   }
 
-  ret = pthread_mutex_unlock(params->atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release atclient lock\n");
+  // Every manager gets its own deadline. They all start due now, and each refresh reschedules that manager one
+  // interval later, plus a random jitter, so over time the refreshes spread out instead of arriving as one burst.
+  // The username entry is published along with the first successful device_info refresh.
+  manager_refresh_state *states = malloc(sizeof(manager_refresh_state) * num_managers);
+  size_t *due = malloc(sizeof(size_t) * num_managers);
+  if (states == NULL || due == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for refresh deadlines\n");
+    free(states);
+    free(due);
     *params->should_run = 0;
     pthread_exit(NULL);
   }
+  time_t now = time(NULL);
+  for (size_t i = 0; i < num_managers; i++) {
+    states[i].deadline = now;
+    states[i].username_pending = true;
+    states[i].failures = 0;
+  }
+  unsigned int seed = (unsigned int)now ^ (unsigned int)getpid();
 
-  if (!*params->should_run) {
-    pthread_exit(NULL);
+  if (params->params->hide) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO,
+             "--hide enabled, deleting any existing username entries for this device\n");
+  } else {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Saving username entries for this device\n");
   }
 
-  // Build each atkey
-  // TODO: @xavierchanth - review this implementation
-  int interval_seconds = 60 * 60; // once an hour
-  int counter = 0;
+  if (pthread_mutex_lock(params->refresh_lock) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get the refresh lock\n");
+    goto exit;
+  }
   while (*params->should_run) {
-    if (counter == 0) {
-      ret = pthread_mutex_lock(params->atclient_lock);
-      if (ret != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                     "Failed to get a lock on atclient, will try again at next iteration\n");
-        continue;
+    // Sleep until the earliest deadline, or until main signals refresh_cond on shutdown
+    time_t next = now + REFRESH_INTERVAL_SECONDS;
+    for (size_t i = 0; i < num_managers; i++) {
+      if (states[i].deadline < next) {
+        next = states[i].deadline;
+      }
+    }
+    struct timespec wake = {.tv_sec = next, .tv_nsec = 0};
+    while (*params->should_run && time(NULL) < next) {
+      if (pthread_cond_timedwait(params->refresh_cond, params->refresh_lock, &wake) == ETIMEDOUT) {
+        break;
       }
-      // once an hour the counter will reset
+    }
+    if (!*params->should_run) {
+      break;
+    }
+    // Don't hold the lock while talking to the atServer, main only needs it to stop us
+    pthread_mutex_unlock(params->refresh_lock);
+
+    now = time(NULL);
+    size_t due_len = 0;
+    for (size_t i = 0; i < num_managers; i++) {
+      if (states[i].deadline <= now) {
+        due[due_len++] = i;
+      }
+    }
+
+    if (due_len > 0) {
       if (params->params->hide) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO,
-                     "--hide enabled, deleting any existing device info entries for this device\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO,
+                 "--hide enabled, deleting %lu existing device info entries for this device\n", due_len);
       } else {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Refreshing device info entries for this device\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Refreshing %lu device info entries for this device\n",
+                 due_len);
       }
+    }
 
-      fflush(stdout);
+    // Work through the due managers a few at a time, checking the atclient back in between batches so that request
+    // handlers waiting on the pool get a turn, even when there are many managers
+    for (size_t batch = 0; batch < due_len && *params->should_run; batch += REFRESH_BATCH_SIZE) {
+      size_t batch_end = batch + REFRESH_BATCH_SIZE < due_len ? batch + REFRESH_BATCH_SIZE : due_len;
 
-      for (size_t i = 0; i < num_managers; i++) {
-        if (params->params->hide) {
-          ret = atclient_delete(params->atclient, infokeys + i, NULL, NULL);
+      atclient *atclient = atclient_pool_checkout(params->pool, "refresh_device_entry");
+      if (atclient == NULL) {
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to check out an atclient\n");
+      }
+
+      for (size_t j = batch; j < batch_end; j++) {
+        size_t i = due[j];
+        ret = atclient == NULL ? 1 : refresh_manager(atclient, params, i, &states[i]);
+        if (ret == 0) {
+          states[i].failures = 0;
+          states[i].deadline = now + REFRESH_INTERVAL_SECONDS + rand_r(&seed) % REFRESH_JITTER_SECONDS;
         } else {
-          ret = atclient_put_shared_key(params->atclient, infokeys + i, params->payload, NULL, NULL);
-        }
-        if (ret != 0) {
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to refresh device entry for %s\n",
-                       params->params->manager_list[i]);
+          // Retry just this manager, backing off linearly up to REFRESH_MAX_RETRY_SECONDS
+          states[i].failures++;
+          time_t delay = REFRESH_RETRY_SECONDS * states[i].failures;
+          if (delay > REFRESH_MAX_RETRY_SECONDS) {
+            delay = REFRESH_MAX_RETRY_SECONDS;
+          }
+          states[i].deadline = now + delay;
         }
       }
 
-      ret = pthread_mutex_unlock(params->atclient_lock);
-      if (ret != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Bad pthread state, exiting to prevent deadlock");
-        *params->should_run = 0;
-        break;
+      if (atclient != NULL) {
+        atclient_pool_checkin(params->pool, atclient);
       }
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Released the atclient lock\n");
-      fflush(stdout);
     }
 
-    if (counter == interval_seconds) {
-      counter = 0;
-    } else {
-      counter++;
+    if (pthread_mutex_lock(params->refresh_lock) != 0) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get the refresh lock\n");
+      goto exit;
     }
-    sleep(1);
   }
+  pthread_mutex_unlock(params->refresh_lock);
 
+exit:
+  free(states);
+  free(due);
   pthread_exit(NULL);
 }
+
+static int refresh_manager(atclient *atclient, struct refresh_device_entry_params *params, size_t index,
+                           manager_refresh_state *state) {
+  int ret;
+  const char *manager = params->params->manager_list[index];
+
+  if (state->username_pending) {
+    if (params->params->hide) {
+      ret = atclient_delete(atclient, params->usernamekeys + index, NULL, NULL);
+    } else {
+      ret = atclient_put_shared_key(atclient, params->usernamekeys + index, params->username, NULL, NULL);
+    }
+    if (ret != 0) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to %s username atkey for %s\n",
+               params->params->hide ? "delete" : "put", manager);
+      return ret;
+    }
+    state->username_pending = false;
+  }
+
+  if (params->params->hide) {
+    ret = atclient_delete(atclient, params->infokeys + index, NULL, NULL);
+  } else {
+    ret = atclient_put_shared_key(atclient, params->infokeys + index, params->payload, NULL, NULL);
+  }
+  if (ret != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to refresh device entry for %s\n", manager);
+  }
+  return ret;
+}
@@ -0,0 +1,27 @@
+#include "sshnpd/backoff.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+void backoff_init(backoff *backoff, int64_t base_ms, int64_t max_ms, unsigned int seed) {
+  backoff->base_ms = base_ms;
+  backoff->max_ms = max_ms;
+  backoff->attempts = 0;
+  backoff->seed = seed;
+}
+
+int64_t backoff_next_ms(backoff *backoff) {
+  int64_t ceiling = backoff->base_ms;
+  for (unsigned int i = 0; i < backoff->attempts && ceiling < backoff->max_ms; i++) {
+    ceiling *= 2;
+  }
+  if (ceiling > backoff->max_ms) {
+    ceiling = backoff->max_ms;
+  }
+  backoff->attempts++;
+
+  // rand_r only gives us 15 guaranteed bits, so combine two calls for ceilings larger than that
+  uint32_t r = ((uint32_t)rand_r(&backoff->seed) << 15) ^ (uint32_t)rand_r(&backoff->seed);
+  return (int64_t)(r % (uint32_t)(ceiling + 1));
+}
+
+void backoff_reset(backoff *backoff) { backoff->attempts = 0; }
@@ -0,0 +1,92 @@
+#include "sshnpd/contention.h"
+#include "srv/log.h"
+#include <atlogger/atlogger.h>
+#include <string.h>
+
+void contention_stats_init(contention_stats *stats, int64_t long_hold_us) {
+  memset(stats, 0, sizeof(contention_stats));
+  stats->long_hold_us = long_hold_us;
+}
+
+size_t contention_stats_site(contention_stats *stats, const char *name) {
+  for (size_t i = 0; i < stats->len; i++) {
+    // Names are literals, so the pointer nearly always matches
+    if (stats->sites[i].name == name || strcmp(stats->sites[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (stats->len == CONTENTION_MAX_SITES) {
+    stats->sites[CONTENTION_MAX_SITES - 1].name = "(other)";
+    return CONTENTION_MAX_SITES - 1;
+  }
+  stats->sites[stats->len].name = name;
+  return stats->len++;
+}
+
+void contention_stats_acquired(contention_stats *stats, size_t site, int64_t wait_us, bool contended) {
+  contention_site *s = stats->sites + site;
+  s->acquisitions++;
+  if (contended) {
+    s->contended++;
+  }
+  s->wait_us += wait_us;
+  if (wait_us > s->max_wait_us) {
+    s->max_wait_us = wait_us;
+  }
+}
+
+bool contention_stats_released(contention_stats *stats, size_t site, int64_t hold_us) {
+  contention_site *s = stats->sites + site;
+  s->hold_us += hold_us;
+  if (hold_us > s->max_hold_us) {
+    s->max_hold_us = hold_us;
+  }
+  if (hold_us > stats->long_hold_us) {
+    s->long_holds++;
+    return true;
+  }
+  return false;
+}
+
+void contention_stats_reset(contention_stats *stats) {
+  for (size_t i = 0; i < stats->len; i++) {
+    const char *name = stats->sites[i].name;
+    memset(stats->sites + i, 0, sizeof(contention_site));
+    stats->sites[i].name = name;
+  }
+}
+
+void contention_stats_log(const contention_stats *stats, const char *tag, const char *resource, long interval_s) {
+  if (!log_enabled(ATLOGGER_LOGGING_LEVEL_INFO)) {
+    return;
+  }
+
+  // Insertion sort by total hold time, there are only a handful of sites
+  size_t order[CONTENTION_MAX_SITES];
+  size_t len = 0;
+  for (size_t i = 0; i < stats->len; i++) {
+    if (stats->sites[i].acquisitions == 0) {
+      continue;
+    }
+    size_t j = len++;
+    while (j > 0 && stats->sites[order[j - 1]].hold_us < stats->sites[i].hold_us) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+  if (len == 0) {
+    return;
+  }
+
+  lazy_log(tag, ATLOGGER_LOGGING_LEVEL_INFO, "Top %s holders over the last %ld s:\n", resource, interval_s);
+  for (size_t i = 0; i < len; i++) {
+    const contention_site *s = stats->sites + order[i];
+    lazy_log(tag, ATLOGGER_LOGGING_LEVEL_INFO,
+             "  %s: held %.1f ms in total (max %.1f ms, %llu long), %llu acquisitions, %llu contended, waited %.1f ms "
+             "in total (max %.1f ms)\n",
+             s->name, s->hold_us / 1000.0, s->max_hold_us / 1000.0, (unsigned long long)s->long_holds,
+             (unsigned long long)s->acquisitions, (unsigned long long)s->contended, s->wait_us / 1000.0,
+             s->max_wait_us / 1000.0);
+  }
+}
@@ -1,90 +1,471 @@
 #include "sshnpd/file_utils.h"
+#include "srv/log.h"
 #include <atlogger/atlogger.h>
 #include <errno.h>
-#include <pthread.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
-int authorize_ssh_public_key(authkeys_params *params) {
-  const char *tag = "AUTH SSH KEY";
-  int ret = 0;
-
-  flockfile(params->authkeys_file); // should be safe to call freopen inside a lock, since the FILE stream is preserved
-                                    // in most implementations
-  params->authkeys_file = freopen(params->authkeys_filename, "a+", params->authkeys_file); // reopen file in append mode
-  if (params->authkeys_file == NULL) {
-    atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to freopen authkeys file: %s\n", strerror(errno));
-    if (errno != 0) {
-      ret = errno;
-    } else {
-      ret = 1;
+#define TAG "AUTH SSH KEY"
+#define AUTHORIZED_KEYS_INITIAL_CAPACITY 64
+
+// Key types are recognised by prefix, the token after the key type is the key material
+static const char *key_type_prefixes[] = {"ssh-", "ecdsa-", "sk-", "rsa-sha2-"};
+
+static bool is_key_type(const char *token, size_t token_len) {
+  for (size_t i = 0; i < sizeof(key_type_prefixes) / sizeof(key_type_prefixes[0]); i++) {
+    size_t prefix_len = strlen(key_type_prefixes[i]);
+    if (token_len > prefix_len && strncmp(token, key_type_prefixes[i], prefix_len) == 0) {
+      return true;
     }
-    goto exit;
   }
+  return false;
+}
 
-  ret = fseek(params->authkeys_file, 0, SEEK_SET);
-  if (ret != 0) {
-    atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to seek to the beginning of authkeys file: %s\n",
-                 strerror(errno));
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+// Finds the base64 key material in an authorized_keys (or public key) line, skipping any options in front of it
+static bool find_key_blob(const char *line, size_t len, const char **blob, size_t *blob_len) {
+  const char *end = line + len;
+  const char *p = line;
+  while (p < end && is_space(*p)) {
+    p++;
+  }
+  if (p == end || *p == '#') {
+    return false;
+  }
+
+  bool previous_was_type = false;
+  while (p < end) {
+    // Options may contain quoted spaces, e.g. command="echo hi"
+    const char *token = p;
+    bool in_quotes = false;
+    while (p < end && (in_quotes || !is_space(*p))) {
+      if (*p == '"') {
+        in_quotes = !in_quotes;
+      }
+      p++;
+    }
+    if (previous_was_type) {
+      *blob = token;
+      *blob_len = p - token;
+      return true;
+    }
+    previous_was_type = is_key_type(token, p - token);
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+  }
+  return false;
+}
+
+static uint64_t hash_blob(const char *blob, size_t blob_len) {
+  // FNV-1a, with 0 reserved for empty slots
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < blob_len; i++) {
+    hash = (hash ^ (unsigned char)blob[i]) * 0x100000001b3ULL;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+static bool contains_hash(const authorized_keys *keys, uint64_t hash) {
+  size_t mask = keys->capacity - 1;
+  for (size_t i = hash & mask; keys->hashes[i] != 0; i = (i + 1) & mask) {
+    if (keys->hashes[i] == hash) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int insert_hash(authorized_keys *keys, uint64_t hash) {
+  if ((keys->len + 1) * 2 > keys->capacity) {
+    // Keep the table at most half full
+    size_t capacity = keys->capacity * 2;
+    uint64_t *hashes = calloc(capacity, sizeof(uint64_t));
+    if (hashes == NULL) {
+      return 1;
+    }
+    for (size_t i = 0; i < keys->capacity; i++) {
+      if (keys->hashes[i] != 0) {
+        size_t j = keys->hashes[i] & (capacity - 1);
+        while (hashes[j] != 0) {
+          j = (j + 1) & (capacity - 1);
+        }
+        hashes[j] = keys->hashes[i];
+      }
+    }
+    free(keys->hashes);
+    keys->hashes = hashes;
+    keys->capacity = capacity;
+  }
+
+  size_t mask = keys->capacity - 1;
+  size_t i = hash & mask;
+  for (; keys->hashes[i] != 0; i = (i + 1) & mask) {
+    if (keys->hashes[i] == hash) {
+      return 0;
+    }
+  }
+  keys->hashes[i] = hash;
+  keys->len++;
+  return 0;
+}
+
+// Calls fn with the key hash of every line in buf which holds a key
+static int for_each_key(const char *buf, size_t len, int (*fn)(authorized_keys *, uint64_t, const char *, size_t),
+                        authorized_keys *keys) {
+  for (const char *line = buf; line < buf + len;) {
+    const char *newline = memchr(line, '\n', buf + len - line);
+    size_t line_len = newline != NULL ? (size_t)(newline - line) + 1 : (size_t)(buf + len - line);
+    const char *blob;
+    size_t blob_len;
+    if (find_key_blob(line, line_len, &blob, &blob_len) &&
+        fn(keys, hash_blob(blob, blob_len), line, line_len) != 0) {
+      return 1;
+    }
+    line += line_len;
+  }
+  return 0;
+}
+
+static int index_key(authorized_keys *keys, uint64_t hash, const char *line, size_t line_len) {
+  return insert_hash(keys, hash);
+}
+
+// Keeps a queued line only if the reloaded file doesn't already have its key
+static int requeue_key(authorized_keys *keys, uint64_t hash, const char *line, size_t line_len) {
+  if (contains_hash(keys, hash)) {
+    return 0;
+  }
+  memmove(keys->pending + keys->pending_len, line, line_len);
+  keys->pending_len += line_len;
+  keys->pending_keys++;
+  return insert_hash(keys, hash);
+}
+
+static void remember_stat(authorized_keys *keys, const struct stat *st) {
+  keys->dev = st->st_dev;
+  keys->ino = st->st_ino;
+  keys->size = st->st_size;
+  keys->mtime = st->st_mtime;
+}
+
+// (Re)open the file and rebuild the index from it, keeping any queued keys the file doesn't have yet
+static int load(authorized_keys *keys, bool create) {
+  int fd = open(keys->filename, O_RDWR | O_APPEND | (create ? O_CREAT : 0), 0600);
+  bool read_only = false;
+  if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+    // We can still index a file we can't write to, adding keys to it will fail
+    fd = open(keys->filename, O_RDONLY);
+    read_only = true;
+  }
+  if (fd < 0) {
+    int ret = errno != 0 ? errno : 1;
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to open authorized_keys file: %s\n", strerror(errno));
+    return ret;
+  }
+
+  int ret = 1;
+  char *buf = NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to stat authorized_keys file: %s\n", strerror(errno));
     goto exit;
   }
 
-  size_t bufsize = 256;
-  char *buf = malloc(bufsize * sizeof(char));
+  size_t capacity = (size_t)st.st_size + 1, len = 0;
+  buf = malloc(capacity);
   if (buf == NULL) {
-    atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for buf\n", strerror(errno));
-    ret = 1;
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory to read authorized_keys\n");
     goto exit;
   }
-
-  while (getline(&buf, &bufsize, params->authkeys_file) >= 0) {
-    if (strstr(buf, params->key) != NULL) {
-      // already exists in the file, moving on
-      atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_DEBUG, "Already found key in the file, did not add a second entry\n");
-      ret = 0;
-      goto cleanup;
+  for (;;) {
+    if (len == capacity) {
+      // the file grew since fstat
+      char *bigger = realloc(buf, capacity * 2);
+      if (bigger == NULL) {
+        lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory to read authorized_keys\n");
+        goto exit;
+      }
+      buf = bigger;
+      capacity *= 2;
+    }
+    ssize_t n = pread(fd, buf + len, capacity - len, (off_t)len);
+    if (n < 0 && errno == EINTR) {
+      continue;
     }
+    if (n < 0) {
+      lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to read authorized_keys file: %s\n", strerror(errno));
+      goto exit;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += (size_t)n;
   }
 
-  ret = fseek(params->authkeys_file, 0, SEEK_END); // on some platforms a+ opens to the end so seek to beginning first
-  if (ret != 0) {
-    atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to seek to the end of authkeys file: %s\n",
-                 strerror(errno));
-    goto cleanup;
+  memset(keys->hashes, 0, keys->capacity * sizeof(uint64_t));
+  keys->len = 0;
+  if (for_each_key(buf, len, index_key, keys) != 0) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the authorized_keys index\n");
+    goto exit;
+  }
+  size_t pending_len = keys->pending_len;
+  keys->pending_len = 0;
+  keys->pending_keys = 0;
+  if (pending_len > 0 && for_each_key(keys->pending, pending_len, requeue_key, keys) != 0) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the authorized_keys index\n");
+    goto exit;
   }
 
-  char *postfix = "";
-  if (params->key[strlen(params->key) - 1] != '\n') {
-    postfix = "\n";
+  keys->ends_with_newline = len == 0 || buf[len - 1] == '\n';
+  remember_stat(keys, &st);
+  keys->size = (off_t)len;
+  if (keys->fd >= 0) {
+    close(keys->fd);
   }
+  keys->fd = fd;
+  keys->read_only = read_only;
+  fd = -1;
+  ret = 0;
+  lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Loaded %zu keys from %s\n", keys->len, keys->filename);
+
+exit:
+  free(buf);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return ret;
+}
+
+static bool has_changed(authorized_keys *keys) {
+#ifdef __linux__
+  if (keys->inotify_fd >= 0) {
+    const char *slash = strrchr(keys->filename, '/');
+    const char *name = slash != NULL ? slash + 1 : keys->filename;
+    bool relevant = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(keys->inotify_fd, buf, sizeof(buf))) > 0) {
+      for (char *p = buf; p < buf + n;) {
+        struct inotify_event *event = (struct inotify_event *)p;
+        if ((event->mask & IN_Q_OVERFLOW) || (event->len > 0 && strcmp(event->name, name) == 0)) {
+          relevant = true;
+        }
+        p += sizeof(struct inotify_event) + event->len;
+      }
+    }
+    if (!relevant) {
+      return false;
+    }
+    // Our own appends show up here too, so let stat() decide whether someone else changed the file
+  }
+#endif
+  struct stat st;
+  if (stat(keys->filename, &st) != 0) {
+    return true;
+  }
+  return st.st_dev != keys->dev || st.st_ino != keys->ino || st.st_size != keys->size || st.st_mtime != keys->mtime;
+}
 
-  if (strlen(params->permissions) > 0) {
-    ret = fprintf(params->authkeys_file, "%s %s%s", params->permissions, params->key, postfix);
+static int reload_if_changed(authorized_keys *keys) {
+  if (!has_changed(keys)) {
+    return 0;
+  }
+  lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "authorized_keys changed, reloading it\n");
+  // Like the "a+" this used to be opened with, recreate the file if it has been removed
+  return load(keys, true);
+}
+
+static void watch_directory(authorized_keys *keys) {
+  keys->inotify_fd = -1;
+#ifdef __linux__
+  char *dir = strdup(keys->filename);
+  if (dir == NULL) {
+    return;
+  }
+  char *slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else if (slash == dir) {
+    slash[1] = '\0';
   } else {
-    ret = fprintf(params->authkeys_file, "%s%s", params->key, postfix);
+    *slash = '\0';
+  }
+
+  keys->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  // Watch the directory rather than the file, so we still notice when the file is replaced (e.g. by an editor)
+  if (keys->inotify_fd >= 0 && inotify_add_watch(keys->inotify_fd, dir,
+                                                 IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                                     IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to watch %s, checking authorized_keys with stat instead: %s\n",
+             dir, strerror(errno));
+    close(keys->inotify_fd);
+    keys->inotify_fd = -1;
   }
+  free(dir);
+#endif
+}
 
-  if (ret < 0) {
-    printf("%d\n", ret);
-    atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to append key to authkeys file s: %s\n", strerror(errno));
-    goto cleanup;
+int authorized_keys_init(authorized_keys *keys, const char *filename) {
+  memset(keys, 0, sizeof(authorized_keys));
+  keys->fd = -1;
+  keys->inotify_fd = -1;
+  keys->filename = strdup(filename);
+  keys->capacity = AUTHORIZED_KEYS_INITIAL_CAPACITY;
+  keys->hashes = calloc(keys->capacity, sizeof(uint64_t));
+  if (keys->filename == NULL || keys->hashes == NULL) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the authorized_keys index\n");
+    authorized_keys_free(keys);
+    return 1;
   }
 
-  ret = fflush(params->authkeys_file);
+  // Start watching before the first load, so no change can slip in between the two
+  watch_directory(keys);
+  int ret = load(keys, false);
   if (ret != 0) {
-    atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to flush authkeys file: %s\n", strerror(errno));
-    goto cleanup;
+    authorized_keys_free(keys);
   }
+  return ret;
+}
 
-  atlogger_log(tag, ATLOGGER_LOGGING_LEVEL_DEBUG, "Successfully authorized the new public key\n");
-cleanup: { free(buf); }
-exit: {
-  funlockfile(params->authkeys_file);
+int authorized_keys_add(authorized_keys *keys, const char *permissions, const char *key, bool *added) {
+  *added = false;
+  int ret = reload_if_changed(keys);
+  if (ret != 0) {
+    return ret;
+  }
 
-  return ret;
+  size_t key_len = strlen(key);
+  const char *blob;
+  size_t blob_len;
+  if (!find_key_blob(key, key_len, &blob, &blob_len)) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Ssh public key does not look like a public key\n");
+    return 1;
+  }
+  uint64_t hash = hash_blob(blob, blob_len);
+  if (contains_hash(keys, hash)) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Already found key in the file, did not add a second entry\n");
+    return 0;
+  }
+  if (keys->read_only) {
+    // Rather than queueing keys which could never be flushed
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "authorized_keys file is read only, can't add the key\n");
+    return EACCES;
+  }
+
+  while (key_len > 0 && is_space(key[key_len - 1])) {
+    key_len--;
+  }
+  size_t permissions_len = strlen(permissions);
+  // permissions, a space, the key and a newline
+  char *pending = realloc(keys->pending, keys->pending_len + permissions_len + key_len + 2);
+  if (pending == NULL) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory to queue the key\n");
+    return 1;
+  }
+  keys->pending = pending;
+  if (permissions_len > 0) {
+    memcpy(pending + keys->pending_len, permissions, permissions_len);
+    keys->pending_len += permissions_len;
+    pending[keys->pending_len++] = ' ';
+  }
+  memcpy(pending + keys->pending_len, key, key_len);
+  keys->pending_len += key_len;
+  pending[keys->pending_len++] = '\n';
+  keys->pending_keys++;
+  if (insert_hash(keys, hash) != 0) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the authorized_keys index\n");
+    return 1;
+  }
+  *added = true;
+
+  if (keys->pending_keys >= AUTHORIZED_KEYS_MAX_BATCH) {
+    return authorized_keys_flush(keys);
+  }
+  return 0;
+}
+
+int authorized_keys_flush(authorized_keys *keys) {
+  if (keys->pending_len == 0) {
+    return 0;
+  }
+  // Make sure fd is still the file at filename, and drop anything someone else added in the meantime
+  int ret = reload_if_changed(keys);
+  if (ret != 0 || keys->pending_len == 0) {
+    return ret;
+  }
+
+  // One writev on an O_APPEND descriptor, so the batch can't interleave with another writer's lines
+  struct iovec iov[2];
+  int iovcnt = 0;
+  if (!keys->ends_with_newline) {
+    iov[iovcnt].iov_base = (char *)"\n";
+    iov[iovcnt++].iov_len = 1;
+  }
+  iov[iovcnt].iov_base = keys->pending;
+  iov[iovcnt++].iov_len = keys->pending_len;
+  size_t total = keys->pending_len + (keys->ends_with_newline ? 0 : 1);
+
+  ssize_t written;
+  do {
+    written = writev(keys->fd, iov, iovcnt);
+  } while (written < 0 && errno == EINTR);
+  if (written < 0) {
+    ret = errno != 0 ? errno : 1;
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to append %zu keys to authorized_keys file: %s\n",
+             keys->pending_keys, strerror(errno));
+    return ret;
+  }
+  if ((size_t)written != total) {
+    // Don't guess what made it, forget the queue and reindex the file next time
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Short write appending to authorized_keys file (%zd of %zu bytes)\n",
+             written, total);
+    keys->pending_len = 0;
+    keys->pending_keys = 0;
+    keys->ino = 0;
+    keys->size = -1;
+    return 1;
+  }
+
+  lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Appended %zu keys to authorized_keys\n", keys->pending_keys);
+  keys->pending_len = 0;
+  keys->pending_keys = 0;
+  keys->ends_with_newline = true;
+  // Only account for our own write, so anything another process appended since still shows up as a change. The mtime
+  // is only trusted if nothing else has been written.
+  keys->size += written;
+  struct stat st;
+  if (fstat(keys->fd, &st) == 0 && st.st_size == keys->size) {
+    keys->mtime = st.st_mtime;
+  }
+  return 0;
 }
+
+void authorized_keys_free(authorized_keys *keys) {
+  if (keys->fd >= 0) {
+    authorized_keys_flush(keys);
+    close(keys->fd);
+    keys->fd = -1;
+  }
+  if (keys->inotify_fd >= 0) {
+    close(keys->inotify_fd);
+    keys->inotify_fd = -1;
+  }
+  free(keys->filename);
+  free(keys->hashes);
+  free(keys->pending);
+  keys->filename = NULL;
+  keys->hashes = NULL;
+  keys->pending = NULL;
 }
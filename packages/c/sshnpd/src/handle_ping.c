@@ -1,8 +1,9 @@
+#include "srv/log.h"
+#include "sshnpd/notify_queue.h"
 #include "sshnpd/params.h"
 #include "sshnpd/sshnpd.h"
 #include <atclient/atkey.h>
 #include <atclient/monitor.h>
-#include <atclient/notify.h>
 #include <atlogger/atlogger.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -12,9 +13,9 @@
 
 #define LOGGER_TAG "PING RESPONSE"
 
-void handle_ping(sshnpd_params *params, atclient_monitor_response *message, char *ping_response, atclient *atclient,
-                 pthread_mutex_t *atclient_lock) {
-  int ret = 1;
+static void ping_response_sent(int ret, const atclient_atkey *atkey, void *ctx);
+
+void handle_ping(sshnpd_params *params, atclient_monitor_response *message, char *ping_response, notify_queue *queue) {
   atclient_atkey pingkey;
   atclient_atkey_init(&pingkey);
 
@@ -28,44 +29,25 @@ void handle_ping(sshnpd_params *params, atclient_monitor_response *message, char
   atclient_atkey_metadata_set_is_encrypted(metadata, true);
   atclient_atkey_metadata_set_ttl(metadata, 10000);
 
-  atclient_notify_params notify_params;
-  atclient_notify_params_init(&notify_params);
-  if ((ret = atclient_notify_params_set_atkey(&notify_params, &pingkey)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set atkey in notify params\n");
-    goto exit_ping;
-  }
-
-  if ((ret = atclient_notify_params_set_operation(&notify_params, ATCLIENT_NOTIFY_OPERATION_UPDATE)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set operation in notify params\n");
-    goto exit_ping;
+  // Don't wait for the atServer, the sender thread reports the result in ping_response_sent
+  if (notify_queue_push(queue, &pingkey, ping_response, ping_response_sent, NULL) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to queue ping response to %s\n",
+             message->notification.from);
   }
 
-  if ((ret = atclient_notify_params_set_value(&notify_params, ping_response)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set value in notify params\n");
-    goto exit_ping;
-  }
+  atclient_atkey_free(&pingkey);
+  return;
+}
 
-  ret = pthread_mutex_lock(atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Failed to get a lock on atclient for sending a notification\n");
-    goto exit_ping;
+static void ping_response_sent(int ret, const atclient_atkey *atkey, void *ctx) {
+  (void)ctx;
+  if (ret == 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Sent ping response\n");
+    return;
   }
 
-  ret = atclient_notify(atclient, &notify_params, NULL);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to send ping response to %s\n",
-                 message->notification.from);
-  }
-  ret = pthread_mutex_unlock(atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release atclient lock\n");
-    exit(1);
-  } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Released the atclient lock\n");
-  }
-exit_ping:
-  atclient_notify_params_free(&notify_params);
-  atclient_atkey_free(&pingkey);
-  return;
+  char *atkey_str = NULL;
+  atclient_atkey_to_string(atkey, &atkey_str);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to send ping response: %s\n", atkey_str);
+  free(atkey_str);
 }
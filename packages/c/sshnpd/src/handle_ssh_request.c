@@ -1,3 +1,4 @@
+#include "srv/log.h"
 #include "sshnpd/params.h"
 #include <atchops/aes.h>
 #include <atchops/base64.h>
@@ -12,6 +13,7 @@
 #include <pthread.h>
 #include <sshnpd/handle_ssh_request.h>
 #include <sshnpd/handler_commons.h>
+#include <sshnpd/metrics.h>
 #include <sshnpd/run_srv_process.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,60 +23,89 @@
 #define LOGGER_TAG "SSH_REQUEST"
 
 // TODO: refactor this to call the new common handlers
-void handle_ssh_request(atclient *atclient, pthread_mutex_t *atclient_lock, sshnpd_params *params,
-                        bool *is_child_process, atclient_monitor_response *message,
-                        atchops_rsa_key_private_key signing_key) {
+void handle_ssh_request(atclient_pool *pool, notify_queue *queue, replay_filter *replays, session_table *sessions,
+                        sshnpd_params *params, bool *is_child_process, atclient_monitor_response *message,
+                        atchops_rsa_key_private_key signing_key, request_trace *trace) {
   int res = 0;
 
+  request_trace_begin(trace, "extract_envelope");
   cJSON *envelope = extract_envelope_from_notification(message);
   if (envelope == NULL) {
+    metrics_inc(METRIC_REQUESTS_REJECTED_BAD_ENVELOPE);
     return;
   }
   // allocated: envelope
 
+  // Validate and decode everything we expect to be in the envelope up front, the handler only reads the struct
+  request_trace_begin(trace, "decode_request");
+  ssh_request request;
+  enum metric_counter rejected = METRIC_COUNTERS;
+  if (decode_ssh_request(envelope, &request) != 0) {
+    rejected = METRIC_REQUESTS_REJECTED_BAD_ENVELOPE;
+  } else if (is_request_stale(params, message, request.envelope.timestamp)) {
+    rejected = METRIC_REQUESTS_REJECTED_STALE;
+  } else if (is_request_replayed(replays, request.envelope.session_id)) {
+    rejected = METRIC_REQUESTS_REJECTED_REPLAYED;
+  }
+  if (rejected != METRIC_COUNTERS) {
+    metrics_inc(rejected);
+    cJSON_Delete(envelope);
+    return;
+  }
+
   // log envelope
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Received envelope: %s\n", cJSON_Print(envelope));
+  if (log_enabled(ATLOGGER_LOGGING_LEVEL_DEBUG)) {
+    char *envelope_str = cJSON_Print(envelope);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Received envelope: %s\n", envelope_str);
+    cJSON_free(envelope_str);
+  }
 
+  request_trace_begin(trace, "verify_signature");
   char *requesting_atsign = message->notification.from;
-  res = verify_envelope_signature_from(envelope, requesting_atsign, atclient, atclient_lock);
+  res = verify_envelope_signature_from(&request.envelope, requesting_atsign, pool);
 
   if (res != 0) {
+    metrics_inc(METRIC_REQUESTS_REJECTED_BAD_SIGNATURE);
     cJSON_Delete(envelope);
     return;
   }
+  // Only remember sessionIds from verified requests, so nobody else can block a session by sending its id first
+  remember_request(replays, request.envelope.session_id);
 
-  // First validate the types of everything we expect to be in the envelope
-  res = verify_envelope_contents(envelope, payload_type_ssh);
-
-  if (res != 0) {
+  request_trace_begin(trace, "admit_session");
+  if (!admit_session(sessions, request.envelope.session_id, queue, params, requesting_atsign)) {
+    metrics_inc(METRIC_REQUESTS_REJECTED_SESSION_LIMIT);
     cJSON_Delete(envelope);
     return;
   }
-  cJSON *payload = cJSON_GetObjectItem(envelope, "payload");
 
-  bool authenticate_to_rvd = cJSON_IsTrue(cJSON_GetObjectItem(payload, "authenticateToRvd"));
+  bool authenticate_to_rvd = request.envelope.authenticate_to_rvd;
   char *rvd_auth_string;
 
   if (authenticate_to_rvd) {
-    res = create_rvd_auth_string(payload, &signing_key, &rvd_auth_string);
+    request_trace_begin(trace, "create_rvd_auth_string");
+    res = create_rvd_auth_string(&request.envelope, &signing_key, &rvd_auth_string);
     if (res != 0) {
+      metrics_inc(METRIC_REQUESTS_FAILED);
       cJSON_Delete(envelope);
       return;
     }
     // allocated: rvd_auth_string
   }
 
-  bool encrypt_rvd_traffic = cJSON_IsTrue(cJSON_GetObjectItem(payload, "encryptRvdTraffic"));
+  bool encrypt_rvd_traffic = request.envelope.encrypt_rvd_traffic;
   unsigned char *session_aes_key = NULL;
   unsigned char *session_iv = NULL;
   unsigned char *session_aes_key_base64 = NULL;
   unsigned char *session_iv_base64 = NULL;
 
   if (encrypt_rvd_traffic) {
-    res = setup_rvd_session_encryption(payload, &session_aes_key, &session_aes_key_base64, &session_iv,
+    request_trace_begin(trace, "setup_rvd_session_encryption");
+    res = setup_rvd_session_encryption(&request.envelope, &session_aes_key, &session_aes_key_base64, &session_iv,
                                        &session_iv_base64);
     if (res != 0) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to setup rvd session encryption");
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to setup rvd session encryption");
+      metrics_inc(METRIC_REQUESTS_FAILED);
       return;
     }
   }
@@ -86,7 +117,8 @@ void handle_ssh_request(atclient *atclient, pthread_mutex_t *atclient_lock, sshn
   // - session_aes_key_base64 (if encrypt_rvd_traffic == true)
   // - session_iv_base64 (if encrypt_rvd_traffic == true)
 
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Running fork()...\n");
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Running fork()...\n");
+  request_trace_begin(trace, "fork");
 
   pid_t pid = fork();
   int status;
@@ -100,15 +132,16 @@ void handle_ssh_request(atclient *atclient, pthread_mutex_t *atclient_lock, sshn
       free(session_iv_base64);
     }
 
-    char *rvd_host_str = cJSON_GetStringValue(cJSON_GetObjectItem(payload, "host"));
-    uint16_t rvd_port_int = cJSON_GetNumberValue(cJSON_GetObjectItem(payload, "port"));
+    char *rvd_host_str = request.host;
+    uint16_t rvd_port_int = request.port;
     char *requested_host_str = "localhost";
     uint16_t requested_port_int = params->local_sshd_port;
 
     const bool multi = false;
 
     int res = run_srv_process(rvd_host_str, rvd_port_int, requested_host_str, requested_port_int, authenticate_to_rvd,
-                              rvd_auth_string, encrypt_rvd_traffic, multi, session_aes_key, session_iv);
+                              rvd_auth_string, encrypt_rvd_traffic, multi, session_aes_key, session_iv,
+                              params->srv_stats_fd);
 
     *is_child_process = true;
 
@@ -132,29 +165,39 @@ void handle_ssh_request(atclient *atclient, pthread_mutex_t *atclient_lock, sshn
     int waitpid_return = waitpid(pid, &status, WNOHANG); // Don't wait for srv - we want it to be running in the bg
     if (waitpid_return > 0) {
       // child process has already exited
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "srv process has already exited\n");
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "srv process has already exited\n");
       if (WIFEXITED(status)) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "srv process exited with status %d\n", status);
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "srv process exited with status %d\n", status);
       } else {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "srv process exited abnormally\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "srv process exited abnormally\n");
       }
+      metrics_inc(METRIC_REQUESTS_FAILED);
       goto cancel;
     } else if (waitpid_return == -1) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to wait for srv process: %s\n", strerror(errno));
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to wait for srv process: %s\n", strerror(errno));
+      metrics_inc(METRIC_REQUESTS_FAILED);
       goto cancel;
     }
 
-    res = send_success_payload(payload, atclient, atclient_lock, params, session_aes_key_base64, session_iv_base64,
+    // The session lasts until main reaps the srv process
+    if (session_table_add(sessions, pid, requesting_atsign) != 0) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to record the session for %s\n", requesting_atsign);
+    }
+
+    request_trace_begin(trace, "send_success_payload");
+    res = send_success_payload(request.envelope.session_id, queue, params, session_aes_key_base64, session_iv_base64,
                                &signing_key, requesting_atsign);
+    metrics_inc(res == 0 ? METRIC_REQUESTS_ACCEPTED : METRIC_REQUESTS_FAILED);
     if (res != 0) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                   "Failed to send success message to the requesting atsign: %s\n", requesting_atsign);
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+               "Failed to send success message to the requesting atsign: %s\n", requesting_atsign);
       goto cancel;
     }
 
     // end of parent process
   } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to fork the srv process: %s\n", strerror(errno));
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to fork the srv process: %s\n", strerror(errno));
+    metrics_inc(METRIC_REQUESTS_FAILED);
   }
 cancel:
   if (authenticate_to_rvd) {
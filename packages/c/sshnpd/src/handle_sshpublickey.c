@@ -1,3 +1,4 @@
+#include "srv/log.h"
 #include "sshnpd/file_utils.h"
 #include "sshnpd/params.h"
 #include <atclient/monitor.h>
@@ -11,11 +12,9 @@ static char *supported_key_prefix_map[] = {
     [SKP_RSA] = "ssh-rsa", [SKP_ED9] = "ssh-ed25519",
 };
 
-void handle_sshpublickey(sshnpd_params *params, atclient_monitor_response *message, FILE *authkeys_file,
-                         char *authkeys_filename) {
+void handle_sshpublickey(sshnpd_params *params, atclient_monitor_response *message, authorized_keys *authkeys) {
   if (!params->sshpublickey) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Ignoring sshpublickey from %s\n",
-                 message->notification.from);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Ignoring sshpublickey from %s\n", message->notification.from);
     return;
   }
 
@@ -38,22 +37,19 @@ void handle_sshpublickey(sshnpd_params *params, atclient_monitor_response *messa
   }
 
   if (!is_valid_prefix) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Ssh public key does not look like a public key\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Ssh public key does not look like a public key\n");
     return;
   }
 
-  authkeys_params authkeys_params = {};
-  authkeys_params.authkeys_file = authkeys_file;
-  authkeys_params.authkeys_filename = authkeys_filename;
-  authkeys_params.permissions = "";
-  authkeys_params.key = ssh_key;
-
-  // authorize public key
-  int ret = authorize_ssh_public_key(&authkeys_params);
+  // authorize public key, it is written out with the rest of the batch before the next ssh or npt request is handled
+  bool added;
+  int ret = authorized_keys_add(authkeys, "", ssh_key, &added);
   if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to authorize ssh public key\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to authorize ssh public key\n");
     return;
   }
 
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Authorized public key\n");
+  if (added) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Authorized public key\n");
+  }
 }
@@ -2,8 +2,7 @@
 #include "atchops/base64.h"
 #include "atchops/iv.h"
 #include "atchops/rsa.h"
-#include "atclient/notify.h"
-#include "atclient/notify_params.h"
+#include "srv/log.h"
 #include "sshnpd/params.h"
 #include "sshnpd/sshnpd.h"
 #include <atchops/constants.h>
@@ -11,53 +10,42 @@
 #include <atcommons/json.h>
 #include <atlogger/atlogger.h>
 #include <sshnpd/handler_commons.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define LOGGER_TAG "HANDLER_COMMONS"
 
-int verify_envelope_signature_from(cJSON *envelope, char *requesting_atsign, atclient *atclient,
-                                   pthread_mutex_t *atclient_lock) {
-  cJSON *signature = cJSON_GetObjectItem(envelope, "signature");
-  cJSON *hashing_algo = cJSON_GetObjectItem(envelope, "hashingAlgo");
-  cJSON *signing_algo = cJSON_GetObjectItem(envelope, "signingAlgo");
-  cJSON *payload = cJSON_GetObjectItem(envelope, "payload");
+static void final_response_sent(int ret, const atclient_atkey *atkey, void *ctx);
 
+int verify_envelope_signature_from(request_envelope *envelope, char *requesting_atsign, atclient_pool *pool) {
   int res = 0;
   atclient_atkey atkey;
   atclient_atkey_init(&atkey);
 
   if ((res = atclient_atkey_create_public_key(&atkey, "publickey", requesting_atsign, NULL)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create public key\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create public key\n");
     return 1;
   }
 
-  res = pthread_mutex_lock(atclient_lock);
-  if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Failed to get a lock on atclient for sending a notification\n");
+  atclient *atclient = atclient_pool_checkout(pool, "verify_envelope_signature");
+  if (atclient == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to check out an atclient to get the public key\n");
     atclient_atkey_free(&atkey);
     return 1;
-  } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Locked the atclient\n");
   }
-  // TODO lock wrap
+
   char *buffer = NULL;
   res = atclient_get_public_key(atclient, &atkey, &buffer, NULL);
+  atclient_pool_checkin(pool, atclient);
   atclient_atkey_free(&atkey);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get public key\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get public key\n");
     return 1;
   }
 
-  res = pthread_mutex_unlock(atclient_lock);
-  if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release atclient lock\n");
-    exit(1);
-  } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Released the atclient lock\n");
-  }
-
   atchops_rsa_key_public_key requesting_atsign_publickey;
   atchops_rsa_key_public_key_init(&requesting_atsign_publickey);
 
@@ -67,30 +55,27 @@ int verify_envelope_signature_from(cJSON *envelope, char *requesting_atsign, atc
     return 1;
   }
 
-  char *signature_str = cJSON_GetStringValue(signature);
-  char *hashing_algo_str = cJSON_GetStringValue(hashing_algo);
-  char *signing_algo_str = cJSON_GetStringValue(signing_algo);
-
   size_t valueolen = 0;
-  res = atchops_base64_decode((unsigned char *)signature_str, strlen(signature_str), (unsigned char *)buffer,
-                              strlen(buffer), &valueolen);
+  res = atchops_base64_decode((unsigned char *)envelope->signature, strlen(envelope->signature),
+                              (unsigned char *)buffer, strlen(buffer), &valueolen);
 
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "atchops_base64_decode: %d\n", res);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "atchops_base64_decode: %d\n", res);
     free(buffer);
     return 1;
   }
 
-  char *payloadstr = cJSON_PrintUnformatted(payload);
+  // The signature is over the payload as the client serialized it, which cJSON reproduces for the payloads we accept
+  char *payloadstr = cJSON_PrintUnformatted(envelope->payload);
   res = verify_envelope_signature(&requesting_atsign_publickey, (const unsigned char *)payloadstr,
-                                  (unsigned char *)buffer, hashing_algo_str, signing_algo_str);
+                                  (unsigned char *)buffer, envelope->hashing_algo, envelope->signing_algo);
 
   free(buffer);
   atchops_rsa_key_public_key_free(&requesting_atsign_publickey);
   cJSON_free(payloadstr);
 
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to verify envelope signature\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to verify envelope signature\n");
   }
 
   return res;
@@ -105,21 +90,21 @@ int verify_envelope_signature(atchops_rsa_key_public_key *publickey, const unsig
   if (strcmp(hashing_algo, "sha256") == 0) {
     mdtype = ATCHOPS_MD_SHA256;
   } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Unsupported hash type for envelope verify\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Unsupported hash type for envelope verify\n");
     return -1;
   }
   if (strcmp(signing_algo, "rsa2048") == 0) {
     ret = atchops_rsa_verify(publickey, mdtype, payload, strlen((char *)payload), signature);
     if (ret != 0) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "verify_envelope_signature (failed)\n");
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "verify_envelope_signature (failed)\n");
       return -1;
     }
   } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Unsupported signing algo for envelope verify");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Unsupported signing algo for envelope verify");
     return -1;
   }
 
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "verify_envelope_signature (success)\n");
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "verify_envelope_signature (success)\n");
 
   return ret;
 }
@@ -127,122 +112,227 @@ int verify_envelope_signature(atchops_rsa_key_public_key *publickey, const unsig
 cJSON *extract_envelope_from_notification(atclient_monitor_response *message) {
   // Sanity check the notification
   if (!atclient_atnotification_is_from_initialized(&message->notification) && message->notification.from != NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to initialize the from field of the notification\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to initialize the from field of the notification\n");
     return NULL;
   }
 
   if (!atclient_atnotification_is_decrypted_value_initialized(&message->notification) &&
       message->notification.decrypted_value != NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Failed to initialize the decrypted value of the notification\n");
-    return NULL;
-  }
-
-  // Get the decrypted envelope
-  char *decrypted_json = malloc(sizeof(char) * (strlen(message->notification.decrypted_value) + 1));
-  if (decrypted_json == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory to decrypt the envelope\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+             "Failed to initialize the decrypted value of the notification\n");
     return NULL;
   }
 
-  memcpy(decrypted_json, message->notification.decrypted_value, strlen(message->notification.decrypted_value));
-  *(decrypted_json + strlen(message->notification.decrypted_value)) = '\0';
-
   // log the decrypted json
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Decrypted json: %s\n", decrypted_json);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Decrypted json: %s\n", message->notification.decrypted_value);
 
-  // Parse it to cJSON*
-  cJSON *envelope = cJSON_Parse(decrypted_json);
-  free(decrypted_json);
+  // Parse it to cJSON* straight from the notification, cJSON doesn't modify its input so there's no need for a copy
+  cJSON *envelope = cJSON_Parse(message->notification.decrypted_value);
   if (envelope == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to parse the decrypted notification\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to parse the decrypted notification\n");
   }
   return envelope;
 }
 
-int verify_envelope_contents(cJSON *envelope, enum payload_type type) {
-  bool has_valid_values = cJSON_IsObject(envelope);
+bool is_request_stale(sshnpd_params *params, atclient_monitor_response *message, int64_t timestamp) {
+  if (params->request_max_age <= 0) {
+    return false;
+  }
 
-  if (!has_valid_values) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to parse the envelope\n");
-    return 1;
+  int64_t now_ms = (int64_t)time(NULL) * 1000;
+  int64_t max_age_ms = (int64_t)params->request_max_age * 1000;
+
+  if (atclient_atnotification_is_epoch_millis_initialized(&message->notification) &&
+      now_ms - message->notification.epoch_millis > max_age_ms) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Ignoring stale request %s, sent %lld seconds ago\n",
+             message->notification.id, (long long)((now_ms - message->notification.epoch_millis) / 1000));
+    return true;
   }
 
-  // These 4 values are always required for a signed envelope
-  cJSON *payload = cJSON_GetObjectItem(envelope, "payload");
-  has_valid_values = has_valid_values && cJSON_IsObject(payload) &&
-                     cJSON_IsString(cJSON_GetObjectItem(envelope, "signature")) &&
-                     cJSON_IsString(cJSON_GetObjectItem(envelope, "hashingAlgo")) &&
-                     cJSON_IsString(cJSON_GetObjectItem(envelope, "signingAlgo"));
+  if (timestamp > 0 && now_ms - timestamp > max_age_ms) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Ignoring stale request %s, payload timestamp is %lld\n",
+             message->notification.id, (long long)timestamp);
+    return true;
+  }
 
-  if (!has_valid_values) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received invalid envelope format\n");
-    return 1;
+  return false;
+}
+
+bool is_request_replayed(replay_filter *replays, const char *session_id) {
+  if (!replay_filter_contains(replays, session_id, time(NULL))) {
+    return false;
   }
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Ignoring duplicate request for session %s\n", session_id);
+  return true;
+}
 
-  return verify_payload_contents(payload, type);
+void remember_request(replay_filter *replays, const char *session_id) {
+  replay_filter_insert(replays, session_id, time(NULL));
 }
 
-int verify_payload_contents(cJSON *payload, enum payload_type type) {
-  bool has_valid_values = cJSON_IsObject(payload);
+bool admit_session(session_table *sessions, const char *session_id, notify_queue *queue, sshnpd_params *params,
+                   const char *requesting_atsign) {
+  const char *error;
+  switch (session_table_admit(sessions, requesting_atsign, time(NULL))) {
+  case SESSION_ADMITTED:
+    return true;
+  case SESSION_RATE_LIMITED:
+    error = "Too many session requests, try again later";
+    break;
+  case SESSION_REQUESTER_AT_MAX:
+    error = "Too many live sessions for this atSign";
+    break;
+  case SESSION_TABLE_AT_MAX:
+  default:
+    error = "Too many live sessions on this device";
+    break;
+  }
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Refusing session for %s: %s\n", requesting_atsign, error);
+  send_error_response(session_id, queue, params, requesting_atsign, error);
+  return false;
+}
 
-  has_valid_values = cJSON_IsString(cJSON_GetObjectItem(payload, "sessionId"));
+// Decode one payload field shared by all request types, returns false if key isn't one of them
+static bool decode_common_field(cJSON *item, request_envelope *envelope, bool *valid) {
+  const char *key = item->string;
+  if (strcmp(key, "sessionId") == 0) {
+    envelope->session_id = cJSON_GetStringValue(item);
+    *valid = *valid && envelope->session_id != NULL;
+  } else if (strcmp(key, "timestamp") == 0) {
+    envelope->timestamp = cJSON_IsNumber(item) ? (int64_t)cJSON_GetNumberValue(item) : 0;
+  } else if (strcmp(key, "authenticateToRvd") == 0) {
+    envelope->authenticate_to_rvd = cJSON_IsTrue(item);
+  } else if (strcmp(key, "encryptRvdTraffic") == 0) {
+    envelope->encrypt_rvd_traffic = cJSON_IsTrue(item);
+  } else if (strcmp(key, "clientNonce") == 0) {
+    envelope->client_nonce = cJSON_GetStringValue(item);
+  } else if (strcmp(key, "rvdNonce") == 0) {
+    envelope->rvd_nonce = cJSON_GetStringValue(item);
+  } else if (strcmp(key, "clientEphemeralPK") == 0) {
+    envelope->client_ephemeral_pk = cJSON_GetStringValue(item);
+  } else if (strcmp(key, "clientEphemeralPKType") == 0) {
+    envelope->client_ephemeral_pk_type = cJSON_GetStringValue(item);
+  } else {
+    return false;
+  }
+  return true;
+}
 
-  switch (type) {
-  case payload_type_ssh: {
-    cJSON *direct = cJSON_GetObjectItem(payload, "direct");
-    has_valid_values = cJSON_IsBool(direct);
+// Decode the outer envelope, the 4 values always required for a signed envelope
+static int decode_envelope(cJSON *json, request_envelope *envelope) {
+  memset(envelope, 0, sizeof(request_envelope));
+  if (!cJSON_IsObject(json)) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to parse the envelope\n");
+    return 1;
+  }
 
-    if (!has_valid_values) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Couldn't determine if payload is direct\n");
-      return 1;
+  for (cJSON *item = json->child; item != NULL; item = item->next) {
+    if (strcmp(item->string, "payload") == 0) {
+      envelope->payload = cJSON_IsObject(item) ? item : NULL;
+    } else if (strcmp(item->string, "signature") == 0) {
+      envelope->signature = cJSON_GetStringValue(item);
+    } else if (strcmp(item->string, "hashingAlgo") == 0) {
+      envelope->hashing_algo = cJSON_GetStringValue(item);
+    } else if (strcmp(item->string, "signingAlgo") == 0) {
+      envelope->signing_algo = cJSON_GetStringValue(item);
     }
+  }
 
-    if (!cJSON_IsTrue(direct)) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Only direct mode is supported by this device\n");
-      return 1;
-    }
+  if (envelope->payload == NULL || envelope->signature == NULL || envelope->hashing_algo == NULL ||
+      envelope->signing_algo == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received invalid envelope format\n");
+    return 1;
+  }
+  return 0;
+}
 
-    has_valid_values = has_valid_values && cJSON_IsString(cJSON_GetObjectItem(payload, "host")) &&
-                       cJSON_IsNumber(cJSON_GetObjectItem(payload, "port"));
-    break;
+int decode_ssh_request(cJSON *json, ssh_request *request) {
+  memset(request, 0, sizeof(ssh_request));
+  if (decode_envelope(json, &request->envelope) != 0) {
+    return 1;
   }
-  case payload_type_npt: {
-    has_valid_values = has_valid_values && cJSON_IsString(cJSON_GetObjectItem(payload, "rvdHost")) &&
-                       cJSON_IsNumber(cJSON_GetObjectItem(payload, "rvdPort")) &&
-                       cJSON_IsString(cJSON_GetObjectItem(payload, "requestedHost"));
 
-    cJSON *requested_port = cJSON_GetObjectItem(payload, "requestedPort");
-    has_valid_values = has_valid_values && cJSON_IsNumber(requested_port) && cJSON_GetNumberValue(requested_port) > 0;
-    break;
+  bool valid = true;
+  cJSON *direct = NULL;
+  cJSON *port = NULL;
+  for (cJSON *item = request->envelope.payload->child; item != NULL; item = item->next) {
+    if (decode_common_field(item, &request->envelope, &valid)) {
+      continue;
+    }
+    if (strcmp(item->string, "direct") == 0) {
+      direct = item;
+    } else if (strcmp(item->string, "host") == 0) {
+      request->host = cJSON_GetStringValue(item);
+    } else if (strcmp(item->string, "port") == 0) {
+      port = item;
+    }
   }
+
+  if (!cJSON_IsBool(direct)) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Couldn't determine if payload is direct\n");
+    return 1;
+  }
+  if (!cJSON_IsTrue(direct)) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Only direct mode is supported by this device\n");
+    return 1;
   }
 
-  if (!has_valid_values) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received invalid payload format\n");
+  valid = valid && request->envelope.session_id != NULL && request->host != NULL && cJSON_IsNumber(port);
+  if (!valid) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received invalid payload format\n");
     return 1;
   }
+  request->port = cJSON_GetNumberValue(port);
   return 0;
 }
 
-int create_rvd_auth_string(cJSON *payload, atchops_rsa_key_private_key *signing_key, char **rvd_auth_string) {
+int decode_npt_request(cJSON *json, npt_request *request) {
+  memset(request, 0, sizeof(npt_request));
+  if (decode_envelope(json, &request->envelope) != 0) {
+    return 1;
+  }
 
-  (void)(rvd_auth_string); // Tell the compiler to be quiet about output parameters
+  bool valid = true;
+  cJSON *rvd_port = NULL;
+  cJSON *requested_port = NULL;
+  for (cJSON *item = request->envelope.payload->child; item != NULL; item = item->next) {
+    if (decode_common_field(item, &request->envelope, &valid)) {
+      continue;
+    }
+    if (strcmp(item->string, "rvdHost") == 0) {
+      request->rvd_host = cJSON_GetStringValue(item);
+    } else if (strcmp(item->string, "rvdPort") == 0) {
+      rvd_port = item;
+    } else if (strcmp(item->string, "requestedHost") == 0) {
+      request->requested_host = cJSON_GetStringValue(item);
+    } else if (strcmp(item->string, "requestedPort") == 0) {
+      requested_port = item;
+    }
+  }
 
-  cJSON *client_nonce = cJSON_GetObjectItem(payload, "clientNonce");
-  cJSON *rvd_nonce = cJSON_GetObjectItem(payload, "rvdNonce");
-  bool has_valid_values = cJSON_IsString(client_nonce) && cJSON_IsString(rvd_nonce);
+  valid = valid && request->envelope.session_id != NULL && request->rvd_host != NULL && cJSON_IsNumber(rvd_port) &&
+          request->requested_host != NULL && cJSON_IsNumber(requested_port) &&
+          cJSON_GetNumberValue(requested_port) > 0;
+  if (!valid) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received invalid payload format\n");
+    return 1;
+  }
+  request->rvd_port = cJSON_GetNumberValue(rvd_port);
+  request->requested_port = cJSON_GetNumberValue(requested_port);
+  return 0;
+}
 
-  if (!has_valid_values) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Missing nonce values, cannot create auth string for rvd\n");
+int create_rvd_auth_string(request_envelope *envelope, atchops_rsa_key_private_key *signing_key,
+                           char **rvd_auth_string) {
+  if (envelope->client_nonce == NULL || envelope->rvd_nonce == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Missing nonce values, cannot create auth string for rvd\n");
     return 1;
   }
 
   cJSON *rvd_auth_payload = cJSON_CreateObject();
-  cJSON *session_id = cJSON_GetObjectItem(payload, "sessionId");
-  cJSON_AddItemReferenceToObject(rvd_auth_payload, "sessionId", session_id);
-  cJSON_AddItemReferenceToObject(rvd_auth_payload, "clientNonce", client_nonce);
-  cJSON_AddItemReferenceToObject(rvd_auth_payload, "rvdNonce", rvd_nonce);
+  cJSON_AddStringToObject(rvd_auth_payload, "sessionId", envelope->session_id);
+  cJSON_AddStringToObject(rvd_auth_payload, "clientNonce", envelope->client_nonce);
+  cJSON_AddStringToObject(rvd_auth_payload, "rvdNonce", envelope->rvd_nonce);
 
   cJSON *res_envelope = cJSON_CreateObject();
   cJSON_AddItemReferenceToObject(res_envelope, "payload", rvd_auth_payload);
@@ -254,7 +344,7 @@ int create_rvd_auth_string(cJSON *payload, atchops_rsa_key_private_key *signing_
                              strlen((char *)signing_input), signature);
   cJSON_free(signing_input);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to sign the auth string payload\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to sign the auth string payload\n");
     cJSON_Delete(rvd_auth_payload);
     cJSON_Delete(res_envelope);
     return res;
@@ -266,7 +356,7 @@ int create_rvd_auth_string(cJSON *payload, atchops_rsa_key_private_key *signing_
   size_t sig_len;
   res = atchops_base64_encode(signature, 256, base64signature, 384, &sig_len);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to base64 encode the auth string payload\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to base64 encode the auth string payload\n");
     cJSON_Delete(rvd_auth_payload);
     cJSON_Delete(res_envelope);
     return res;
@@ -281,39 +371,36 @@ int create_rvd_auth_string(cJSON *payload, atchops_rsa_key_private_key *signing_
   cJSON_Delete(res_envelope);
 
   if (*rvd_auth_string == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to write auth string from rvd auth envelope\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to write auth string from rvd auth envelope\n");
     return 1;
   }
   return 0;
 }
 
-int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key,
+int setup_rvd_session_encryption(request_envelope *envelope, unsigned char **session_aes_key,
                                  unsigned char **session_aes_key_base64, unsigned char **session_iv,
                                  unsigned char **session_iv_base64) {
-  cJSON *client_ephemeral_pk = cJSON_GetObjectItem(payload, "clientEphemeralPK");
-  cJSON *client_ephemeral_pk_type = cJSON_GetObjectItem(payload, "clientEphemeralPKType");
   unsigned char key[32], iv[16];
   unsigned char *session_aes_key_encrypted, *session_iv_encrypted;
   size_t session_aes_key_len, session_iv_len, session_aes_key_encrypted_len, session_iv_encrypted_len;
 
   bool is_valid = false;
-  bool has_valid_values = cJSON_IsString(client_ephemeral_pk) && cJSON_IsString(client_ephemeral_pk_type);
-  if (!has_valid_values) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "encryptRvdTraffic was requested, but no client ephemeral public key / key type was provided\n");
+  if (envelope->client_ephemeral_pk == NULL || envelope->client_ephemeral_pk_type == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+             "encryptRvdTraffic was requested, but no client ephemeral public key / key type was provided\n");
     return 1;
   }
   int res = 0;
 
   memset(key, 0, BYTES(32));
   if ((res = atchops_aes_generate_key(key, ATCHOPS_AES_256)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session aes key\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session aes key\n");
     return res;
   }
 
   *session_aes_key = malloc(sizeof(unsigned char) * 49);
   if (*session_aes_key == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "unable to allocate memory for: session_aes_key");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "unable to allocate memory for: session_aes_key");
     free(*session_aes_key);
     return 1;
   }
@@ -321,21 +408,21 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
   memset(*session_aes_key, 0, BYTES(49));
   res = atchops_base64_encode(key, 32, *session_aes_key, 49, &session_aes_key_len);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session aes key\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session aes key\n");
     free(*session_aes_key);
     return res;
   }
 
   memset(iv, 0, BYTES(16));
   if ((res = atchops_iv_generate(iv)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session iv\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session iv\n");
     free(*session_aes_key);
     return res;
   }
 
   *session_iv = malloc(sizeof(unsigned char) * 25);
   if (*session_iv == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "unable to allocate memory for: session_iv");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "unable to allocate memory for: session_iv");
     free(*session_aes_key);
     return 1;
   }
@@ -343,14 +430,14 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
   memset(*session_iv, 0, BYTES(25));
   res = atchops_base64_encode(iv, 16, *session_iv, 25, &session_iv_len);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session iv\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to generate session iv\n");
     free(*session_aes_key);
     free(*session_iv);
     return res;
   }
 
-  char *pk_type = cJSON_GetStringValue(client_ephemeral_pk_type);
-  char *pk = cJSON_GetStringValue(client_ephemeral_pk);
+  const char *pk_type = envelope->client_ephemeral_pk_type;
+  const char *pk = envelope->client_ephemeral_pk;
 
   switch (strlen(pk_type)) {
   case 7: { // rsa2048 is the only valid type right now
@@ -361,7 +448,7 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
 
       res = atchops_rsa_key_populate_public_key(&ac, pk, strlen(pk));
       if (res != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to populate client ephemeral pk\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to populate client ephemeral pk\n");
         atchops_rsa_key_public_key_free(&ac);
         free(*session_aes_key);
         free(*session_iv);
@@ -370,8 +457,8 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
 
       session_aes_key_encrypted = malloc(BYTES(256));
       if (session_aes_key_encrypted == NULL) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                     "Failed to allocate memory to encrypt the session aes key\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+                 "Failed to allocate memory to encrypt the session aes key\n");
         atchops_rsa_key_public_key_free(&ac);
         free(*session_aes_key);
         free(*session_iv);
@@ -380,7 +467,7 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
 
       res = atchops_rsa_encrypt(&ac, *session_aes_key, session_aes_key_len, session_aes_key_encrypted);
       if (res != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to encrypt the session aes key\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to encrypt the session aes key\n");
         atchops_rsa_key_public_key_free(&ac);
         free(*session_aes_key);
         free(*session_iv);
@@ -393,8 +480,8 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
 
       *session_aes_key_base64 = malloc(BYTES(session_aes_key_len));
       if (*session_aes_key_base64 == NULL) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                     "Failed to allocate memory to base64 encode the session aes key\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+                 "Failed to allocate memory to base64 encode the session aes key\n");
         atchops_rsa_key_public_key_free(&ac);
         free(*session_aes_key);
         free(*session_iv);
@@ -409,7 +496,7 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
       // No longer need this
       free(session_aes_key_encrypted);
       if (res != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to base64 encode the session aes key\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to base64 encode the session aes key\n");
         atchops_rsa_key_public_key_free(&ac);
         free(*session_aes_key);
         free(*session_iv);
@@ -419,7 +506,7 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
 
       session_iv_encrypted = malloc(BYTES(256));
       if (session_iv_encrypted == NULL) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory to encrypt the session iv\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory to encrypt the session iv\n");
         atchops_rsa_key_public_key_free(&ac);
         free(*session_aes_key);
         free(*session_iv);
@@ -431,7 +518,7 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
       res = atchops_rsa_encrypt(&ac, *session_iv, session_iv_len, session_iv_encrypted);
       atchops_rsa_key_public_key_free(&ac);
       if (res != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to encrypt the session iv\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to encrypt the session iv\n");
         free(session_iv_encrypted);
         free(*session_aes_key);
         free(*session_iv);
@@ -443,8 +530,8 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
       session_iv_len = session_iv_encrypted_len * 3 / 2; // reusing this since we can
       *session_iv_base64 = malloc(BYTES(session_iv_len));
       if (*session_iv_base64 == NULL) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                     "Failed to allocate memory to base64 encode the session iv\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+                 "Failed to allocate memory to base64 encode the session iv\n");
         free(session_iv_encrypted);
         free(*session_aes_key);
         free(*session_iv);
@@ -459,7 +546,7 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
       // No longer need this
       free(session_iv_encrypted);
       if (res != 0) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to base64 encode the session iv\n");
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to base64 encode the session iv\n");
         free(*session_aes_key);
         free(*session_iv);
         free(*session_iv_base64);
@@ -471,22 +558,20 @@ int setup_rvd_session_encryption(cJSON *payload, unsigned char **session_aes_key
   } // switch
 
   if (!is_valid) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "%s is not an accepted key type for encrypting the aes key\n", pk_type);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+             "%s is not an accepted key type for encrypting the aes key\n", pk_type);
     return 1;
   }
   return res;
 }
 
-int send_success_payload(cJSON *payload, atclient *atclient, pthread_mutex_t *atclient_lock, sshnpd_params *params,
+int send_success_payload(const char *identifier, notify_queue *queue, sshnpd_params *params,
                          unsigned char *session_aes_key_base64, unsigned char *session_iv_base64,
                          atchops_rsa_key_private_key *signing_key, char *requesting_atsign) {
   int res = 0;
-  cJSON *session_id = cJSON_GetObjectItem(payload, "sessionId");
-  char *identifier = cJSON_GetStringValue(session_id);
   cJSON *final_res_payload = cJSON_CreateObject();
   cJSON_AddStringToObject(final_res_payload, "status", "connected");
-  cJSON_AddItemReferenceToObject(final_res_payload, "sessionId", session_id);
+  cJSON_AddStringToObject(final_res_payload, "sessionId", identifier);
   cJSON_AddStringToObject(final_res_payload, "sessionAESKey", (char *)session_aes_key_base64);
   cJSON_AddStringToObject(final_res_payload, "sessionIV", (char *)session_iv_base64);
 
@@ -499,7 +584,7 @@ int send_success_payload(cJSON *payload, atclient *atclient, pthread_mutex_t *at
   memset(signature, 0, 256);
   res = atchops_rsa_sign(signing_key, ATCHOPS_MD_SHA256, signing_input, strlen((char *)signing_input), signature);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to sign the final res payload\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to sign the final res payload\n");
     goto clean_json;
   }
 
@@ -509,8 +594,7 @@ int send_success_payload(cJSON *payload, atclient *atclient, pthread_mutex_t *at
   size_t sig_len;
   res = atchops_base64_encode(signature, 256, base64signature, 384, &sig_len);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Failed to base64 encode the final res payload's signature\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to base64 encode the final res payload's signature\n");
     goto clean_json;
   }
 
@@ -525,7 +609,7 @@ int send_success_payload(cJSON *payload, atclient *atclient, pthread_mutex_t *at
   size_t keynamelen = strlen(identifier) + strlen(params->device) + 2; // + 1 for '.' +1 for '\0'
   char *keyname = malloc(sizeof(char) * keynamelen);
   if (keyname == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for keyname");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for keyname");
     goto clean_final_res_value;
   }
 
@@ -535,7 +619,7 @@ int send_success_payload(cJSON *payload, atclient *atclient, pthread_mutex_t *at
   // print final_res_atkey
   char *final_res_atkey_str = NULL;
   atclient_atkey_to_string(&final_res_atkey, &final_res_atkey_str);
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Final response atkey: %s\n", final_res_atkey_str);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Final response atkey: %s\n", final_res_atkey_str);
   free(final_res_atkey_str);
 
   atclient_atkey_metadata *metadata = &final_res_atkey.metadata;
@@ -543,46 +627,13 @@ int send_success_payload(cJSON *payload, atclient *atclient, pthread_mutex_t *at
   atclient_atkey_metadata_set_is_encrypted(metadata, true);
   atclient_atkey_metadata_set_ttl(metadata, 10000);
 
-  atclient_notify_params notify_params;
-  atclient_notify_params_init(&notify_params);
-  if ((res = atclient_notify_params_set_atkey(&notify_params, &final_res_atkey)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set atkey in notify params\n");
-    goto clean_res;
-  }
-  if ((res = atclient_notify_params_set_value(&notify_params, final_res_value)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set value in notify params\n");
-    goto clean_res;
-  }
-  if ((res = atclient_notify_params_set_operation(&notify_params, ATCLIENT_NOTIFY_OPERATION_UPDATE)) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set operation in notify params\n");
-    goto clean_res;
-  }
-
-  char *final_keystr = NULL;
-  atclient_atkey_to_string(&final_res_atkey, &final_keystr);
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Final response atkey: %s\n", final_res_atkey_str);
-  free(final_keystr);
-
-  int ret = pthread_mutex_lock(atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Failed to get a lock on atclient for sending a notification\n");
-    goto clean_res;
-  }
-
-  ret = atclient_notify(atclient, &notify_params, NULL);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to send final response to %s\n", requesting_atsign);
-  }
-  ret = pthread_mutex_unlock(atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release atclient lock\n");
-    exit(1);
-  } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Released the atclient lock\n");
+  // Don't wait for the atServer, the sender thread reports the result in final_response_sent
+  res = notify_queue_push(queue, &final_res_atkey, final_res_value, final_response_sent, NULL);
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to queue final response to %s\n", requesting_atsign);
   }
 
-clean_res: { free(keyname); }
+  free(keyname);
 clean_final_res_value: {
   atclient_atkey_free(&final_res_atkey);
   cJSON_free(final_res_value);
@@ -593,3 +644,60 @@ clean_json: {
 }
   return res;
 }
+
+int send_busy_response(atclient_monitor_response *message, notify_queue *queue, sshnpd_params *params) {
+  cJSON *envelope = extract_envelope_from_notification(message);
+  if (envelope == NULL) {
+    return 1;
+  }
+  int res = 1;
+  char *identifier = cJSON_GetStringValue(cJSON_GetObjectItem(cJSON_GetObjectItem(envelope, "payload"), "sessionId"));
+  if (identifier == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Can't send a busy response without a sessionId\n");
+  } else {
+    res = send_error_response(identifier, queue, params, message->notification.from, "Device is busy, try again later");
+  }
+  cJSON_Delete(envelope);
+  return res;
+}
+
+int send_error_response(const char *identifier, notify_queue *queue, sshnpd_params *params,
+                        const char *requesting_atsign, const char *error) {
+  int res;
+  size_t keynamelen = strlen(identifier) + strlen(params->device) + 2; // + 1 for '.' +1 for '\0'
+  char keyname[keynamelen];
+  snprintf(keyname, keynamelen, "%s.%s", identifier, params->device);
+
+  atclient_atkey error_atkey;
+  atclient_atkey_init(&error_atkey);
+  res = atclient_atkey_create_shared_key(&error_atkey, keyname, params->atsign, requesting_atsign, SSHNP_NS);
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create the error response atkey\n");
+    goto clean_atkey;
+  }
+
+  atclient_atkey_metadata *metadata = &error_atkey.metadata;
+  atclient_atkey_metadata_set_is_public(metadata, false);
+  atclient_atkey_metadata_set_is_encrypted(metadata, true);
+  atclient_atkey_metadata_set_ttl(metadata, 10000);
+
+  res = notify_queue_push(queue, &error_atkey, error, final_response_sent, NULL);
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to queue error response to %s\n", requesting_atsign);
+  }
+
+clean_atkey: { atclient_atkey_free(&error_atkey); }
+  return res;
+}
+
+static void final_response_sent(int ret, const atclient_atkey *atkey, void *ctx) {
+  (void)ctx;
+  char *atkey_str = NULL;
+  atclient_atkey_to_string(atkey, &atkey_str);
+  if (ret == 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Sent final response: %s\n", atkey_str);
+  } else {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to send final response: %s\n", atkey_str);
+  }
+  free(atkey_str);
+}
@@ -1,10 +1,26 @@
+#include "srv/log.h"
+#include "srv/probes.h"
+#include "srv/stats.h"
+#include "sshnpd/address_cache.h"
+#include "sshnpd/atclient_pool.h"
 #include "sshnpd/background_jobs.h"
+#include "sshnpd/backoff.h"
 #include "sshnpd/handle_npt_request.h"
 #include "sshnpd/handle_ping.h"
 #include "sshnpd/handle_ssh_request.h"
 #include "sshnpd/handle_sshpublickey.h"
+#include "sshnpd/handler_commons.h"
+#include "sshnpd/manager_set.h"
+#include "sshnpd/metrics.h"
+#include "sshnpd/notify_queue.h"
 #include "sshnpd/permitopen.h"
+#include "sshnpd/replay_filter.h"
+#include "sshnpd/request_queue.h"
+#include "sshnpd/request_trace.h"
+#include "sshnpd/session_table.h"
+#include "sshnpd/srv_reports.h"
 #include "sshnpd/sshnpd.h"
+#include "sshnpd/startup_profile.h"
 #include "sshnpd/version.h"
 #include <atchops/aes.h>
 #include <atchops/iv.h>
@@ -24,23 +40,47 @@
 #include <atcommons/json.h>
 #include <atlogger/atlogger.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <mbedtls/ssl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sshnpd/file_utils.h>
 #include <sshnpd/run_srv_process.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define FILENAME_BUFFER_SIZE 500
 #define LOGGER_TAG "sshnpd"
 
 #define MONITOR_READ_TIMEOUT_MS 5000
-// How often to try to reconnect if the connect appears stale
-#define MONITOR_NOOP_TIMEOUT_MS 40000
+// How long the monitor connection may stay silent before we send it a heartbeat
+#define MONITOR_HEARTBEAT_INTERVAL_MS 15000
+// How long to wait for a heartbeat response before treating the monitor connection as dead
+#define MONITOR_HEARTBEAT_DEADLINE_MS 3000
+
+// Reconnect backoff bounds for the monitor and decrypt connections
+#define RECONNECT_BACKOFF_BASE_MS 1000
+#define RECONNECT_BACKOFF_MAX_MS 60000
+
+// How many notifications of each priority class (see request_class_of) may wait to be handled
+#define REQUEST_QUEUE_CONNECT_DEPTH 48 // a connection request usually comes with a public key
+#define REQUEST_QUEUE_PING_DEPTH 64
+#define REQUEST_QUEUE_OTHER_DEPTH 8
+#define REQUEST_QUEUE_MAX_TOTAL 64
+// How many monitor messages to read in a row before handling a queued one
+#define MONITOR_INTAKE_BURST 16
+
+// Events returned by wait_for_events
+#define EVENT_MONITOR 1     // the monitor connection has data to read
+#define EVENT_SIGNAL 2      // a signal arrived on the signal pipe
+#define EVENT_SRV_REPORTS 4 // srv processes have reported on their sessions
 
 static struct {
   char *str;
@@ -53,28 +93,94 @@ static struct {
     {"npt_request", NK_NPT_REQUEST},
 };
 
+typedef struct {
+  atclient_monitor_response message;
+  enum notification_key key;
+  request_trace trace; // only started for ssh and npt requests
+} queued_notification;
+
+// A connection authenticated on its own thread at startup, each PKAM being a TLS handshake and an RSA signature
+typedef struct {
+  int (*run)(void);
+  const char *name; // the phase it is recorded as in the startup profile
+  pthread_t tid;
+  bool started; // run is on tid, which hasn't been joined yet
+  int res;
+  int64_t began_us;
+  int64_t ended_us;
+} startup_job;
+
+// An atServer address to authenticate against. Replaced ones are kept until exit, as a connection on another thread may
+// still be authenticating against one, the atServer rarely moves so there are only ever a few
+typedef struct _atserver_address {
+  atclient_authenticate_options options;
+  struct _atserver_address *previous;
+} atserver_address;
+
 // static unsigned long min(unsigned long a, unsigned long b) { return a < b ? a : b; }
 
-static pthread_mutex_t atclient_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
-static int lock_atclient(void);
-static int unlock_atclient(int);
 
-static int reconnect_atclient();
+static int find_atserver_address(bool *from_cache);
+static int set_auth_options();
+static atclient_authenticate_options *current_auth_options();
+static void update_atserver_address(char *host, int port);
+static void refresh_atserver_address();
+static void *validate_cached_address(void *arg);
+static int authenticate_monitor(void);
+static int authenticate_decrypt_ctx(void);
+static int authenticate_pool(void);
+static void start_authentication();
+static int finish_authentication();
+static void reset_connections();
 static int reconnect_monitor();
+static int reconnect_decrypt_ctx();
+static bool probe_monitor(int64_t *heartbeat_sent);
+static int wait_for_events(int timeout_ms, bool watch_monitor);
+static void handle_signals();
+static void update_gauges();
+static int64_t monotonic_ms();
+static void queue_notification(atclient_monitor_response *message, enum notification_key key, int64_t read_began_us,
+                               int64_t read_ended_us);
+static void shed_notification(queued_notification *item);
+static bool dispatch_next_notification();
 
-static int set_worker_hooks();
 static void main_loop();
 
 // information to be shared between functions in this file
-static atclient worker;
-static char *atserver_host;
+static atclient_pool pool;
+static notify_queue outbound_queue;
+static manager_set managers; // read only once built, used to drop unauthorized notifications early
+static replay_filter replays; // recently handled sessionIds, only used by the main loop
+static request_queue pending;  // notifications read from the monitor but not yet handled, only used by the main loop
+static session_table sessions; // live srv processes and per-atSign session limits, only used by the main loop
+static request_tracer tracer;  // only used by the main loop
+static metrics_server metrics;
+// Read by the main loop, written to by the srv processes
+static srv_reports reports = {{-1, -1}};
+static atclient decrypt_ctx; // only ever used by the main loop, to decrypt monitor notifications
+static backoff monitor_backoff;
+static int64_t monitor_retry_at;
+static backoff decrypt_backoff;
+static int64_t decrypt_retry_at;
+static startup_job startup_jobs[] = {{authenticate_monitor, "pkam_monitor"},
+                                     {authenticate_decrypt_ctx, "pkam_decrypt"},
+                                     {authenticate_pool, "pkam_pool"}};
+static startup_profile profile;
+static bool pool_ready;     // set by authenticate_pool, only read once the startup jobs are joined
+static pthread_mutex_t address_lock = PTHREAD_MUTEX_INITIALIZER; // protects the atserver_* and addresses once running
+static char *atserver_host;                                      // where the atServer was last found
 static int atserver_port;
+static atserver_address *addresses;                 // every address published so far, newest first
+static atclient_authenticate_options *auth_options; // the newest of them, see current_auth_options
+static pthread_t validate_tid;
+static bool validate_started; // validate_cached_address is running on validate_tid, which hasn't been joined yet
 static atclient_atkeys atkeys;
 static sshnpd_params params;
 static atclient monitor_ctx;
 static char *regex;
-static FILE *authkeys_file;
+static authorized_keys authkeys; // only used by the main loop
 static char *authkeys_filename;
 static char *ping_response;
 static char *home_dir;
@@ -82,33 +188,57 @@ static atchops_rsa_key_private_key signingkey;
 static bool is_child_process = false;
 
 // Signal handling
+// The handlers only write the signal number to signal_pipe, the main loop picks it up and does the actual work
 static volatile sig_atomic_t should_run = 1;
-static void exit_handler(int sig) {
-  atlogger_log("exit_handler", ATLOGGER_LOGGING_LEVEL_WARN, "Received signal: %d\n", sig);
-  should_run = 0;
-  exit(1);
-}
-static void child_exit_handler(int sig) {
-  atlogger_log("child_exit_handler", ATLOGGER_LOGGING_LEVEL_WARN, "Received signal: %d\n", sig);
-  int status;
-  pid_t pid = waitpid(-1, &status, WNOHANG);
-  if (pid > 0 && WIFEXITED(status)) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "pid %d exited\n", pid);
+static int signal_pipe[2] = {-1, -1};
+static pid_t main_pid;
+static void signal_handler(int sig) {
+  if (sig == SIGINT && getpid() != main_pid) {
+    _exit(1); // a forked srv child, which doesn't run the main loop
   }
+  if (sig == SRV_STATS_SIGNAL && getpid() != main_pid) {
+    return; // a forked srv child which hasn't started its stats reporter yet
+  }
+  if (sig == SIGINT) {
+    should_run = 0;
+  }
+  int saved_errno = errno;
+  unsigned char byte = (unsigned char)sig;
+  if (write(signal_pipe[1], &byte, 1) < 0) {
+    // nothing more we can safely do from here, the pipe is only full if the main loop is already behind on signals
+  }
+  errno = saved_errno;
 }
 
 int main(int argc, char **argv) {
   int res = 0;
   int exit_res = 0;
-
-  // Catch sigint and pass to the handler
-  signal(SIGINT, exit_handler);
-  signal(SIGCHLD, child_exit_handler);
+  bool free_ping_response = false;
+  bool outbound_queue_started = false;
+
+  // Catch sigint and sigchld and pass them to the main loop through the signal pipe
+  main_pid = getpid();
+  startup_profile_init(&profile, startup_profile_now_us());
+  time_t started_at = time(NULL);
+  backoff_init(&monitor_backoff, RECONNECT_BACKOFF_BASE_MS, RECONNECT_BACKOFF_MAX_MS,
+               (unsigned int)time(NULL) ^ (unsigned int)main_pid);
+  backoff_init(&decrypt_backoff, RECONNECT_BACKOFF_BASE_MS, RECONNECT_BACKOFF_MAX_MS,
+               (unsigned int)time(NULL) ^ (unsigned int)main_pid ^ 0x5bd1e995u);
+  if (pipe(signal_pipe) != 0) {
+    printf("Failed to create the signal pipe: %s\n", strerror(errno));
+    return 1;
+  }
+  fcntl(signal_pipe[0], F_SETFL, fcntl(signal_pipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl(signal_pipe[1], F_SETFL, fcntl(signal_pipe[1], F_GETFL) | O_NONBLOCK);
+  signal(SIGINT, signal_handler);
+  signal(SIGCHLD, signal_handler);
+  signal(SRV_STATS_SIGNAL, signal_handler);
 
   // 1.  Load default values
   apply_default_values_to_sshnpd_params(&params);
 
   // 2.  Parse the command line arguments
+  startup_profile_begin(&profile, "parse_params", startup_profile_now_us());
   if (parse_sshnpd_params(&params, argc, (const char **)argv) != 0) {
     return 1;
   }
@@ -121,24 +251,26 @@ int main(int argc, char **argv) {
   } else {
     atlogger_set_logging_level(ATLOGGER_LOGGING_LEVEL_INFO);
   }
+  // From here on logging only costs the callers a format and a copy, a background thread does the writing
+  log_sink_start();
 
   // 4. Validate the environment
   home_dir = getenv(HOMEVAR);
   if (home_dir == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Unable to determine your home directory: please "
-                 "set %s environment variable\n",
-                 HOMEVAR);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+             "Unable to determine your home directory: please "
+             "set %s environment variable\n",
+             HOMEVAR);
     exit_res = 1;
     goto exit;
   }
 
   const char *username = getenv(USERVAR);
   if (!params.hide && username == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Unable to determine your username: please "
-                 "set %s environment variable\n",
-                 USERVAR);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+             "Unable to determine your username: please "
+             "set %s environment variable\n",
+             USERVAR);
     exit_res = 1;
     goto exit;
   }
@@ -149,20 +281,21 @@ int main(int argc, char **argv) {
   }
 
   // 5.  Load the atKeys
+  startup_profile_begin(&profile, "load_atkeys", startup_profile_now_us());
   atclient_atkeys_init(&atkeys);
   if (params.key_file == NULL) {
     char filename[FILENAME_BUFFER_SIZE];
     snprintf(filename, FILENAME_BUFFER_SIZE, "%s/.atsign/keys/%s_key.atKeys", home_dir, params.atsign);
     res = atclient_atkeys_populate_from_path(&atkeys, filename);
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Using atkeysfile: %s\n", filename);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Using atkeysfile: %s\n", filename);
   } else {
     res = atclient_atkeys_populate_from_path(&atkeys, (const char *)params.key_file);
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Using atkeysfile: %s\n", (const char *)params.key_file);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Using atkeysfile: %s\n", (const char *)params.key_file);
   }
 
   if (res != 0 || !should_run) {
     if (res != 0) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Unable to load the atkeys file\n");
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Unable to load the atkeys file\n");
     }
     atclient_atkeys_free(&atkeys);
     exit_res = res;
@@ -174,48 +307,100 @@ int main(int argc, char **argv) {
   atchops_rsa_key_private_key_clone(&atkeys.encrypt_private_key, &signingkey);
 
   // 6. Get atServer address
-  res = atclient_utils_find_atserver_address(params.root_domain, ROOT_PORT, params.atsign, &atserver_host,
-                                             &atserver_port);
+  startup_profile_begin(&profile, "find_atserver", startup_profile_now_us());
+  bool address_from_cache;
+  res = find_atserver_address(&address_from_cache);
   if (res != 0) {
     exit_res = res;
     goto clean_atkeys;
   }
+  res = set_auth_options();
 
-  // 7.a Initialize the monitor atclient
+  // 7. Authenticate the monitor, decrypt and worker connections concurrently, the rest of startup doesn't need them
   atclient_init(&monitor_ctx);
   atclient_set_read_timeout(&monitor_ctx, MONITOR_READ_TIMEOUT_MS); // 5 seconds for timeout
-  res = atclient_monitor_pkam_authenticate(&monitor_ctx, params.atsign, &atkeys, NULL);
+  // The decrypt client has its own connection so that decrypting never waits on the outbound worker pool
+  atclient_init(&decrypt_ctx);
   if (res != 0 || !should_run) {
     exit_res = res;
-    goto cancel_monitor_ctx;
+    goto cancel_decrypt_ctx;
+  }
+  startup_profile_end(&profile, startup_profile_now_us());
+  int64_t auth_began = monotonic_ms();
+  start_authentication();
+
+  // 8. Build the manager set, queues and tables used to handle requests
+  startup_profile_begin(&profile, "build_request_state", startup_profile_now_us());
+  if (log_enabled(ATLOGGER_LOGGING_LEVEL_DEBUG)) {
+    size_t list_len = 1;
+    for (size_t i = 0; i < params.manager_list_len; i++) {
+      list_len += strlen(params.manager_list[i]) + 1;
+    }
+    char *list = malloc(list_len);
+    if (list != NULL) {
+      char *end = list;
+      *end = '\0';
+      for (size_t i = 0; i < params.manager_list_len; i++) {
+        end += sprintf(end, "%s%s", i > 0 ? "," : "", params.manager_list[i]);
+      }
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Manager List: %lu - %s\n", params.manager_list_len, list);
+      free(list);
+    }
   }
 
-  // 7.b Initialize the worker atclient
-  atclient_init(&worker);
-  bool free_ping_response = false;
-  res = atclient_pkam_authenticate(&worker, params.atsign, &atkeys, NULL, NULL);
-  if (res != 0 || !should_run) {
+  res = manager_set_init(&managers, params.manager_list, params.manager_list_len);
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to build the manager set\n");
     exit_res = res;
     goto cancel_atclient;
   }
 
-  // 7.c setup hooks to restart the worker atclient
-  set_worker_hooks();
+  // Remember sessionIds for at least as long as a request can be accepted for
+  int replay_window = REPLAY_FILTER_MIN_WINDOW_SECONDS;
+  if (params.request_max_age > replay_window) {
+    replay_window = params.request_max_age;
+  }
+  res = replay_filter_init(&replays, REPLAY_FILTER_CAPACITY, replay_window, time(NULL));
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate the replay filter\n");
+    exit_res = res;
+    goto cancel_atclient;
+  }
 
-  // 8. cache the manager public keys
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Manager List: %lu - ", params.manager_list_len);
-  for (size_t i = 0; i < params.manager_list_len; i++) {
-    printf("%s,", params.manager_list[i]);
+  const size_t queue_depths[REQUEST_QUEUE_CLASSES] = {REQUEST_QUEUE_CONNECT_DEPTH, REQUEST_QUEUE_PING_DEPTH,
+                                                      REQUEST_QUEUE_OTHER_DEPTH};
+  res = request_queue_init(&pending, queue_depths, REQUEST_QUEUE_MAX_TOTAL);
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate the request queue\n");
+    exit_res = res;
+    goto cancel_atclient;
+  }
 
-    // char public_encryption_key[1024];
-    // atclient_get_public_encryption_key(&atclient, params.manager_list[i], &public_encryption_key);
-    // TODO: finish caching
+  res = session_table_init(&sessions, params.max_sessions, params.max_sessions_per_atsign, params.session_rate,
+                           params.session_burst);
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to initialize the session table\n");
+    exit_res = res;
+    goto cancel_atclient;
+  }
+  res = request_tracer_open(&tracer, params.trace_file, params.trace_sample);
+  if (res != 0) {
+    exit_res = res;
+    goto cancel_atclient;
+  }
+  res = metrics_server_start(&metrics, params.metrics_socket, params.metrics_port);
+  if (res != 0) {
+    exit_res = res;
+    goto cancel_atclient;
+  }
+  // Without it sessions still work, srv just logs its own stats
+  if (srv_reports_open(&reports) == 0) {
+    params.srv_stats_fd = reports.fds[1];
   }
-  printf("\n");
   if (params.policy == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Policy Manager: NULL");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Policy Manager: NULL");
   } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Policy Manager: %s", params.policy);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Policy Manager: %s", params.policy);
   }
 
   if (!should_run) {
@@ -223,6 +408,7 @@ int main(int argc, char **argv) {
     goto cancel_atclient;
   }
 
+  startup_profile_begin(&profile, "build_ping_response", startup_profile_now_us());
   cJSON *ping_response_json = cJSON_CreateObject();
 
   cJSON_AddItemToObject(ping_response_json, "devicename", cJSON_CreateString(params.device));
@@ -240,7 +426,12 @@ int main(int argc, char **argv) {
   cJSON *allowed_services = cJSON_CreateArray();
   char *buf = malloc(sizeof(char) * 1024);
   for (size_t i = 0; i < params.permitopen_len; i++) {
-    sprintf(buf, "%s:%u", params.permitopen_hosts[i], (unsigned int)params.permitopen_ports[i]);
+    if (params.permitopen_port_ends[i] != params.permitopen_ports[i]) {
+      sprintf(buf, "%s:%u-%u", params.permitopen_hosts[i], (unsigned int)params.permitopen_ports[i],
+              (unsigned int)params.permitopen_port_ends[i]);
+    } else {
+      sprintf(buf, "%s:%u", params.permitopen_hosts[i], (unsigned int)params.permitopen_ports[i]);
+    }
     cJSON_AddItemToArray(allowed_services, cJSON_CreateString(buf));
   }
   free(buf);
@@ -252,21 +443,63 @@ int main(int argc, char **argv) {
   cJSON_Delete(ping_response_json);
 
   if (ping_response == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "cJSON_Print failed\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "cJSON_Print failed\n");
     goto cancel_atclient;
   } else {
     free_ping_response = true;
   }
 
+  // 9. Wait for the connections
+  startup_profile_begin(&profile, "wait_for_connections", startup_profile_now_us());
+  res = finish_authentication();
+  if (res != 0 && address_from_cache && should_run) {
+    // The atServer may have moved since we cached its address, so forget it and ask the root server
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN,
+             "Failed to authenticate with the cached atServer address, looking it up again\n");
+    atserver_address_cache_remove(params.storage_path, params.atsign);
+    free(atserver_host);
+    atserver_host = NULL;
+    res = find_atserver_address(&address_from_cache);
+    if (res == 0) {
+      res = set_auth_options();
+    }
+    if (res == 0) {
+      reset_connections();
+      start_authentication();
+      res = finish_authentication();
+    }
+  }
+  if (res != 0 || !should_run) {
+    exit_res = res;
+    goto cancel_atclient;
+  }
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Authenticated the atServer connections in %ld ms\n",
+           (long)(monotonic_ms() - auth_began));
+
+  if (address_from_cache) {
+    // Check the cached address with the root server in the background, and switch to the new one if it has moved
+    validate_started = pthread_create(&validate_tid, NULL, validate_cached_address, NULL) == 0;
+  }
+
+  // Start the outbound notification queue
+  startup_profile_begin(&profile, "start_outbound_queue", startup_profile_now_us());
+  res = notify_queue_start(&outbound_queue, &pool);
+  if (res != 0) {
+    exit_res = res;
+    goto cancel_atclient;
+  }
+  outbound_queue_started = true;
+
   if (!should_run) {
     goto cancel_atclient;
   }
 
-  // 9. Start the device refresh loop - if hide is off
+  // 10. Start the device refresh loop - if hide is off
+  startup_profile_begin(&profile, "start_refresh_thread", startup_profile_now_us());
   pthread_t refresh_tid;
   atclient_atkey *infokeys = malloc(sizeof(atclient_atkey) * params.manager_list_len);
   if (infokeys == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for infokeys\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for infokeys\n");
     exit_res = 1;
     goto cancel_atclient;
   }
@@ -277,7 +510,7 @@ int main(int argc, char **argv) {
 
   atclient_atkey *usernamekeys = malloc(sizeof(atclient_atkey) * params.manager_list_len);
   if (usernamekeys == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for usernamekeys\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for usernamekeys\n");
     exit_res = 1;
     goto clean_info_keys;
   }
@@ -287,10 +520,10 @@ int main(int argc, char **argv) {
   }
 
   struct refresh_device_entry_params refresh_params = {
-      &worker, &atclient_lock, &refresh_cond, &params, ping_response, username, &should_run, infokeys, usernamekeys};
+      &pool, &refresh_lock, &refresh_cond, &params, ping_response, username, &should_run, infokeys, usernamekeys};
   res = pthread_create(&refresh_tid, NULL, refresh_device_entry, (void *)&refresh_params);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to start refresh device entry thread\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to start refresh device entry thread\n");
     exit_res = res;
     goto clean_username_keys;
   }
@@ -299,10 +532,11 @@ int main(int argc, char **argv) {
     goto cancel_refresh;
   }
 
-  // 10. Start monitor
+  // 11. Start monitor
+  startup_profile_begin(&profile, "start_monitor", startup_profile_now_us());
   regex = malloc((strlen(params.device) + strlen(SSHNP_NS) + 3)); // needs to be declared before any gotos
   if (regex == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the monitor regex\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the monitor regex\n");
     exit_res = 1;
     goto cancel_refresh;
   }
@@ -310,7 +544,7 @@ int main(int argc, char **argv) {
   sprintf(regex, "%s.%s@", params.device, SSHNP_NS);
   res = atclient_monitor_start(&monitor_ctx, regex);
   if (res != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to start monitor\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to start monitor\n");
     exit_res = res;
     goto cancel_refresh;
   }
@@ -319,27 +553,21 @@ int main(int argc, char **argv) {
     goto cancel_refresh;
   }
 
-  // 11. Get a pointer to the authorized_keys file
+  // 12. Get a pointer to the authorized_keys file
+  startup_profile_begin(&profile, "open_authorized_keys", startup_profile_now_us());
   authkeys_filename = malloc(sizeof(char) + (strlen(home_dir) + 22));
   if (authkeys_filename == NULL) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for authkeys_filename\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for authkeys_filename\n");
     exit_res = 1;
     goto cancel_refresh;
   }
   sprintf(authkeys_filename, "%s/.ssh/authorized_keys", home_dir);
 
-  atlogger_log("AUTH SSH KEY", ATLOGGER_LOGGING_LEVEL_DEBUG, "Using authorized_keys file: %s\n", authkeys_filename);
-  authkeys_file = fopen(authkeys_filename, "r"); // readonly for now, we will freopen this file later
-
-  if (authkeys_file == NULL) {
-    atlogger_log("AUTH SSH KEY", ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to open authorized_keys file: %s\n",
-                 strerror(errno));
-    if (errno != 0) {
-      exit_res = errno;
-    } else {
-      exit_res = 1;
-    }
-    goto close_authkeys;
+  lazy_log("AUTH SSH KEY", ATLOGGER_LOGGING_LEVEL_DEBUG, "Using authorized_keys file: %s\n", authkeys_filename);
+  res = authorized_keys_init(&authkeys, authkeys_filename);
+  if (res != 0) {
+    exit_res = res;
+    goto free_authkeys_filename;
   }
 
   if (!should_run) {
@@ -347,21 +575,37 @@ int main(int argc, char **argv) {
   }
 
   // 13. Main notification handler loop
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Starting main loop\n");
+  startup_profile_finish(&profile, startup_profile_now_us());
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Started in %ld ms\n",
+           (long)((profile.ended_us - profile.began_us) / 1000));
+  startup_profile_log(&profile);
+  if (params.startup_profile != NULL) {
+    startup_profile_append(&profile, params.startup_profile, SSHNPD_VERSION, started_at);
+  }
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Starting main loop\n");
   main_loop();
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Exited main loop\n");
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Exited main loop\n");
 
 close_authkeys:
-  fclose(authkeys_file);
+  authorized_keys_free(&authkeys);
+free_authkeys_filename:
   free(authkeys_filename);
 cancel_refresh:
   free(regex);
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Joining device entry refresh thread\n");
-  should_run = 0;
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Joining device entry refresh thread\n");
+  if (!is_child_process) {
+    // Wake the refresh thread up, rather than waiting for its next deadline
+    pthread_mutex_lock(&refresh_lock);
+    should_run = 0;
+    pthread_cond_signal(&refresh_cond);
+    pthread_mutex_unlock(&refresh_lock);
+  } else {
+    should_run = 0;
+  }
   if (!is_child_process && pthread_join(refresh_tid, NULL) != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to join device entry refresh thread\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to join device entry refresh thread\n");
   } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Joined device entry refresh thread\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Joined device entry refresh thread\n");
   }
 clean_username_keys:
   for (size_t i = 0; i < params.manager_list_len; i++) {
@@ -378,14 +622,48 @@ cancel_atclient:
     free(ping_response);
   }
   if (!is_child_process) {
-    atclient_connection_disconnect(&worker.atserver_connection);
-    atclient_free(&worker);
+    // Nothing can be freed while a startup job might still be authenticating it
+    finish_authentication();
+    // or while the validator might still be publishing an address or reading params
+    if (validate_started) {
+      pthread_join(validate_tid, NULL);
+      validate_started = false;
+    }
+    if (outbound_queue_started) {
+      notify_queue_stop(&outbound_queue);
+    }
+  }
+  manager_set_free(&managers);
+  replay_filter_free(&replays);
+  for (queued_notification *item; (item = request_queue_pop(&pending, NULL)) != NULL;) {
+    atclient_monitor_response_free(&item->message);
+    free(item);
+  }
+  request_queue_free(&pending);
+  session_table_free(&sessions);
+  if (!is_child_process) {
+    request_tracer_close(&tracer);
+    metrics_server_stop(&metrics);
+    srv_reports_close(&reports);
+  }
+  if (!is_child_process && pool_ready) {
+    atclient_pool_free(&pool);
+  }
+cancel_decrypt_ctx:
+  if (!is_child_process) {
+    atclient_connection_disconnect(&decrypt_ctx.atserver_connection);
+    atclient_free(&decrypt_ctx);
   }
-cancel_monitor_ctx:
   if (!is_child_process) {
     atclient_connection_disconnect(&monitor_ctx.atserver_connection);
     atclient_free(&monitor_ctx);
   }
+  while (addresses != NULL) {
+    atserver_address *previous = addresses->previous;
+    atclient_authenticate_options_free(&addresses->options);
+    free(addresses);
+    addresses = previous;
+  }
   free(atserver_host);
 
 clean_atkeys:
@@ -396,86 +674,177 @@ exit:
   free(params.manager_list);
   free(params.permitopen_hosts);
   free(params.permitopen_ports);
+  free(params.permitopen_port_ends);
+  permitopen_index_free(&params.permitopen_index);
   free(params.permitopen_str);
+  log_sink_stop();
   exit(exit_res);
 }
 
 void main_loop() {
-  atlogger_log("E2E TESTS", ATLOGGER_LOGGING_LEVEL_INFO, "Monitor .*monitor started\n");
-  atclient_monitor_hooks monitor_hooks;
-
-  monitor_hooks.pre_decrypt_notification = lock_atclient;
-  monitor_hooks.post_decrypt_notification = unlock_atclient;
-
+  lazy_log("E2E TESTS", ATLOGGER_LOGGING_LEVEL_INFO, "Monitor .*monitor started\n");
   atclient_monitor_response message;
 
-  permitopen_params permitopen;
-  permitopen.permitopen_len = params.permitopen_len;
-  permitopen.permitopen_hosts = params.permitopen_hosts;
-  permitopen.permitopen_ports = params.permitopen_ports;
-
-  size_t timeout_counter = 0;
+  // The monitor connection is considered alive while we keep hearing from it. After MONITOR_HEARTBEAT_INTERVAL_MS of
+  // silence we send a heartbeat, and if that isn't answered within MONITOR_HEARTBEAT_DEADLINE_MS we reconnect.
+  bool monitor_ok = true;
+  int64_t last_heard = monotonic_ms();
+  int64_t heartbeat_sent = 0; // 0 when no heartbeat is outstanding
+  int reads_since_dispatch = 0;
+  // Checking the decrypt connection is a round trip to the atServer, so it is only checked while idle (alongside the
+  // monitor heartbeat) or once something suggests it is broken, never in front of every read
+  bool decrypt_ok = true;
 
   while (should_run) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Waiting for next monitor thread message\n");
-    atclient_monitor_response_init(&message);
+    if (!monitor_ok) {
+      // Finish handling what was already read before reconnecting
+      if (pending.total > 0) {
+        if (dispatch_next_notification()) {
+          return; // in a child process
+        }
+        continue;
+      }
+      // Wait out the reconnect backoff, while still handling signals
+      int64_t wait_ms = monitor_retry_at - monotonic_ms();
+      if (wait_ms > 0) {
+        int events = wait_for_events((int)wait_ms, false);
+        if (events & EVENT_SIGNAL) {
+          handle_signals();
+        }
+        if (events & EVENT_SRV_REPORTS) {
+          srv_reports_drain(&reports);
+        }
+        continue;
+      }
+      if (reconnect_monitor() != 0) {
+        continue;
+      }
+      monitor_ok = true;
+      last_heard = monotonic_ms();
+      heartbeat_sent = 0;
+    }
 
-    int ret;
-    if (timeout_counter * MONITOR_READ_TIMEOUT_MS > MONITOR_NOOP_TIMEOUT_MS) {
-      // Do noop & reconnect if needed
-      ret = reconnect_monitor();
-      if (ret != 0) {
-        timeout_counter = MONITOR_NOOP_TIMEOUT_MS / MONITOR_READ_TIMEOUT_MS + 1;
-        atclient_monitor_response_free(&message);
+    int64_t now = monotonic_ms();
+    if (heartbeat_sent != 0 && now - heartbeat_sent >= MONITOR_HEARTBEAT_DEADLINE_MS) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Monitor heartbeat was not answered within %d ms\n",
+               MONITOR_HEARTBEAT_DEADLINE_MS);
+      monitor_ok = false;
+      continue;
+    }
+    if (now - last_heard >= MONITOR_HEARTBEAT_INTERVAL_MS && heartbeat_sent == 0) {
+      decrypt_ok = reconnect_decrypt_ctx() == 0;
+    }
+    if (now - last_heard >= MONITOR_HEARTBEAT_INTERVAL_MS && !probe_monitor(&heartbeat_sent)) {
+      monitor_ok = false;
+      continue;
+    }
+
+    int64_t deadline = last_heard + MONITOR_HEARTBEAT_INTERVAL_MS;
+    if (heartbeat_sent != 0) {
+      deadline = heartbeat_sent + MONITOR_HEARTBEAT_DEADLINE_MS;
+    }
+    // Only block when there is nothing queued to handle
+    int timeout_ms = deadline > now ? (int)(deadline - now) : 0;
+    if (pending.total > 0) {
+      timeout_ms = 0;
+    } else {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Waiting for next monitor thread message\n");
+    }
+    int events = wait_for_events(timeout_ms, true);
+    if (events & EVENT_SIGNAL) {
+      handle_signals();
+    }
+    if (events & EVENT_SRV_REPORTS) {
+      srv_reports_drain(&reports);
+    }
+    if (!should_run) {
+      continue;
+    }
+
+    // Read everything the atServer has already sent before handling any of it, so that the queue can put the most
+    // important requests first. Handle one anyway every MONITOR_INTAKE_BURST reads, so a flood can't starve handling.
+    if (!(events & EVENT_MONITOR) || reads_since_dispatch >= MONITOR_INTAKE_BURST) {
+      reads_since_dispatch = 0;
+      if (dispatch_next_notification()) {
+        return; // in a child process
+      }
+      if (!(events & EVENT_MONITOR)) {
         continue;
-      } else {
-        timeout_counter = 0;
       }
     }
+    reads_since_dispatch++;
+
+    // Make sure notifications can be decrypted, failing that they will be reported as decrypt errors below
+    if (!decrypt_ok) {
+      decrypt_ok = reconnect_decrypt_ctx() == 0;
+    }
 
     // Read the next monitor message
-    ret = atclient_monitor_read(&monitor_ctx, &worker, &message, &monitor_hooks);
+    atclient_monitor_response_init(&message);
+    int64_t read_began_us = request_tracer_now_us(&tracer);
+    int ret = atclient_monitor_read(&monitor_ctx, &decrypt_ctx, &message, NULL);
+    int64_t read_ended_us = request_tracer_now_us(&tracer);
     if (ret != 0) {
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                   "Possible bad state: monitor read failed, resetting connection (ret: %d)\n", ret);
-      timeout_counter = MONITOR_NOOP_TIMEOUT_MS / MONITOR_READ_TIMEOUT_MS + 1;
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+               "Possible bad state: monitor read failed, resetting connection (ret: %d)\n", ret);
+      monitor_ok = false;
+      decrypt_ok = false;
     }
 
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Received message of type: %d\n", message.type);
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Received message of type: %d\n", message.type);
     switch (message.type) {
     case ATCLIENT_MONITOR_MESSAGE_TYPE_EMPTY:
-      timeout_counter++;
+      // The socket was readable but nothing came of it, probe the connection rather than trust it
+      if (!probe_monitor(&heartbeat_sent)) {
+        monitor_ok = false;
+      }
       break;
     case ATCLIENT_MONITOR_ERROR_READ:
-      timeout_counter = MONITOR_NOOP_TIMEOUT_MS / MONITOR_READ_TIMEOUT_MS + 1;
+      monitor_ok = false;
+      decrypt_ok = false;
       break;
     case ATCLIENT_MONITOR_MESSAGE_TYPE_DATA_RESPONSE:
-      timeout_counter = 0;
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Received a data response: %s\n", message.data_response);
+      last_heard = monotonic_ms();
+      heartbeat_sent = 0;
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Received a data response: %s\n", message.data_response);
       break;
     case ATCLIENT_MONITOR_MESSAGE_TYPE_ERROR_RESPONSE:
-      timeout_counter = 0;
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received an error response: %s\n",
-                   message.error_response);
+      last_heard = monotonic_ms();
+      heartbeat_sent = 0;
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received an error response: %s\n", message.error_response);
       break;
     case ATCLIENT_MONITOR_MESSAGE_TYPE_NONE:
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received a NONE notification type\n");
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Received a NONE notification type\n");
       break;
     case ATCLIENT_MONITOR_ERROR_PARSE_NOTIFICATION:
-      timeout_counter = MONITOR_NOOP_TIMEOUT_MS + 1;
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to parse the notification\n");
-      break;
     case ATCLIENT_MONITOR_ERROR_DECRYPT_NOTIFICATION:
-      timeout_counter = MONITOR_NOOP_TIMEOUT_MS + 1;
-      atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to decrypt the notification\n");
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to %s the notification\n",
+               message.type == ATCLIENT_MONITOR_ERROR_PARSE_NOTIFICATION ? "parse" : "decrypt");
+      if (message.type == ATCLIENT_MONITOR_ERROR_DECRYPT_NOTIFICATION) {
+        decrypt_ok = false;
+      }
+      // Could be a one-off bad notification, or a broken connection, the heartbeat will tell us which
+      if (!probe_monitor(&heartbeat_sent)) {
+        monitor_ok = false;
+      }
       break;
     case ATCLIENT_MONITOR_MESSAGE_TYPE_NOTIFICATION: {
-      timeout_counter = 0;
+      last_heard = monotonic_ms();
+      heartbeat_sent = 0;
+      // Drop anything not sent by a manager before doing any more work on it
+      if (!atclient_atnotification_is_from_initialized(&message.notification) ||
+          !manager_set_contains(&managers, message.notification.from)) {
+        metrics_inc(METRIC_NOTIFICATIONS_UNAUTHORIZED);
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Ignoring notification from unauthorized atSign %s\n",
+                 atclient_atnotification_is_from_initialized(&message.notification) ? message.notification.from
+                                                                                    : "(unknown)");
+        break;
+      }
       bool is_init = atclient_atnotification_is_decrypted_value_initialized(&message.notification);
       bool has_key = atclient_atnotification_is_key_initialized(&message.notification);
       if (is_init) {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Notification value received: %s\n",
-                     message.notification.decrypted_value);
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Notification value received: %s\n",
+                 message.notification.decrypted_value);
         if (!has_key || strcmp(message.notification.id, "-1") == 0) {
           break;
         }
@@ -487,7 +856,7 @@ void main_loop() {
         sprintf(tail, ".%s.%s%s", params.device, SSHNP_NS, message.notification.from);
         char *tailstart = strstr(key, tail);
         if (tailstart == NULL) {
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Skipping message: couldn't find the tail\n");
+          lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Skipping message: couldn't find the tail\n");
           break;
         }
         *tailstart = '\0'; // reterminate the string at the start of the trail
@@ -497,13 +866,13 @@ void main_loop() {
         char *head = message.notification.to;
         size_t head_len = strlen(head);
         if (strlen(key) < head_len) {
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                       "Skipping message: key length is shorter than the expected head\n");
+          lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+                   "Skipping message: key length is shorter than the expected head\n");
           break;
         }
         int is_equal = strncmp(key, head, head_len);
         if (is_equal != 0) {
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Skipping message: couldn't find the head\n");
+          lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Skipping message: couldn't find the head\n");
           break;
         }
 
@@ -524,50 +893,19 @@ void main_loop() {
           break;
         }
 
-        if (params.policy != NULL) {
-          // TODO: implement a separate permitopen check for npa checks
-          // DO NOT USE permitopen, use npa_permitopen
+        // Requests queued up while we were offline are likely long abandoned, don't spend any more work on them
+        if ((notification_key == NK_SSH_REQUEST || notification_key == NK_NPT_REQUEST) &&
+            is_request_stale(&params, &message, 0)) {
+          metrics_inc(METRIC_REQUESTS_REJECTED_STALE);
+          break;
         }
 
-        switch (notification_key) {
-        case NK_SSHPUBLICKEY:
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_sshpublickey\n");
-          handle_sshpublickey(&params, &message, authkeys_file, authkeys_filename);
-          break;
-        case NK_PING:
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_ping\n");
-          handle_ping(&params, &message, ping_response, &worker, &atclient_lock);
-          break;
-        case NK_SSH_REQUEST:
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_ssh_request\n");
-          // permitopen happens first for ssh so we can avoid a bunch of unnecessary tasks
-          permitopen.requested_host = "localhost";
-          permitopen.requested_port = params.local_sshd_port;
-          if (!should_permitopen(&permitopen)) {
-            atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Ignoring request to localhost:%d\n",
-                         params.local_sshd_port);
-            // TODO notify daemon doesn't permit connections to $requested_host:$requested_port
-            break;
-          }
-          handle_ssh_request(&worker, &atclient_lock, &params, &is_child_process, &message, signingkey);
-          if (is_child_process) {
-            atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Exiting child process\n");
-            atclient_monitor_response_free(&message);
-            return;
-          }
-          break;
-        case NK_NPT_REQUEST:
-          atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_npt_request\n");
-          // No permitopen here... since we need to parse the json first in order to check, it happens inside
-          // handle_npt_request
-          handle_npt_request(&worker, &atclient_lock, &params, &is_child_process, &message, signingkey);
-          break;
-        case NK_NONE:
-          break;
+        if (notification_key != NK_NONE) {
+          queue_notification(&message, notification_key, read_began_us, read_ended_us);
         }
       } else {
-        atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Skipping notification (no decryptedvalue): %s\n",
-                     message.notification.id);
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Skipping notification (no decryptedvalue): %s\n",
+                 message.notification.id);
       }
       break;
     } // end of case ATCLIENT_MONITOR_MESSAGE_TYPE_NOTIFICATION
@@ -576,76 +914,459 @@ void main_loop() {
   } // end of while loop
 }
 
-static int lock_atclient(void) {
-  int ret = pthread_mutex_lock(&atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Failed to get a lock on atclient for sending a notification\n");
-  } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Locked the atclient\n");
+static void queue_notification(atclient_monitor_response *message, enum notification_key key, int64_t read_began_us,
+                               int64_t read_ended_us) {
+  queued_notification *item = malloc(sizeof(queued_notification));
+  if (item == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory to queue a notification\n");
+    return;
+  }
+  // Take over the message, leaving the caller with an empty one to free
+  memcpy(&item->message, message, sizeof(atclient_monitor_response));
+  atclient_monitor_response_init(message);
+  item->key = key;
+  // Counted once it is known to be from a manager and for us, even if it is shed
+  metrics_inc(METRIC_NOTIFICATIONS_SSHPUBLICKEY + (key - NK_SSHPUBLICKEY));
+  item->trace.sampled = false;
+  if (key == NK_SSH_REQUEST || key == NK_NPT_REQUEST) {
+    request_trace_start(&tracer, &item->trace, notification_key_map[key].str, item->message.notification.id,
+                        read_began_us);
+    request_trace_span(&item->trace, "monitor_read", read_began_us, read_ended_us);
+    request_trace_begin(&item->trace, "queued");
   }
-  return ret;
+
+  void *shed = NULL;
+  int shed_cls;
+  if (!request_queue_push(&pending, request_class_of(key), item, &shed, &shed_cls)) {
+    shed_notification(item);
+  }
+  if (shed != NULL) {
+    shed_notification(shed);
+  }
+  update_gauges();
 }
 
-static int unlock_atclient(int ret) {
-  ret = pthread_mutex_unlock(&atclient_lock);
-  if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release atclient lock\n");
-    exit(1);
-  } else {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Released the atclient lock\n");
+static void shed_notification(queued_notification *item) {
+  metrics_inc(METRIC_NOTIFICATIONS_SHED);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Too busy, shedding %s notification %s from %s\n",
+           notification_key_map[item->key].str, item->message.notification.id, item->message.notification.from);
+  // Pings and public keys are cheap for the client to retry, but a connection request deserves an answer
+  if (item->key == NK_SSH_REQUEST || item->key == NK_NPT_REQUEST) {
+    send_busy_response(&item->message, &outbound_queue, &params);
   }
-  return ret;
+  atclient_monitor_response_free(&item->message);
+  free(item);
 }
 
-static int set_worker_hooks() {
-  atclient_connection_hooks_enable(&worker.atserver_connection);
-  return atclient_connection_hooks_set(&worker.atserver_connection, ATCLIENT_CONNECTION_HOOK_TYPE_PRE_WRITE,
-                                       reconnect_atclient);
+static bool dispatch_next_notification() {
+  queued_notification *item = request_queue_pop(&pending, NULL);
+  if (item == NULL) {
+    return false;
+  }
+
+  // Keys have to be in authorized_keys before the clients which sent them try to connect. A key is queued ahead of the
+  // request it came with (see request_class_of), so by now it has been added.
+  if (item->key == NK_SSH_REQUEST || item->key == NK_NPT_REQUEST) {
+    authorized_keys_flush(&authkeys);
+  }
+
+  if (params.policy != NULL) {
+    // TODO: implement a separate permitopen check for npa checks
+    // DO NOT USE permitopen, use npa_permitopen
+  }
+
+  int64_t handler_began = metrics_now_us();
+  usdt_probe2(sshnpd, handler_start, notification_key_map[item->key].str, item->message.notification.id);
+  switch (item->key) {
+  case NK_SSHPUBLICKEY:
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_sshpublickey\n");
+    handle_sshpublickey(&params, &item->message, &authkeys);
+    break;
+  case NK_PING:
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_ping\n");
+    handle_ping(&params, &item->message, ping_response, &outbound_queue);
+    break;
+  case NK_SSH_REQUEST:
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_ssh_request\n");
+    // permitopen happens first for ssh so we can avoid a bunch of unnecessary tasks
+    if (!permitopen_index_allows(&params.permitopen_index, "localhost", params.local_sshd_port)) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Ignoring request to localhost:%d\n", params.local_sshd_port);
+      metrics_inc(METRIC_REQUESTS_REJECTED_NOT_PERMITTED);
+      // TODO notify daemon doesn't permit connections to $requested_host:$requested_port
+      break;
+    }
+    handle_ssh_request(&pool, &outbound_queue, &replays, &sessions, &params, &is_child_process, &item->message,
+                       signingkey, &item->trace);
+    if (is_child_process) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Exiting child process\n");
+    }
+    break;
+  case NK_NPT_REQUEST:
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Executing handle_npt_request\n");
+    // No permitopen here... since we need to parse the json first in order to check, it happens inside
+    // handle_npt_request
+    handle_npt_request(&pool, &outbound_queue, &replays, &sessions, &params, &is_child_process, &item->message,
+                       signingkey, &item->trace);
+    break;
+  case NK_NONE:
+    break;
+  }
+
+  // The srv child process has nothing more to add to the trace, only the daemon writes it out
+  if (!is_child_process) {
+    usdt_probe1(sshnpd, handler_done, notification_key_map[item->key].str);
+    request_trace_finish(&tracer, &item->trace);
+    if (item->key != NK_NONE) {
+      metrics_observe_us(METRIC_HANDLER_SSHPUBLICKEY + (item->key - NK_SSHPUBLICKEY), metrics_now_us() - handler_began);
+    }
+    update_gauges();
+  }
+  atclient_monitor_response_free(&item->message);
+  free(item);
+  // Otherwise batch the appends up until the queue runs dry
+  if (!is_child_process && pending.total == 0) {
+    authorized_keys_flush(&authkeys);
+  }
+  return is_child_process;
 }
 
-static int reconnect_atclient() {
-  char *TAG = "reconnect";
-  int ret = 0;
+// Find the atServer, preferring an address cached under --storage-path to asking the root server
+static int find_atserver_address(bool *from_cache) {
+  *from_cache = false;
+  time_t stored_at = 0;
+  bool cached = params.storage_path != NULL &&
+                atserver_address_cache_load(params.storage_path, params.atsign, &atserver_host, &atserver_port,
+                                            &stored_at) == 0;
+  if (cached && time(NULL) - stored_at < ATSERVER_ADDRESS_CACHE_TTL_SECONDS) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Using cached atServer address %s:%d\n", atserver_host,
+             atserver_port);
+    *from_cache = true;
+    return 0;
+  }
 
-  if (!atclient_is_connected(&worker)) {
-    atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Worker client is not connected, attempting to reconnect:\n");
-    ret = atclient_pkam_authenticate(&worker, params.atsign, &atkeys, NULL, NULL);
+  char *host = NULL;
+  int port = 0;
+  int res = atclient_utils_find_atserver_address(params.root_domain, ROOT_PORT, params.atsign, &host, &port);
+  if (res != 0) {
+    if (cached) {
+      // An old address beats not starting at all while the root server is unreachable
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN,
+               "Failed to look up the atServer address, falling back to the expired cached address %s:%d\n",
+               atserver_host, atserver_port);
+      *from_cache = true;
+      return 0;
+    }
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to look up the atServer address\n");
+    return res;
+  }
 
-    if (ret != 0) {
-      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to reconnect to the atServer.\n");
-      goto exit;
+  free(atserver_host);
+  atserver_host = host;
+  atserver_port = port;
+  if (params.storage_path != NULL) {
+    atserver_address_cache_store(params.storage_path, params.atsign, atserver_host, atserver_port, time(NULL));
+  }
+  return 0;
+}
+
+// Publish atserver_host:atserver_port as the address every connection authenticates against from now on. Callers hold
+// address_lock once the validator may be running.
+static int set_auth_options() {
+  atserver_address *address = malloc(sizeof(atserver_address));
+  if (address == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for the atServer address\n");
+    return 1;
+  }
+  atclient_authenticate_options_init(&address->options);
+  int res = atclient_authenticate_options_set_atserver_host(&address->options, atserver_host);
+  if (res == 0) {
+    res = atclient_authenticate_options_set_atserver_port(&address->options, atserver_port);
+  }
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set the atServer address to authenticate with\n");
+    atclient_authenticate_options_free(&address->options);
+    free(address);
+    return res;
+  }
+
+  address->previous = addresses;
+  addresses = address;
+  __atomic_store_n(&auth_options, &address->options, __ATOMIC_RELEASE);
+  if (pool_ready) {
+    atclient_pool_set_auth_options(&pool, &address->options);
+  }
+  return 0;
+}
+
+static atclient_authenticate_options *current_auth_options() {
+  return __atomic_load_n(&auth_options, __ATOMIC_ACQUIRE);
+}
+
+// Switch to an address the root server has just given us if the atServer has moved, takes ownership of host
+static void update_atserver_address(char *host, int port) {
+  pthread_mutex_lock(&address_lock);
+  if (strcmp(host, atserver_host) != 0 || port != atserver_port) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "The atServer address has changed from %s:%d to %s:%d\n",
+             atserver_host, atserver_port, host, port);
+    char *old_host = atserver_host;
+    int old_port = atserver_port;
+    atserver_host = host;
+    atserver_port = port;
+    if (set_auth_options() == 0) {
+      host = old_host;
+    } else {
+      // Keep using the old one
+      atserver_host = old_host;
+      atserver_port = old_port;
     }
+  }
+  // Store it either way, which also restarts the TTL
+  if (params.storage_path != NULL) {
+    atserver_address_cache_store(params.storage_path, params.atsign, atserver_host, atserver_port, time(NULL));
+  }
+  pthread_mutex_unlock(&address_lock);
+  free(host);
+}
 
-    atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Reconnected to the atServer!\n");
-    ret = set_worker_hooks();
+// After a reconnect has failed, in case it failed because the atServer has moved
+static void refresh_atserver_address() {
+  char *host = NULL;
+  int port = 0;
+  if (atclient_utils_find_atserver_address(params.root_domain, ROOT_PORT, params.atsign, &host, &port) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to look up the atServer address again\n");
+    return;
+  }
+  update_atserver_address(host, port);
+}
 
-    if (ret != 0) {
-      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set worker hooks for the atServer.\n");
+// Joined at exit
+static void *validate_cached_address(void *arg) {
+  (void)arg;
+  char *host = NULL;
+  int port = 0;
+  if (atclient_utils_find_atserver_address(params.root_domain, ROOT_PORT, params.atsign, &host, &port) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Could not validate the cached atServer address yet\n");
+    return NULL;
+  }
+  update_atserver_address(host, port);
+  return NULL;
+}
+
+static int authenticate_monitor(void) {
+  int res = atclient_monitor_pkam_authenticate(&monitor_ctx, params.atsign, &atkeys, current_auth_options());
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to authenticate the monitor connection\n");
+  }
+  return res;
+}
+
+static int authenticate_decrypt_ctx(void) {
+  int res = atclient_pkam_authenticate(&decrypt_ctx, params.atsign, &atkeys, current_auth_options(), NULL);
+  if (res != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to authenticate the decrypt connection\n");
+  }
+  return res;
+}
+
+static int authenticate_pool(void) {
+  int res = atclient_pool_init(&pool, WORKER_POOL_SIZE, params.atsign, &atkeys, current_auth_options());
+  pool_ready = res == 0;
+  return res;
+}
+
+static void *run_startup_job(void *void_job) {
+  startup_job *job = void_job;
+  job->began_us = startup_profile_now_us();
+  job->res = job->run();
+  job->ended_us = startup_profile_now_us();
+  return NULL;
+}
+
+// Authenticating every connection at once costs the slowest handshake instead of the sum of them
+static void start_authentication() {
+  for (size_t i = 0; i < sizeof(startup_jobs) / sizeof(startup_jobs[0]); i++) {
+    startup_job *job = startup_jobs + i;
+    job->res = 0;
+    job->started = pthread_create(&job->tid, NULL, run_startup_job, job) == 0;
+    if (!job->started) {
+      run_startup_job(job);
     }
   }
+}
 
-exit:
-  return ret;
+// Safe to call more than once, returns the first failure
+static int finish_authentication() {
+  int res = 0;
+  for (size_t i = 0; i < sizeof(startup_jobs) / sizeof(startup_jobs[0]); i++) {
+    startup_job *job = startup_jobs + i;
+    if (job->started) {
+      pthread_join(job->tid, NULL);
+      job->started = false;
+      startup_profile_add(&profile, job->name, job->began_us, job->ended_us);
+    }
+    if (res == 0) {
+      res = job->res;
+    }
+  }
+  return res;
 }
 
-static int reconnect_monitor() {
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Seems the monitor connection is down, trying to reconnect\n");
+// Throw away whatever the startup jobs connected, so they can be run again against another address
+static void reset_connections() {
+  atclient_connection_disconnect(&monitor_ctx.atserver_connection);
+  atclient_free(&monitor_ctx);
+  atclient_init(&monitor_ctx);
+  atclient_set_read_timeout(&monitor_ctx, MONITOR_READ_TIMEOUT_MS);
+  atclient_connection_disconnect(&decrypt_ctx.atserver_connection);
+  atclient_free(&decrypt_ctx);
+  atclient_init(&decrypt_ctx);
+  if (pool_ready) {
+    atclient_pool_free(&pool);
+    pool_ready = false;
+  }
+}
+
+static int reconnect_decrypt_ctx() {
+  if (monotonic_ms() < decrypt_retry_at) {
+    return 1; // still backing off
+  }
+  if (atclient_is_connected(&decrypt_ctx)) {
+    return 0;
+  }
 
-  int ret = atclient_monitor_pkam_authenticate(&monitor_ctx, params.atsign, &atkeys, NULL);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Decrypt client is not connected, attempting to reconnect\n");
+  metrics_inc(METRIC_RECONNECTS_DECRYPT);
+  int ret = atclient_pkam_authenticate(&decrypt_ctx, params.atsign, &atkeys, current_auth_options(), NULL);
   if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                 "Monitor connection failed to reconnect, trying again in 1 second...\n");
-    sleep(1);
+    metrics_inc(METRIC_RECONNECT_FAILURES_DECRYPT);
+    int64_t delay = backoff_next_ms(&decrypt_backoff);
+    decrypt_retry_at = monotonic_ms() + delay;
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+             "Failed to reconnect the decrypt client, trying again in %ld ms\n", (long)delay);
+    refresh_atserver_address();
     return ret;
   }
 
-  ret = atclient_monitor_start(&monitor_ctx, regex);
+  backoff_reset(&decrypt_backoff);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Reconnected the decrypt client.\n");
+  return 0;
+}
+
+static int reconnect_monitor() {
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Seems the monitor connection is down, trying to reconnect\n");
+
+  metrics_inc(METRIC_RECONNECTS_MONITOR);
+  int ret = atclient_monitor_pkam_authenticate(&monitor_ctx, params.atsign, &atkeys, current_auth_options());
   if (ret != 0) {
-    atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Monitor verb failed to restart.\n");
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Monitor connection failed to reconnect.\n");
+  } else if ((ret = atclient_monitor_start(&monitor_ctx, regex)) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Monitor verb failed to restart.\n");
+  }
+
+  if (ret != 0) {
+    metrics_inc(METRIC_RECONNECT_FAILURES_MONITOR);
+    int64_t delay = backoff_next_ms(&monitor_backoff);
+    monitor_retry_at = monotonic_ms() + delay;
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Trying the monitor connection again in %ld ms\n", (long)delay);
+    refresh_atserver_address();
     return ret;
   }
 
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Reconnected the monitor connection.\n");
+  backoff_reset(&monitor_backoff);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Reconnected the monitor connection.\n");
   return 0;
 }
+
+static bool probe_monitor(int64_t *heartbeat_sent) {
+  if (*heartbeat_sent != 0) {
+    return true; // already waiting on one
+  }
+
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Sending monitor heartbeat\n");
+  if (atclient_send_heartbeat(&monitor_ctx) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to send the monitor heartbeat\n");
+    return false;
+  }
+  *heartbeat_sent = monotonic_ms();
+  return true;
+}
+
+static int wait_for_events(int timeout_ms, bool watch_monitor) {
+  // mbedtls may already hold decrypted data that poll can't see on the socket
+  if (watch_monitor && mbedtls_ssl_get_bytes_avail(&monitor_ctx.atserver_connection.ssl) > 0) {
+    return EVENT_MONITOR;
+  }
+
+  // poll ignores negative fds
+  struct pollfd fds[3] = {
+      {.fd = watch_monitor ? monitor_ctx.atserver_connection.net.fd : -1, .events = POLLIN},
+      {.fd = signal_pipe[0], .events = POLLIN},
+      {.fd = reports.fds[0], .events = POLLIN},
+  };
+  int ret = poll(fds, 3, timeout_ms);
+  if (ret <= 0) {
+    if (ret < 0 && errno != EINTR) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "poll failed: %s\n", strerror(errno));
+    }
+    return 0;
+  }
+
+  int events = 0;
+  // a hung up or errored socket is reported as readable, so that the read fails and we reconnect
+  if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+    events |= EVENT_MONITOR;
+  }
+  if (fds[1].revents & POLLIN) {
+    events |= EVENT_SIGNAL;
+  }
+  if (fds[2].revents & POLLIN) {
+    events |= EVENT_SRV_REPORTS;
+  }
+  return events;
+}
+
+static void handle_signals() {
+  unsigned char sig;
+  while (read(signal_pipe[0], &sig, 1) == 1) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Received signal: %d\n", sig);
+    if (sig == SRV_STATS_SIGNAL) {
+      // Each srv reports its live sessions back through the reports socket
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_INFO, "Asking %zu srv processes for their session stats\n",
+               sessions.sessions_len);
+      for (size_t i = 0; i < sessions.sessions_len; i++) {
+        kill(sessions.sessions[i].pid, SRV_STATS_SIGNAL);
+      }
+      continue;
+    }
+    if (sig != SIGCHLD) {
+      continue;
+    }
+    // One SIGCHLD may stand for several exited children
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      session_table_remove(&sessions, pid);
+      if (WIFEXITED(status)) {
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "pid %d exited\n", pid);
+      } else {
+        lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "pid %d exited abnormally\n", pid);
+      }
+    }
+  }
+  if (!should_run) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Received SIGINT, shutting down\n");
+  }
+  update_gauges();
+}
+
+// The session table and request queue belong to the main loop, so it publishes their sizes whenever they change
+static void update_gauges() {
+  metrics_set(METRIC_LIVE_SESSIONS, (int64_t)sessions.sessions_len);
+  metrics_set(METRIC_QUEUED_REQUESTS, (int64_t)pending.total);
+}
+
+static int64_t monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
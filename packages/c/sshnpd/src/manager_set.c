@@ -0,0 +1,109 @@
+#include "sshnpd/manager_set.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// 32-bit FNV-1a of the lower cased atSign, good enough for a handful of short atSigns
+static uint32_t hash_atsign(const char *atsign) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *c = (const unsigned char *)atsign; *c != '\0'; c++) {
+    hash ^= (unsigned char)tolower(*c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// A lower cased copy with the leading '@', the caller frees it
+static char *normalize_atsign(const char *atsign) {
+  size_t prefix = atsign[0] == '@' ? 0 : 1;
+  char *normalized = malloc(prefix + strlen(atsign) + 1);
+  if (normalized == NULL) {
+    return NULL;
+  }
+  normalized[0] = '@';
+  char *out = normalized + prefix;
+  for (const char *c = atsign; *c != '\0'; c++) {
+    *out++ = (char)tolower((unsigned char)*c);
+  }
+  *out = '\0';
+  return normalized;
+}
+
+int manager_set_init(manager_set *set, char **managers, size_t managers_len) {
+  // Keep the load factor at or below 1/2 so probe sequences stay short
+  size_t capacity = 8;
+  while (capacity < managers_len * 2) {
+    capacity *= 2;
+  }
+
+  set->slots = calloc(capacity, sizeof(char *));
+  if (set->slots == NULL) {
+    return 1;
+  }
+  set->hashes = calloc(capacity, sizeof(uint32_t));
+  if (set->hashes == NULL) {
+    free(set->slots);
+    return 1;
+  }
+  set->capacity = capacity;
+  set->len = 0;
+
+  for (size_t i = 0; i < managers_len; i++) {
+    char *manager = normalize_atsign(managers[i]);
+    if (manager == NULL) {
+      manager_set_free(set);
+      return 1;
+    }
+    uint32_t hash = hash_atsign(manager);
+    size_t slot = hash & (capacity - 1);
+    bool duplicate = false;
+    while (set->slots[slot] != NULL) {
+      if (set->hashes[slot] == hash && strcmp(set->slots[slot], manager) == 0) {
+        duplicate = true;
+        break;
+      }
+      slot = (slot + 1) & (capacity - 1);
+    }
+    if (duplicate) {
+      free(manager);
+    } else {
+      set->slots[slot] = manager;
+      set->hashes[slot] = hash;
+      set->len++;
+    }
+  }
+
+  return 0;
+}
+
+bool manager_set_contains(const manager_set *set, const char *atsign) {
+  if (atsign == NULL || set->len == 0) {
+    return false;
+  }
+
+  uint32_t hash = hash_atsign(atsign);
+  size_t slot = hash & (set->capacity - 1);
+  while (set->slots[slot] != NULL) {
+    if (set->hashes[slot] == hash && strcasecmp(set->slots[slot], atsign) == 0) {
+      return true;
+    }
+    slot = (slot + 1) & (set->capacity - 1);
+  }
+  return false;
+}
+
+void manager_set_free(manager_set *set) {
+  for (size_t i = 0; i < set->capacity; i++) {
+    free(set->slots[i]);
+  }
+  free(set->slots);
+  free(set->hashes);
+  set->slots = NULL;
+  set->hashes = NULL;
+  set->capacity = 0;
+  set->len = 0;
+}
@@ -0,0 +1,425 @@
+#include "sshnpd/metrics.h"
+#include "srv/log.h"
+#include <arpa/inet.h>
+#include <atlogger/atlogger.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOGGER_TAG "METRICS"
+// How long a client gets to send its request before it is answered anyway
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+#define METRICS_LISTEN_BACKLOG 8
+
+// A client which hangs up early mustn't take the daemon down with SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define METRICS_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define METRICS_SEND_FLAGS 0
+#endif
+
+typedef struct {
+  const char *name;
+  const char *labels; // without the braces, NULL for none
+  const char *help;
+} metric_info;
+
+// Series of the same metric must be next to each other, the HELP and TYPE lines are written before the first one
+static const metric_info counter_info[METRIC_COUNTERS] = {
+    {"sshnpd_notifications_total", "type=\"sshpublickey\"", "Notifications received from managers, by type"},
+    {"sshnpd_notifications_total", "type=\"ping\"", NULL},
+    {"sshnpd_notifications_total", "type=\"ssh_request\"", NULL},
+    {"sshnpd_notifications_total", "type=\"npt_request\"", NULL},
+    {"sshnpd_notifications_unauthorized_total", NULL, "Notifications dropped because they weren't from a manager"},
+    {"sshnpd_notifications_shed_total", NULL, "Notifications dropped because too many were queued"},
+    {"sshnpd_requests_accepted_total", NULL, "ssh and npt requests which started a session"},
+    {"sshnpd_requests_rejected_total", "reason=\"bad_envelope\"", "ssh and npt requests which were refused, by reason"},
+    {"sshnpd_requests_rejected_total", "reason=\"stale\"", NULL},
+    {"sshnpd_requests_rejected_total", "reason=\"replayed\"", NULL},
+    {"sshnpd_requests_rejected_total", "reason=\"bad_signature\"", NULL},
+    {"sshnpd_requests_rejected_total", "reason=\"not_permitted\"", NULL},
+    {"sshnpd_requests_rejected_total", "reason=\"session_limit\"", NULL},
+    {"sshnpd_requests_failed_total", NULL, "ssh and npt requests which were accepted but couldn't be set up"},
+    {"sshnpd_reconnects_total", "connection=\"monitor\"", "Attempts to reconnect to the atServer, by connection"},
+    {"sshnpd_reconnects_total", "connection=\"decrypt\"", NULL},
+    {"sshnpd_reconnects_total", "connection=\"pool\"", NULL},
+    {"sshnpd_reconnect_failures_total", "connection=\"monitor\"", "Failed attempts to reconnect, by connection"},
+    {"sshnpd_reconnect_failures_total", "connection=\"decrypt\"", NULL},
+    {"sshnpd_reconnect_failures_total", "connection=\"pool\"", NULL},
+    {"sshnpd_pool_contended_checkouts_total", NULL, "Worker atclient checkouts which had to wait for another holder"},
+    {"sshnpd_srv_sessions_closed_total", NULL, "srv sessions which have closed and reported their traffic"},
+    {"sshnpd_srv_bytes_relayed_total", "direction=\"to_rvd\"", "Bytes forwarded by closed srv sessions, by direction"},
+    {"sshnpd_srv_bytes_relayed_total", "direction=\"to_local\"", NULL},
+};
+
+static const metric_info gauge_info[METRIC_GAUGES] = {
+    {"sshnpd_live_sessions", NULL, "srv processes which haven't exited yet"},
+    {"sshnpd_queued_requests", NULL, "Notifications read from the monitor but not yet handled"},
+};
+
+static const metric_info histogram_info[METRIC_HISTOGRAMS] = {
+    {"sshnpd_handler_seconds", "type=\"sshpublickey\"", "Time spent handling a notification, by type"},
+    {"sshnpd_handler_seconds", "type=\"ping\"", NULL},
+    {"sshnpd_handler_seconds", "type=\"ssh_request\"", NULL},
+    {"sshnpd_handler_seconds", "type=\"npt_request\"", NULL},
+    {"sshnpd_pool_wait_seconds", NULL, "Time spent waiting to check out a worker atclient"},
+    {"sshnpd_pool_hold_seconds", NULL, "Time a worker atclient was checked out for"},
+};
+
+typedef struct {
+  uint64_t buckets[METRICS_HISTOGRAM_BUCKETS + 1]; // not cumulative, the last one is +Inf
+  uint64_t count;
+  uint64_t sum_us;
+} histogram;
+
+static const int64_t bounds_us[METRICS_HISTOGRAM_BUCKETS] = METRICS_HISTOGRAM_BOUNDS_US;
+static uint64_t counters[METRIC_COUNTERS];
+static int64_t gauges[METRIC_GAUGES];
+static histogram histograms[METRIC_HISTOGRAMS];
+
+// The listening sockets belong to the daemon, a forked srv process shouldn't keep them (or the port) open
+static int listening_fds[2] = {-1, -1};
+static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+
+static void after_fork_in_child(void) {
+  for (int i = 0; i < 2; i++) {
+    if (listening_fds[i] >= 0) {
+      close(listening_fds[i]);
+      listening_fds[i] = -1;
+    }
+  }
+}
+
+static void register_hooks(void) { pthread_atfork(NULL, NULL, after_fork_in_child); }
+
+void metrics_inc(enum metric_counter counter) { __atomic_fetch_add(&counters[counter], 1, __ATOMIC_RELAXED); }
+
+void metrics_add(enum metric_counter counter, uint64_t n) {
+  __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_set(enum metric_gauge gauge, int64_t value) { __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED); }
+
+void metrics_observe_us(enum metric_histogram which, int64_t duration_us) {
+  if (duration_us < 0) {
+    duration_us = 0;
+  }
+  size_t bucket = 0;
+  while (bucket < METRICS_HISTOGRAM_BUCKETS && duration_us > bounds_us[bucket]) {
+    bucket++;
+  }
+  histogram *h = histograms + which;
+  __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum_us, (uint64_t)duration_us, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+int64_t metrics_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void write_header(FILE *out, const metric_info *info, const char *type) {
+  if (info->help != NULL) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, type);
+  }
+}
+
+// Writes name{labels,extra} or name{labels} or name, followed by a space
+static void write_series(FILE *out, const char *name, const char *suffix, const char *labels, const char *extra) {
+  fprintf(out, "%s%s", name, suffix);
+  if (labels != NULL && extra != NULL) {
+    fprintf(out, "{%s,%s} ", labels, extra);
+  } else if (labels != NULL || extra != NULL) {
+    fprintf(out, "{%s} ", labels != NULL ? labels : extra);
+  } else {
+    fputc(' ', out);
+  }
+}
+
+int metrics_write(FILE *out) {
+  for (size_t i = 0; i < METRIC_COUNTERS; i++) {
+    write_header(out, counter_info + i, "counter");
+    write_series(out, counter_info[i].name, "", counter_info[i].labels, NULL);
+    fprintf(out, "%llu\n", (unsigned long long)__atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+  }
+
+  for (size_t i = 0; i < METRIC_GAUGES; i++) {
+    write_header(out, gauge_info + i, "gauge");
+    write_series(out, gauge_info[i].name, "", gauge_info[i].labels, NULL);
+    fprintf(out, "%lld\n", (long long)__atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+  }
+
+  for (size_t i = 0; i < METRIC_HISTOGRAMS; i++) {
+    const metric_info *info = histogram_info + i;
+    histogram *h = histograms + i;
+    write_header(out, info, "histogram");
+
+    // Observations may land while we read, so the count is taken from the buckets to keep the series consistent
+    uint64_t cumulative = 0;
+    char le[32];
+    for (size_t b = 0; b <= METRICS_HISTOGRAM_BUCKETS; b++) {
+      cumulative += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+      if (b < METRICS_HISTOGRAM_BUCKETS) {
+        snprintf(le, sizeof(le), "le=\"%g\"", (double)bounds_us[b] / 1000000.0);
+      } else {
+        snprintf(le, sizeof(le), "le=\"+Inf\"");
+      }
+      write_series(out, info->name, "_bucket", info->labels, le);
+      fprintf(out, "%llu\n", (unsigned long long)cumulative);
+    }
+    write_series(out, info->name, "_sum", info->labels, NULL);
+    fprintf(out, "%.6f\n", (double)__atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1000000.0);
+    write_series(out, info->name, "_count", info->labels, NULL);
+    fprintf(out, "%llu\n", (unsigned long long)cumulative);
+  }
+  return ferror(out) ? 1 : 0;
+}
+
+static int listen_unix(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "The metrics socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create the metrics socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // A socket left behind by a daemon which didn't exit cleanly would make bind fail, but anything else at the path
+  // (e.g. a mistyped --metrics-socket, or another daemon's live socket) is left alone
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "%s already exists and isn't a socket, not replacing it\n",
+               path);
+      close(fd);
+      return -1;
+    }
+    // Nobody listening means it is stale
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 || errno != ECONNREFUSED) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "%s is in use, not replacing it\n", path);
+      close(fd);
+      return -1;
+    }
+    // A failed connect leaves the socket unusable, start again with a fresh one
+    close(fd);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create the metrics socket: %s\n",
+               strerror(errno));
+      return -1;
+    }
+  }
+  // Only the daemon's user may read the metrics
+  mode_t old_umask = umask(0177);
+  int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_umask);
+  if (ret != 0 || listen(fd, METRICS_LISTEN_BACKLOG) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int listen_loopback(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create the metrics socket: %s\n", strerror(errno));
+    return -1;
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, METRICS_LISTEN_BACKLOG) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to listen on 127.0.0.1:%d: %s\n", port,
+             strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, METRICS_SEND_FLAGS);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+}
+
+static void serve_client(int fd) {
+#ifdef SO_NOSIGPIPE
+  int nosigpipe = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+  // Read whatever the client sends first, a plain nc might not send anything at all
+  char request[512];
+  ssize_t request_len = 0;
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0) {
+    request_len = read(fd, request, sizeof(request) - 1);
+  }
+  bool http = request_len >= 4 && strncmp(request, "GET ", 4) == 0;
+
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&body, &body_len);
+  if (out == NULL) {
+    return;
+  }
+  metrics_write(out);
+  if (fclose(out) != 0) {
+    free(body);
+    return;
+  }
+
+  if (http) {
+    char header[160];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n"
+                              "Connection: close\r\n\r\n",
+                              (unsigned long)body_len);
+    send_all(fd, header, (size_t)header_len);
+  }
+  send_all(fd, body, body_len);
+  free(body);
+}
+
+static void *metrics_server_loop(void *void_server) {
+  metrics_server *server = void_server;
+  struct pollfd fds[3] = {
+      {.fd = server->stop_pipe[0], .events = POLLIN},
+      {.fd = server->unix_fd, .events = POLLIN},
+      {.fd = server->tcp_fd, .events = POLLIN},
+  };
+
+  for (;;) {
+    // poll ignores the negative fds of sockets we aren't listening on
+    if (poll(fds, 3, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Metrics server poll failed: %s\n", strerror(errno));
+      break;
+    }
+    if (fds[0].revents != 0) {
+      break;
+    }
+    for (int i = 1; i < 3; i++) {
+      if (!(fds[i].revents & POLLIN)) {
+        continue;
+      }
+      int client = accept(fds[i].fd, NULL, NULL);
+      if (client < 0) {
+        continue;
+      }
+      serve_client(client);
+      close(client);
+    }
+  }
+  return NULL;
+}
+
+int metrics_server_start(metrics_server *server, const char *socket_path, int port) {
+  server->unix_fd = -1;
+  server->tcp_fd = -1;
+  server->stop_pipe[0] = -1;
+  server->stop_pipe[1] = -1;
+  server->socket_path = NULL;
+  server->running = false;
+  if (socket_path == NULL && port == 0) {
+    return 0;
+  }
+  pthread_once(&hooks_once, register_hooks);
+
+  if (socket_path != NULL) {
+    server->unix_fd = listen_unix(socket_path);
+    server->socket_path = strdup(socket_path);
+    if (server->unix_fd < 0 || server->socket_path == NULL) {
+      goto cancel;
+    }
+  }
+  if (port != 0 && (server->tcp_fd = listen_loopback(port)) < 0) {
+    goto cancel;
+  }
+  if (pipe(server->stop_pipe) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create the metrics stop pipe: %s\n",
+             strerror(errno));
+    goto cancel;
+  }
+
+  listening_fds[0] = server->unix_fd;
+  listening_fds[1] = server->tcp_fd;
+  int ret = pthread_create(&server->thread, NULL, metrics_server_loop, server);
+  if (ret != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to start the metrics server\n");
+    goto cancel;
+  }
+  server->running = true;
+  return 0;
+
+cancel:
+  metrics_server_stop(server);
+  return 1;
+}
+
+void metrics_server_stop(metrics_server *server) {
+  if (server->running) {
+    if (write(server->stop_pipe[1], "x", 1) != 1) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to wake the metrics server up: %s\n", strerror(errno));
+    }
+    pthread_join(server->thread, NULL);
+    server->running = false;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (server->stop_pipe[i] >= 0) {
+      close(server->stop_pipe[i]);
+      server->stop_pipe[i] = -1;
+    }
+  }
+  if (server->tcp_fd >= 0) {
+    close(server->tcp_fd);
+    server->tcp_fd = -1;
+  }
+  if (server->unix_fd >= 0) {
+    close(server->unix_fd);
+    server->unix_fd = -1;
+    unlink(server->socket_path);
+  }
+  free(server->socket_path);
+  server->socket_path = NULL;
+  listening_fds[0] = -1;
+  listening_fds[1] = -1;
+}
@@ -0,0 +1,212 @@
+#include "sshnpd/notify_queue.h"
+#include "srv/log.h"
+#include "sshnpd/atclient_pool.h"
+#include <atclient/atkey.h>
+#include <atclient/notify.h>
+#include <atclient/notify_params.h>
+#include <atlogger/atlogger.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOGGER_TAG "notify_queue"
+
+static void *notify_queue_sender(void *queue);
+static int send_job(atclient *atclient, notify_job *job);
+static void free_job(notify_job *job);
+
+int notify_queue_start(notify_queue *queue, atclient_pool *pool) {
+  queue->pool = pool;
+  queue->head = NULL;
+  queue->tail = NULL;
+  queue->depth = 0;
+  queue->running = true;
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+
+  int ret = pthread_create(&queue->sender, NULL, notify_queue_sender, queue);
+  if (ret != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to start the notification sender thread\n");
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+  }
+  return ret;
+}
+
+int notify_queue_push(notify_queue *queue, atclient_atkey *atkey, const char *value, notify_queue_callback *callback,
+                      void *callback_ctx) {
+  notify_job *job = malloc(sizeof(notify_job));
+  if (job == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for a notification\n");
+    return 1;
+  }
+
+  job->value = malloc(strlen(value) + 1);
+  if (job->value == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for a notification value\n");
+    free(job);
+    return 1;
+  }
+  strcpy(job->value, value);
+  job->callback = callback;
+  job->callback_ctx = callback_ctx;
+  job->next = NULL;
+
+  if (pthread_mutex_lock(&queue->lock) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get a lock on the notification queue\n");
+    free(job->value);
+    free(job);
+    return 1;
+  }
+
+  int ret = 0;
+  if (!queue->running) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Notification queue is stopped, dropping notification\n");
+    ret = 1;
+  } else if (queue->depth >= NOTIFY_QUEUE_MAX_DEPTH) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Notification queue is full, dropping notification\n");
+    ret = 1;
+  } else {
+    // Take ownership of the atkey, leaving the caller with an empty one
+    memcpy(&job->atkey, atkey, sizeof(atclient_atkey));
+    atclient_atkey_init(atkey);
+
+    if (queue->tail == NULL) {
+      queue->head = job;
+    } else {
+      queue->tail->next = job;
+    }
+    queue->tail = job;
+    queue->depth++;
+    pthread_cond_signal(&queue->not_empty);
+  }
+
+  if (pthread_mutex_unlock(&queue->lock) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to release notification queue lock\n");
+    exit(1);
+  }
+
+  if (ret != 0) {
+    free(job->value);
+    free(job);
+  }
+  return ret;
+}
+
+void notify_queue_stop(notify_queue *queue) {
+  if (pthread_mutex_lock(&queue->lock) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get a lock on the notification queue\n");
+    exit(1);
+  }
+  queue->running = false;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+
+  if (pthread_join(queue->sender, NULL) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to join the notification sender thread\n");
+    return;
+  }
+
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_mutex_destroy(&queue->lock);
+}
+
+static void *notify_queue_sender(void *void_queue) {
+  notify_queue *queue = void_queue;
+
+  while (true) {
+    if (pthread_mutex_lock(&queue->lock) != 0) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to get a lock on the notification queue\n");
+      exit(1);
+    }
+    while (queue->head == NULL && queue->running) {
+      pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->head == NULL) {
+      // stopped and fully drained
+      pthread_mutex_unlock(&queue->lock);
+      break;
+    }
+
+    // Detach a batch of jobs, so that handlers can keep pushing while we send
+    notify_job *batch = queue->head;
+    notify_job *last = batch;
+    size_t batch_len = 1;
+    while (last->next != NULL && batch_len < NOTIFY_QUEUE_BATCH_SIZE) {
+      last = last->next;
+      batch_len++;
+    }
+    queue->head = last->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+    queue->depth -= batch_len;
+    last->next = NULL;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Sending a batch of %lu notifications\n", batch_len);
+    atclient *atclient = atclient_pool_checkout(queue->pool, "notify_queue");
+    if (atclient == NULL) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
+               "Failed to check out an atclient, dropping %lu notifications\n", batch_len);
+    }
+
+    // Send the whole batch before running any callbacks, so the connection is checked back in as soon as possible
+    int results[NOTIFY_QUEUE_BATCH_SIZE];
+    size_t i = 0;
+    for (notify_job *job = batch; job != NULL; job = job->next) {
+      results[i++] = atclient == NULL ? 1 : send_job(atclient, job);
+    }
+    if (atclient != NULL) {
+      atclient_pool_checkin(queue->pool, atclient);
+    }
+
+    i = 0;
+    while (batch != NULL) {
+      notify_job *next = batch->next;
+      if (batch->callback != NULL) {
+        batch->callback(results[i], &batch->atkey, batch->callback_ctx);
+      }
+      i++;
+      free_job(batch);
+      batch = next;
+    }
+  }
+
+  return NULL;
+}
+
+static int send_job(atclient *atclient, notify_job *job) {
+  int ret = 0;
+  atclient_notify_params notify_params;
+  atclient_notify_params_init(&notify_params);
+
+  if ((ret = atclient_notify_params_set_atkey(&notify_params, &job->atkey)) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set atkey in notify params\n");
+    goto exit;
+  }
+
+  if ((ret = atclient_notify_params_set_operation(&notify_params, ATCLIENT_NOTIFY_OPERATION_UPDATE)) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set operation in notify params\n");
+    goto exit;
+  }
+
+  if ((ret = atclient_notify_params_set_value(&notify_params, job->value)) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to set value in notify params\n");
+    goto exit;
+  }
+
+  ret = atclient_notify(atclient, &notify_params, NULL);
+
+exit:
+  atclient_notify_params_free(&notify_params);
+  return ret;
+}
+
+static void free_job(notify_job *job) {
+  atclient_atkey_free(&job->atkey);
+  free(job->value);
+  free(job);
+}
@@ -7,6 +7,12 @@
 #include <string.h>
 
 #define default_permitopen "localhost:22,localhost:3389"
+#define default_request_max_age 300
+#define default_max_sessions 32
+#define default_max_sessions_per_atsign 8
+#define default_session_rate 20
+#define default_session_burst 5
+#define default_trace_sample 1
 void apply_default_values_to_sshnpd_params(sshnpd_params *params) {
   params->key_file = NULL;
   params->atsign = NULL;
@@ -20,6 +26,17 @@ void apply_default_values_to_sshnpd_params(sshnpd_params *params) {
   params->root_domain = "root.atsign.org";
   params->local_sshd_port = 22;
   params->storage_path = NULL;
+  params->startup_profile = NULL;
+  params->trace_file = NULL;
+  params->trace_sample = default_trace_sample;
+  params->metrics_socket = NULL;
+  params->metrics_port = 0;
+  params->request_max_age = default_request_max_age;
+  params->max_sessions = default_max_sessions;
+  params->max_sessions_per_atsign = default_max_sessions_per_atsign;
+  params->session_rate = default_session_rate;
+  params->session_burst = default_session_burst;
+  params->srv_stats_fd = -1;
 }
 
 int parse_sshnpd_params(sshnpd_params *params, int argc, const char **argv) {
@@ -46,12 +63,39 @@ int parse_sshnpd_params(sshnpd_params *params, int argc, const char **argv) {
       OPT_BOOLEAN('v', "verbose", &params->verbose, "Verbose output"),
       OPT_STRING(0, "permit-open", &permitopen,
                  "Comma separated-list of host:port to which the daemon will permit a connection from an authorized "
-                 "client. (defaults to \"localhost:22,localhost:3389\")"),
+                 "client. Hosts may be '*', *.domain or an IPv4 CIDR range (which only matches IP addresses, not "
+                 "hostnames), ports may be '*' or a range like 8000-8100. "
+                 "(defaults to \"localhost:22,localhost:3389\")"),
       OPT_STRING(0, "ssh-algorithm", &ssh_algorithm_input, "SSH algorithm to use"),
       OPT_STRING(0, "ephemeral-permission", &ephemeral_permissions, "(Kept for compatibility)"),
       OPT_STRING(0, "root-domain", &params->root_domain, "Root domain to use"),
       OPT_INTEGER(0, "local-sshd-port", &params->local_sshd_port, "Local sshd port to use"),
-      OPT_STRING(0, "storage-path", &params->storage_path, NULL),
+      OPT_STRING(0, "storage-path", &params->storage_path,
+                 "Directory to keep state in across restarts, e.g. the atServer address (not kept if unset)"),
+      OPT_STRING(0, "startup-profile", &params->startup_profile,
+                 "Append how long each startup step took to this file as a line of JSON, - for stderr"),
+      OPT_STRING(0, "trace", &params->trace_file,
+                 "Write how long each stage of handling ssh and npt requests took to this file, in Chrome trace event "
+                 "format (not traced if unset)"),
+      OPT_INTEGER(0, "trace-sample", &params->trace_sample,
+                  "Trace one in every this many ssh and npt requests (defaults to 1, every request)"),
+      OPT_STRING(0, "metrics-socket", &params->metrics_socket,
+                 "Serve metrics in Prometheus' text format on this unix socket (not served if unset)"),
+      OPT_INTEGER(0, "metrics-port", &params->metrics_port,
+                  "Serve metrics in Prometheus' text format on this port on 127.0.0.1 (not served if unset)"),
+      OPT_INTEGER(0, "request-max-age", &params->request_max_age,
+                  "Ignore ssh and npt requests sent more than this many seconds ago, 0 to accept requests of any age. "
+                  "(defaults to 300)"),
+      OPT_INTEGER(0, "max-sessions", &params->max_sessions,
+                  "Maximum number of live sessions, 0 for no limit (defaults to 32)"),
+      OPT_INTEGER(0, "max-sessions-per-atsign", &params->max_sessions_per_atsign,
+                  "Maximum number of live sessions for any one requesting atSign, 0 for no limit (defaults to 8)"),
+      OPT_INTEGER(0, "session-rate", &params->session_rate,
+                  "Maximum number of new sessions per minute for any one requesting atSign, 0 for no limit "
+                  "(defaults to 20)"),
+      OPT_INTEGER(0, "session-burst", &params->session_burst,
+                  "Number of new sessions a requesting atSign may start at once before --session-rate applies "
+                  "(defaults to 5)"),
 
       // Doesn't do anything more, added in case old config would cause a parsing issue
       OPT_BOOLEAN('u', "un-hide", NULL, NULL),
@@ -89,8 +133,8 @@ int parse_sshnpd_params(sshnpd_params *params, int argc, const char **argv) {
     strcpy(params->permitopen_str, default_permitopen);
     permitopen = params->permitopen_str;
   }
-  if ((parse_permitopen(permitopen, &params->permitopen_hosts, &params->permitopen_ports, &params->permitopen_len,
-                        false) != 0)) {
+  if ((parse_permitopen_ranges(permitopen, &params->permitopen_hosts, &params->permitopen_ports,
+                               &params->permitopen_port_ends, &params->permitopen_len, false) != 0)) {
     printf("Failed to parse permit-open string\n");
     free(params->permitopen_str);
     return 1;
@@ -100,6 +144,8 @@ int parse_sshnpd_params(sshnpd_params *params, int argc, const char **argv) {
   for (size_t i = 0; i < params->permitopen_len; i++) {
     if (params->permitopen_ports[i] == 0) {
       printf("%s:*\n", params->permitopen_hosts[i]);
+    } else if (params->permitopen_port_ends[i] != params->permitopen_ports[i]) {
+      printf("%s:%d-%d\n", params->permitopen_hosts[i], params->permitopen_ports[i], params->permitopen_port_ends[i]);
     } else {
       printf("%s:%d\n", params->permitopen_hosts[i], params->permitopen_ports[i]);
     }
@@ -121,6 +167,36 @@ int parse_sshnpd_params(sshnpd_params *params, int argc, const char **argv) {
     }
   }
 
+  if (params->request_max_age < 0) {
+    printf("Invalid Argument(s): --request-max-age must not be negative\n");
+    free(params->permitopen_str);
+    return 1;
+  }
+
+  if (params->max_sessions < 0 || params->max_sessions_per_atsign < 0 || params->session_rate < 0) {
+    printf("Invalid Argument(s): --max-sessions, --max-sessions-per-atsign and --session-rate must not be negative\n");
+    free(params->permitopen_str);
+    return 1;
+  }
+
+  if (params->session_burst < 1) {
+    printf("Invalid Argument(s): --session-burst must be at least 1\n");
+    free(params->permitopen_str);
+    return 1;
+  }
+
+  if (params->trace_sample < 1) {
+    printf("Invalid Argument(s): --trace-sample must be at least 1\n");
+    free(params->permitopen_str);
+    return 1;
+  }
+
+  if (params->metrics_port < 0 || params->metrics_port > 65535) {
+    printf("Invalid Argument(s): --metrics-port must be between 0 and 65535 (0 disables it)\n");
+    free(params->permitopen_str);
+    return 1;
+  }
+
   if (params->atsign[0] != '@') {
     printf("Invalid Argument(s): \"%s\" is not a valid atSign\n", params->atsign);
     free(params->permitopen_str);
@@ -178,5 +254,13 @@ int parse_sshnpd_params(sshnpd_params *params, int argc, const char **argv) {
   }
 
   // Repeat for permit-open
+
+  // Compile the rules once, rather than scanning them for every request
+  if (permitopen_index_init(&params->permitopen_index, params->permitopen_hosts, params->permitopen_ports,
+                            params->permitopen_port_ends, params->permitopen_len) != 0) {
+    printf("Invalid Argument(s): Failed to compile --permit-open, CIDR ranges must look like 10.0.0.0/8\n");
+    free(params->permitopen_str);
+    return 1;
+  }
   return 0;
 }
@@ -1,12 +1,42 @@
 #include "sshnpd/permitopen.h"
+#include "srv/log.h"
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+#define TAG "parse_permitopen"
+
+static void report_error(bool is_logger_available, const char *message, const char *value) {
+  if (is_logger_available) {
+    lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, message, value);
+  } else {
+    printf(message, value);
+  }
+}
+
+static bool parse_port(const char *input, long *port) {
+  char *end;
+  errno = 0;
+  *port = strtol(input, &end, 10);
+  return end != input && *end == '\0' && errno != ERANGE && *port >= 0 && *port <= UINT16_MAX;
+}
 
 int parse_permitopen(char *input, char ***permitopen_hosts, uint16_t **permitopen_ports, size_t *permitopen_len,
                      bool is_logger_available) {
-  const char *TAG = "parse_permitopen";
+  return parse_permitopen_ranges(input, permitopen_hosts, permitopen_ports, NULL, permitopen_len, is_logger_available);
+}
+
+int parse_permitopen_ranges(char *input, char ***permitopen_hosts, uint16_t **permitopen_ports,
+                            uint16_t **permitopen_port_ends, size_t *permitopen_len, bool is_logger_available) {
+  const char *port_error = "Argument error, received %s for port, must be a number 1-65535, a range like 8000-8100 "
+                           "or '*'\n";
+  if (permitopen_port_ends == NULL) {
+    port_error = "Argument error, received %s for port, must be a number 1-65535 or '*'\n";
+  }
   int sep_count = 0;
   int permitopen_end = strlen(input);
 
@@ -24,15 +54,14 @@ int parse_permitopen(char *input, char ***permitopen_hosts, uint16_t **permitope
   // malloc pointers to each string, but don't malloc any more memory for individual char storage
   *permitopen_hosts = malloc((sep_count) * sizeof(char *));
   *permitopen_ports = malloc((sep_count) * sizeof(uint16_t));
-  if (*permitopen_hosts == NULL) {
+  uint16_t *port_ends = malloc((sep_count) * sizeof(uint16_t));
+  if (*permitopen_hosts == NULL || *permitopen_ports == NULL || port_ends == NULL) {
     if (is_logger_available) {
-      atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for permitopen\n");
+      lazy_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to allocate memory for permitopen\n");
     } else {
       printf("Failed to allocate memory for permitopen\n");
     }
-    free(*permitopen_hosts);
-    free(*permitopen_ports);
-    return 1;
+    goto error;
   }
 
   int pos = 0;
@@ -41,45 +70,52 @@ int parse_permitopen(char *input, char ***permitopen_hosts, uint16_t **permitope
     (*permitopen_hosts)[i] = input + pos;
     // Jump to the port string
     pos += strlen(input + pos) + 1;
-    if (input[pos] == '*') {
-      (*permitopen_ports)[i] = 0;
-      if (input[pos + 1] != '\0') {
+    char *port_str = input + pos;
+    long first, last;
+    char *dash = strchr(port_str, '-');
+    if (port_str[0] == '*') {
+      if (port_str[1] != '\0') {
         // error received a string other than '*' for port
-        if (is_logger_available) {
-          atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                       "Argument error, received %s for port, must be a number 1-65535 or '*'", input + pos);
-        } else {
-          printf("Argument error, received %s for port, must be a number 1-65535 or '*'", input + pos);
-        }
-        free(*permitopen_hosts);
-        free(*permitopen_ports);
-        return 1;
+        report_error(is_logger_available, port_error, port_str);
+        goto error;
+      }
+      first = last = 0;
+    } else if (dash != NULL && permitopen_port_ends != NULL) {
+      *dash = '\0';
+      bool valid = parse_port(port_str, &first) && parse_port(dash + 1, &last) && first >= 1 && first <= last;
+      *dash = '-';
+      if (!valid) {
+        report_error(is_logger_available, port_error, port_str);
+        goto error;
       }
     } else {
-      char *end;
-      long num = strtol(input + pos, &end, 10);
-      if (end == input + pos || *end != '\0' || errno == ERANGE) {
-        if (is_logger_available) {
-          atlogger_log(TAG, ATLOGGER_LOGGING_LEVEL_ERROR,
-                       "Argument error, received %s for port, must be a number 1-65535 or '*'", input + pos);
-        } else {
-          printf("Argument error, received %s for port, must be a number 1-65535 or '*'", input + pos);
-        }
-        free(*permitopen_hosts);
-        free(*permitopen_ports);
-        return 1;
+      if (!parse_port(port_str, &first)) {
+        report_error(is_logger_available, port_error, port_str);
+        goto error;
       }
-
-      (*permitopen_ports)[i] = (uint16_t)num;
+      last = first;
     }
+    (*permitopen_ports)[i] = (uint16_t)first;
+    port_ends[i] = (uint16_t)last;
 
     // Jump to the host string
     //
     pos = pos + strlen(input + pos) + 1;
   }
 
+  if (permitopen_port_ends != NULL) {
+    *permitopen_port_ends = port_ends;
+  } else {
+    free(port_ends);
+  }
   *permitopen_len = sep_count;
   return 0;
+
+error:
+  free(*permitopen_hosts);
+  free(*permitopen_ports);
+  free(port_ends);
+  return 1;
 }
 
 bool should_permitopen(permitopen_params *params) {
@@ -98,3 +134,252 @@ bool should_permitopen(permitopen_params *params) {
 
   return false;
 }
+
+static int add_port_range(permitopen_port_set *set, uint16_t first, uint16_t last) {
+  permitopen_port_range *ranges = realloc(set->ranges, (set->len + 1) * sizeof(permitopen_port_range));
+  if (ranges == NULL) {
+    return 1;
+  }
+  ranges[set->len].first = first;
+  ranges[set->len].last = last;
+  set->ranges = ranges;
+  set->len++;
+  return 0;
+}
+
+static int compare_port_ranges(const void *a, const void *b) {
+  const permitopen_port_range *ra = a, *rb = b;
+  return (int)ra->first - (int)rb->first;
+}
+
+// Sort the ranges and merge the ones which overlap or touch, so a lookup is a binary search
+static void normalize_port_set(permitopen_port_set *set) {
+  if (set->len < 2) {
+    return;
+  }
+  qsort(set->ranges, set->len, sizeof(permitopen_port_range), compare_port_ranges);
+  size_t merged = 0;
+  for (size_t i = 1; i < set->len; i++) {
+    permitopen_port_range *last = &set->ranges[merged];
+    if ((uint32_t)set->ranges[i].first <= (uint32_t)last->last + 1) {
+      if (set->ranges[i].last > last->last) {
+        last->last = set->ranges[i].last;
+      }
+    } else {
+      set->ranges[++merged] = set->ranges[i];
+    }
+  }
+  set->len = merged + 1;
+}
+
+static bool port_set_contains(const permitopen_port_set *set, uint16_t port) {
+  size_t low = 0, high = set->len;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (set->ranges[mid].last < port) {
+      low = mid + 1;
+    } else if (set->ranges[mid].first > port) {
+      high = mid;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+// FNV-1a of the lower cased host, optionally as if it were prefixed with '*'
+static uint64_t hash_host(bool wildcard, const char *host) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  if (wildcard) {
+    hash = (hash ^ '*') * 0x100000001b3ULL;
+  }
+  for (const char *c = host; *c != '\0'; c++) {
+    hash = (hash ^ (unsigned char)tolower((unsigned char)*c)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static permitopen_host_entry *find_host(permitopen_index *index, bool wildcard, const char *host, bool insert) {
+  size_t mask = index->hosts_capacity - 1;
+  for (size_t i = hash_host(wildcard, host) & mask;; i = (i + 1) & mask) {
+    permitopen_host_entry *entry = &index->hosts[i];
+    if (entry->host == NULL) {
+      return insert ? entry : NULL;
+    }
+    if (wildcard ? entry->host[0] == '*' && strcasecmp(entry->host + 1, host) == 0
+                 : strcasecmp(entry->host, host) == 0) {
+      return entry;
+    }
+  }
+}
+
+static int parse_cidr(const char *cidr, uint32_t *addr, int *prefix_len) {
+  const char *slash = strchr(cidr, '/');
+  char addr_str[INET_ADDRSTRLEN];
+  if (slash == NULL || (size_t)(slash - cidr) >= sizeof(addr_str)) {
+    return 1;
+  }
+  memcpy(addr_str, cidr, slash - cidr);
+  addr_str[slash - cidr] = '\0';
+
+  struct in_addr in;
+  long len;
+  if (inet_pton(AF_INET, addr_str, &in) != 1 || !parse_port(slash + 1, &len) || len > 32) {
+    return 1;
+  }
+  *addr = ntohl(in.s_addr);
+  *prefix_len = (int)len;
+  return 0;
+}
+
+static permitopen_cidr_node *insert_cidr(permitopen_index *index, uint32_t addr, int prefix_len) {
+  if (index->cidr_root == NULL && (index->cidr_root = calloc(1, sizeof(permitopen_cidr_node))) == NULL) {
+    return NULL;
+  }
+  permitopen_cidr_node *node = index->cidr_root;
+  for (int bit = 0; bit < prefix_len; bit++) {
+    int branch = (addr >> (31 - bit)) & 1;
+    if (node->children[branch] == NULL && (node->children[branch] = calloc(1, sizeof(permitopen_cidr_node))) == NULL) {
+      return NULL;
+    }
+    node = node->children[branch];
+  }
+  return node;
+}
+
+static bool cidr_allows(const permitopen_cidr_node *node, uint32_t addr, uint16_t port) {
+  // Every node on the path is a prefix of addr, so any of their rules can permit it
+  for (int bit = 0; node != NULL; bit++) {
+    if (port_set_contains(&node->ports, port)) {
+      return true;
+    }
+    if (bit == 32) {
+      break;
+    }
+    node = node->children[(addr >> (31 - bit)) & 1];
+  }
+  return false;
+}
+
+static void normalize_cidr_node(permitopen_cidr_node *node) {
+  if (node == NULL) {
+    return;
+  }
+  normalize_port_set(&node->ports);
+  normalize_cidr_node(node->children[0]);
+  normalize_cidr_node(node->children[1]);
+}
+
+static void free_cidr_node(permitopen_cidr_node *node) {
+  if (node == NULL) {
+    return;
+  }
+  free_cidr_node(node->children[0]);
+  free_cidr_node(node->children[1]);
+  free(node->ports.ranges);
+  free(node);
+}
+
+int permitopen_index_init(permitopen_index *index, char **hosts, uint16_t *ports, uint16_t *port_ends, size_t len) {
+  memset(index, 0, sizeof(permitopen_index));
+
+  // At most half full, so probes stay short
+  index->hosts_capacity = 8;
+  while (index->hosts_capacity < len * 2) {
+    index->hosts_capacity <<= 1;
+  }
+  index->hosts = calloc(index->hosts_capacity, sizeof(permitopen_host_entry));
+  if (index->hosts == NULL) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    // port 0 is '*'
+    uint16_t first = ports[i];
+    uint16_t last = ports[i] == 0 ? UINT16_MAX : (port_ends != NULL ? port_ends[i] : ports[i]);
+    const char *host = hosts[i];
+
+    permitopen_port_set *set;
+    if (strcmp(host, "*") == 0) {
+      set = &index->any_host;
+    } else if (strchr(host, '/') != NULL) {
+      uint32_t addr;
+      int prefix_len;
+      if (parse_cidr(host, &addr, &prefix_len) != 0) {
+        goto error;
+      }
+      permitopen_cidr_node *node = insert_cidr(index, addr, prefix_len);
+      if (node == NULL) {
+        goto error;
+      }
+      set = &node->ports;
+    } else {
+      bool wildcard = host[0] == '*' && host[1] == '.';
+      permitopen_host_entry *entry = find_host(index, wildcard, wildcard ? host + 1 : host, true);
+      if (entry->host == NULL) {
+        if ((entry->host = strdup(host)) == NULL) {
+          goto error;
+        }
+        for (char *c = entry->host; *c != '\0'; c++) {
+          *c = (char)tolower((unsigned char)*c);
+        }
+      }
+      set = &entry->ports;
+    }
+    if (add_port_range(set, first, last) != 0) {
+      goto error;
+    }
+  }
+
+  normalize_port_set(&index->any_host);
+  for (size_t i = 0; i < index->hosts_capacity; i++) {
+    normalize_port_set(&index->hosts[i].ports);
+  }
+  normalize_cidr_node(index->cidr_root);
+  return 0;
+
+error:
+  permitopen_index_free(index);
+  return 1;
+}
+
+bool permitopen_index_allows(permitopen_index *index, const char *host, uint16_t port) {
+  if (port_set_contains(&index->any_host, port)) {
+    return true;
+  }
+
+  permitopen_host_entry *entry = find_host(index, false, host, false);
+  if (entry != NULL && port_set_contains(&entry->ports, port)) {
+    return true;
+  }
+  // a.b.example.com can be permitted by *.b.example.com or *.example.com (but not *.a.b.example.com)
+  for (const char *suffix = strchr(host, '.'); suffix != NULL; suffix = strchr(suffix + 1, '.')) {
+    entry = find_host(index, true, suffix, false);
+    if (entry != NULL && port_set_contains(&entry->ports, port)) {
+      return true;
+    }
+  }
+
+  // Only IP literals, srv connects to exactly the address which was checked
+  struct in_addr in;
+  if (index->cidr_root != NULL && inet_pton(AF_INET, host, &in) == 1) {
+    return cidr_allows(index->cidr_root, ntohl(in.s_addr), port);
+  }
+  return false;
+}
+
+void permitopen_index_free(permitopen_index *index) {
+  if (index->hosts != NULL) {
+    for (size_t i = 0; i < index->hosts_capacity; i++) {
+      free(index->hosts[i].host);
+      free(index->hosts[i].ports.ranges);
+    }
+    free(index->hosts);
+    index->hosts = NULL;
+  }
+  free(index->any_host.ranges);
+  index->any_host.ranges = NULL;
+  index->any_host.len = 0;
+  free_cidr_node(index->cidr_root);
+  index->cidr_root = NULL;
+}
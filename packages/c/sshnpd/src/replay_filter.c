@@ -0,0 +1,108 @@
+#include "sshnpd/replay_filter.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t hash_id(const char *id);
+static void expire(replay_filter *filter, time_t now);
+static bool table_contains(const replay_filter *filter, const uint64_t *table, uint64_t hash);
+
+int replay_filter_init(replay_filter *filter, size_t capacity, int window_seconds, time_t now) {
+  // Keep each table at most half full, so probe sequences stay short
+  size_t slots = 8;
+  while (slots < capacity * 2) {
+    slots *= 2;
+  }
+
+  filter->generations[0] = calloc(slots, sizeof(uint64_t));
+  filter->generations[1] = calloc(slots, sizeof(uint64_t));
+  if (filter->generations[0] == NULL || filter->generations[1] == NULL) {
+    free(filter->generations[0]);
+    free(filter->generations[1]);
+    return 1;
+  }
+  filter->len[0] = 0;
+  filter->len[1] = 0;
+  filter->current = 0;
+  filter->capacity = slots;
+  filter->window_seconds = window_seconds;
+  filter->rotated_at = now;
+  return 0;
+}
+
+bool replay_filter_contains(replay_filter *filter, const char *id, time_t now) {
+  expire(filter, now);
+  uint64_t hash = hash_id(id);
+  return table_contains(filter, filter->generations[0], hash) || table_contains(filter, filter->generations[1], hash);
+}
+
+void replay_filter_insert(replay_filter *filter, const char *id, time_t now) {
+  expire(filter, now);
+  uint64_t hash = hash_id(id);
+  if (table_contains(filter, filter->generations[filter->current], hash)) {
+    return;
+  }
+
+  // Rotate early rather than let the table fill up
+  if ((filter->len[filter->current] + 1) * 2 > filter->capacity) {
+    filter->current ^= 1;
+    memset(filter->generations[filter->current], 0, sizeof(uint64_t) * filter->capacity);
+    filter->len[filter->current] = 0;
+    filter->rotated_at = now;
+  }
+
+  uint64_t *table = filter->generations[filter->current];
+  size_t slot = hash & (filter->capacity - 1);
+  while (table[slot] != 0) {
+    slot = (slot + 1) & (filter->capacity - 1);
+  }
+  table[slot] = hash;
+  filter->len[filter->current]++;
+}
+
+void replay_filter_free(replay_filter *filter) {
+  free(filter->generations[0]);
+  free(filter->generations[1]);
+  filter->generations[0] = NULL;
+  filter->generations[1] = NULL;
+}
+
+// 64-bit FNV-1a, with 0 reserved for empty slots
+static uint64_t hash_id(const char *id) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const unsigned char *c = (const unsigned char *)id; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ull;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+static void expire(replay_filter *filter, time_t now) {
+  time_t elapsed = now - filter->rotated_at;
+  if (elapsed < filter->window_seconds) {
+    return;
+  }
+
+  // Once two windows have passed, nothing in either generation is recent any more
+  int rotations = elapsed >= 2 * (time_t)filter->window_seconds ? 2 : 1;
+  for (int i = 0; i < rotations; i++) {
+    filter->current ^= 1;
+    memset(filter->generations[filter->current], 0, sizeof(uint64_t) * filter->capacity);
+    filter->len[filter->current] = 0;
+  }
+  filter->rotated_at = now;
+}
+
+static bool table_contains(const replay_filter *filter, const uint64_t *table, uint64_t hash) {
+  size_t slot = hash & (filter->capacity - 1);
+  while (table[slot] != 0) {
+    if (table[slot] == hash) {
+      return true;
+    }
+    slot = (slot + 1) & (filter->capacity - 1);
+  }
+  return false;
+}
@@ -0,0 +1,86 @@
+#include "sshnpd/request_queue.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+int request_queue_init(request_queue *queue, const size_t capacity[REQUEST_QUEUE_CLASSES], size_t max_total) {
+  for (int cls = 0; cls < REQUEST_QUEUE_CLASSES; cls++) {
+    queue->items[cls] = malloc(sizeof(void *) * (capacity[cls] > 0 ? capacity[cls] : 1));
+    if (queue->items[cls] == NULL) {
+      while (cls-- > 0) {
+        free(queue->items[cls]);
+      }
+      return 1;
+    }
+    queue->capacity[cls] = capacity[cls];
+    queue->head[cls] = 0;
+    queue->len[cls] = 0;
+  }
+  queue->total = 0;
+  queue->max_total = max_total;
+  return 0;
+}
+
+bool request_queue_push(request_queue *queue, int cls, void *item, void **shed, int *shed_cls) {
+  *shed = NULL;
+  if (cls < 0 || cls >= REQUEST_QUEUE_CLASSES || queue->len[cls] >= queue->capacity[cls]) {
+    return false;
+  }
+
+  if (queue->total >= queue->max_total) {
+    // Make room by dropping the newest item of the least important class below cls
+    int victim = REQUEST_QUEUE_CLASSES - 1;
+    while (victim > cls && queue->len[victim] == 0) {
+      victim--;
+    }
+    if (victim == cls) {
+      return false;
+    }
+    queue->len[victim]--;
+    *shed = queue->items[victim][(queue->head[victim] + queue->len[victim]) % queue->capacity[victim]];
+    *shed_cls = victim;
+    queue->total--;
+  }
+
+  queue->items[cls][(queue->head[cls] + queue->len[cls]) % queue->capacity[cls]] = item;
+  queue->len[cls]++;
+  queue->total++;
+  return true;
+}
+
+void *request_queue_pop(request_queue *queue, int *cls) {
+  for (int i = 0; i < REQUEST_QUEUE_CLASSES; i++) {
+    if (queue->len[i] == 0) {
+      continue;
+    }
+    void *item = queue->items[i][queue->head[i]];
+    queue->head[i] = (queue->head[i] + 1) % queue->capacity[i];
+    queue->len[i]--;
+    queue->total--;
+    if (cls != NULL) {
+      *cls = i;
+    }
+    return item;
+  }
+  return NULL;
+}
+
+void request_queue_free(request_queue *queue) {
+  for (int cls = 0; cls < REQUEST_QUEUE_CLASSES; cls++) {
+    free(queue->items[cls]);
+    queue->items[cls] = NULL;
+  }
+}
+
+int request_class_of(enum notification_key key) {
+  switch (key) {
+  case NK_SSHPUBLICKEY:
+  case NK_SSH_REQUEST:
+  case NK_NPT_REQUEST:
+    return REQUEST_CLASS_CONNECT;
+  case NK_PING:
+    return REQUEST_CLASS_PING;
+  default:
+    return REQUEST_CLASS_OTHER;
+  }
+}
@@ -0,0 +1,155 @@
+#include "sshnpd/request_trace.h"
+#include "srv/log.h"
+#include "srv/probes.h"
+#include <atlogger/atlogger.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOGGER_TAG "REQUEST TRACE"
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Notification ids come from the atServer, so escape them rather than trust them to be plain
+static void write_json_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (const unsigned char *c = (const unsigned char *)str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+      fputc(*c, out);
+    } else if (*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void write_event(FILE *out, const char *name, int64_t began_us, int64_t ended_us, int pid, uint64_t tid) {
+  fprintf(out, "{\"name\":\"%s\",\"cat\":\"sshnpd\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%llu",
+          name, (long long)began_us, (long long)(ended_us - began_us), pid, (unsigned long long)tid);
+}
+
+int request_tracer_open(request_tracer *tracer, const char *path, int sample_every) {
+  memset(tracer, 0, sizeof(request_tracer));
+  tracer->sample_every = sample_every < 1 ? 1 : sample_every;
+  tracer->pid = (int)getpid();
+  if (path == NULL) {
+    return 0;
+  }
+
+  tracer->file = fopen(path, "w");
+  if (tracer->file == NULL) {
+    int ret = errno;
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to open %s: %s\n", path, strerror(ret));
+    return ret != 0 ? ret : 1;
+  }
+  fputs("[\n", tracer->file);
+  fflush(tracer->file);
+  return 0;
+}
+
+void request_tracer_close(request_tracer *tracer) {
+  if (tracer->file == NULL) {
+    return;
+  }
+  fputs("\n]\n", tracer->file);
+  fclose(tracer->file);
+  tracer->file = NULL;
+}
+
+int64_t request_tracer_now_us(const request_tracer *tracer) { return tracer->file == NULL ? 0 : now_us(); }
+
+void request_trace_start(request_tracer *tracer, request_trace *trace, const char *name, const char *notification_id,
+                         int64_t received_us) {
+  trace->sampled = false;
+  trace->len = 0;
+  trace->current_name = NULL;
+  if (tracer->file == NULL || tracer->requests++ % (uint64_t)tracer->sample_every != 0) {
+    return;
+  }
+
+  trace->sampled = true;
+  trace->id = tracer->requests;
+  trace->name = name;
+  strncpy(trace->notification_id, notification_id != NULL ? notification_id : "", REQUEST_TRACE_ID_LEN - 1);
+  trace->notification_id[REQUEST_TRACE_ID_LEN - 1] = '\0';
+  trace->began_us = received_us != 0 ? received_us : now_us();
+  trace->ended_us = 0;
+}
+
+void request_trace_span(request_trace *trace, const char *name, int64_t began_us, int64_t ended_us) {
+  if (trace == NULL || !trace->sampled || trace->len >= REQUEST_TRACE_MAX_SPANS) {
+    return;
+  }
+  request_span *span = trace->spans + trace->len++;
+  span->name = name;
+  span->began_us = began_us;
+  span->ended_us = ended_us;
+}
+
+void request_trace_begin(request_trace *trace, const char *name) {
+  // Every stage fires the probe, whether or not the request is being traced
+  usdt_probe1(sshnpd, stage, name);
+  if (trace == NULL || !trace->sampled) {
+    return;
+  }
+  int64_t now = now_us();
+  if (trace->current_name != NULL) {
+    request_trace_span(trace, trace->current_name, trace->current_began_us, now);
+  }
+  trace->current_name = name;
+  trace->current_began_us = now;
+}
+
+void request_trace_end(request_trace *trace) {
+  if (trace == NULL || !trace->sampled || trace->current_name == NULL) {
+    return;
+  }
+  request_trace_span(trace, trace->current_name, trace->current_began_us, now_us());
+  trace->current_name = NULL;
+}
+
+void request_trace_finish(request_tracer *tracer, request_trace *trace) {
+  if (trace == NULL || !trace->sampled) {
+    return;
+  }
+  request_trace_end(trace);
+  trace->ended_us = now_us();
+  trace->sampled = false; // finished, so nothing more can be recorded or written twice
+
+  if (tracer->file == NULL) {
+    return;
+  }
+  if (request_trace_write(tracer->file, trace, tracer->pid, tracer->events == 0) != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to write a request trace\n");
+  }
+  tracer->events += trace->len + 1;
+  // Nothing may be left buffered when the next request forks, or the child would write it out a second time
+  fflush(tracer->file);
+}
+
+int request_trace_write(FILE *out, const request_trace *trace, int pid, bool first) {
+  if (!first) {
+    fputs(",\n", out);
+  }
+  write_event(out, trace->name, trace->began_us, trace->ended_us, pid, trace->id);
+  fputs(",\"args\":{\"notificationId\":", out);
+  write_json_string(out, trace->notification_id);
+  fputs("}}", out);
+
+  for (size_t i = 0; i < trace->len; i++) {
+    const request_span *span = trace->spans + i;
+    fputs(",\n", out);
+    write_event(out, span->name, span->began_us, span->ended_us, pid, trace->id);
+    fputs("}", out);
+  }
+  return ferror(out) ? 1 : 0;
+}
@@ -1,5 +1,7 @@
+#include "srv/log.h"
 #include "srv/params.h"
 #include "srv/srv.h"
+#include "srv/stats.h"
 #include <atcommons/json.h>
 #include <atclient/string_utils.h>
 #include <atlogger/atlogger.h>
@@ -12,7 +14,7 @@
 
 int run_srv_process(const char *srvd_host, uint16_t srvd_port, const char *requested_host, uint16_t requested_port,
                     bool authenticate_to_rvd, char *rvd_auth_string, bool encrypt_rvd_traffic, bool multi,
-                    unsigned char *session_aes_key_encrypted, unsigned char *session_iv_encrypted) {
+                    unsigned char *session_aes_key_encrypted, unsigned char *session_iv_encrypted, int stats_fd) {
 
   int res = 0;
   srv_params_t srv_params;
@@ -35,20 +37,26 @@ int run_srv_process(const char *srvd_host, uint16_t srvd_port, const char *reque
   srv_params.session_aes_key_string = (char *)session_aes_key_encrypted;
   srv_params.session_aes_iv_string = (char *)session_iv_encrypted;
   srv_params.multi = multi;
+  srv_params.stats_fd = stats_fd;
 
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Starting srv\n");
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "relay: %s:%d\n", srvd_host, srvd_port);
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "requested: %s:%d\n", requested_host, requested_port);
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "rv_auth: %d\n", authenticate_to_rvd);
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "rv_e2ee: %d\n", encrypt_rvd_traffic);
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "multi: %d\n", multi);
-  fflush(stdout);
+  // Nothing but this thread runs in the child yet, so every thread srv starts leaves SRV_STATS_SIGNAL to the reporter
+  srv_stats_start_reporter(stats_fd);
+
+  // The parent's log flusher doesn't survive the fork, so srv gets one of its own
+  log_sink_start();
+
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Starting srv\n");
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "relay: %s:%d\n", srvd_host, srvd_port);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "requested: %s:%d\n", requested_host, requested_port);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "rv_auth: %d\n", authenticate_to_rvd);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "rv_e2ee: %d\n", encrypt_rvd_traffic);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "multi: %d\n", multi);
 
   atlogger_set_logging_level(ATLOGGER_LOGGING_LEVEL_INFO);
   res = run_srv(&srv_params);
 
-  atlogger_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "srv exited (with code %d): %s\n", res, strerror(errno));
-  fflush(stdout);
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "srv exited (with code %d): %s\n", res, strerror(errno));
+  log_sink_stop();
 
   return res;
 }
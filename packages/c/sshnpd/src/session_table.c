@@ -0,0 +1,120 @@
+#include "sshnpd/session_table.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+static session_requester *find_requester(session_table *table, const char *atsign, time_t now);
+
+int session_table_init(session_table *table, int max_sessions, int max_per_requester, int rate_per_minute,
+                       int burst) {
+  memset(table, 0, sizeof(session_table));
+  table->max_sessions = max_sessions;
+  table->max_per_requester = max_per_requester;
+  table->rate_per_minute = rate_per_minute;
+  table->burst = burst > 0 ? burst : 1;
+  return 0;
+}
+
+enum session_admission session_table_admit(session_table *table, const char *atsign, time_t now) {
+  if (table->max_sessions > 0 && table->sessions_len >= (size_t)table->max_sessions) {
+    return SESSION_TABLE_AT_MAX;
+  }
+
+  session_requester *requester = find_requester(table, atsign, now);
+  if (requester == NULL) {
+    // Out of memory, which is exactly what these limits are meant to protect against
+    return SESSION_TABLE_AT_MAX;
+  }
+  if (table->max_per_requester > 0 && requester->live >= table->max_per_requester) {
+    return SESSION_REQUESTER_AT_MAX;
+  }
+
+  if (table->rate_per_minute > 0) {
+    if (now > requester->refilled_at) {
+      requester->tokens += (double)(now - requester->refilled_at) * table->rate_per_minute / 60;
+      if (requester->tokens > table->burst) {
+        requester->tokens = table->burst;
+      }
+      requester->refilled_at = now;
+    }
+    if (requester->tokens < 1) {
+      return SESSION_RATE_LIMITED;
+    }
+    requester->tokens -= 1;
+  }
+
+  return SESSION_ADMITTED;
+}
+
+int session_table_add(session_table *table, pid_t pid, const char *atsign) {
+  session_requester *requester = find_requester(table, atsign, time(NULL));
+  if (requester == NULL) {
+    return 1;
+  }
+
+  if (table->sessions_len == table->sessions_cap) {
+    size_t cap = table->sessions_cap == 0 ? 8 : table->sessions_cap * 2;
+    session_entry *sessions = realloc(table->sessions, sizeof(session_entry) * cap);
+    if (sessions == NULL) {
+      return 1;
+    }
+    table->sessions = sessions;
+    table->sessions_cap = cap;
+  }
+
+  table->sessions[table->sessions_len].pid = pid;
+  table->sessions[table->sessions_len].requester = (size_t)(requester - table->requesters);
+  table->sessions_len++;
+  requester->live++;
+  return 0;
+}
+
+bool session_table_remove(session_table *table, pid_t pid) {
+  for (size_t i = 0; i < table->sessions_len; i++) {
+    if (table->sessions[i].pid == pid) {
+      table->requesters[table->sessions[i].requester].live--;
+      // Order doesn't matter, fill the hole with the last entry
+      table->sessions[i] = table->sessions[--table->sessions_len];
+      return true;
+    }
+  }
+  return false;
+}
+
+void session_table_free(session_table *table) {
+  for (size_t i = 0; i < table->requesters_len; i++) {
+    free(table->requesters[i].atsign);
+  }
+  free(table->requesters);
+  free(table->sessions);
+  memset(table, 0, sizeof(session_table));
+}
+
+static session_requester *find_requester(session_table *table, const char *atsign, time_t now) {
+  // There are only ever as many requesters as managers, a linear search is plenty
+  for (size_t i = 0; i < table->requesters_len; i++) {
+    if (strcmp(table->requesters[i].atsign, atsign) == 0) {
+      return table->requesters + i;
+    }
+  }
+
+  session_requester *requesters = realloc(table->requesters, sizeof(session_requester) * (table->requesters_len + 1));
+  if (requesters == NULL) {
+    return NULL;
+  }
+  table->requesters = requesters;
+
+  session_requester *requester = table->requesters + table->requesters_len;
+  requester->atsign = strdup(atsign);
+  if (requester->atsign == NULL) {
+    return NULL;
+  }
+  requester->live = 0;
+  requester->tokens = table->burst; // a new requester starts with a full bucket
+  requester->refilled_at = now;
+  table->requesters_len++;
+  return requester;
+}
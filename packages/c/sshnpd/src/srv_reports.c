@@ -0,0 +1,82 @@
+#include "sshnpd/srv_reports.h"
+#include "sshnpd/metrics.h"
+#include "srv/log.h"
+#include "srv/stats.h"
+#include <atlogger/atlogger.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LOGGER_TAG "SRV REPORTS"
+
+// The daemon's end, which a forked srv process shouldn't keep open
+static int daemon_fd = -1;
+static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+
+static void after_fork_in_child(void) {
+  if (daemon_fd >= 0) {
+    close(daemon_fd);
+    daemon_fd = -1;
+  }
+}
+
+static void register_hooks(void) { pthread_atfork(NULL, NULL, after_fork_in_child); }
+
+int srv_reports_open(srv_reports *reports) {
+  reports->fds[0] = -1;
+  reports->fds[1] = -1;
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, reports->fds) != 0) {
+    int err = errno;
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_ERROR, "Failed to create the srv reports socket: %s\n", strerror(err));
+    return err;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(reports->fds[i], F_SETFL, fcntl(reports->fds[i], F_GETFL) | O_NONBLOCK);
+  }
+#ifdef SO_NOSIGPIPE
+  // srv can't pass MSG_NOSIGNAL everywhere
+  int one = 1;
+  setsockopt(reports->fds[1], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+  daemon_fd = reports->fds[0];
+  pthread_once(&hooks_once, register_hooks);
+  return 0;
+}
+
+int srv_reports_drain(srv_reports *reports) {
+  int count = 0;
+  srv_stats_report_t report;
+  ssize_t len;
+  while ((len = recv(reports->fds[0], &report, sizeof(report), 0)) >= 0) {
+    if ((size_t)len != sizeof(report)) {
+      lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Ignoring a %zd byte srv report\n", len);
+      continue;
+    }
+    count++;
+    srv_stats_log_report(LOGGER_TAG, &report);
+    // Only closed sessions are counted, so that on demand reports don't count the same bytes twice
+    if (report.closed) {
+      metrics_inc(METRIC_SRV_SESSIONS_CLOSED);
+      metrics_add(METRIC_SRV_BYTES_TO_RVD, report.sides[0].bytes_out);
+      metrics_add(METRIC_SRV_BYTES_TO_LOCAL, report.sides[1].bytes_out);
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to read srv reports: %s\n", strerror(errno));
+  }
+  return count;
+}
+
+void srv_reports_close(srv_reports *reports) {
+  for (int i = 0; i < 2; i++) {
+    if (reports->fds[i] >= 0) {
+      close(reports->fds[i]);
+      reports->fds[i] = -1;
+    }
+  }
+  daemon_fd = -1;
+}
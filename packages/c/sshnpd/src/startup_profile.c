@@ -0,0 +1,96 @@
+#include "sshnpd/startup_profile.h"
+#include "srv/log.h"
+#include <atlogger/atlogger.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LOGGER_TAG "STARTUP PROFILE"
+
+static double to_ms(int64_t us) { return (double)us / 1000.0; }
+
+int64_t startup_profile_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void startup_profile_init(startup_profile *profile, int64_t now_us) {
+  memset(profile, 0, sizeof(startup_profile));
+  profile->began_us = now_us;
+}
+
+void startup_profile_begin(startup_profile *profile, const char *name, int64_t now_us) {
+  startup_profile_end(profile, now_us);
+  profile->current_name = name;
+  profile->current_began_us = now_us;
+}
+
+void startup_profile_end(startup_profile *profile, int64_t now_us) {
+  if (profile->current_name == NULL) {
+    return;
+  }
+  startup_profile_add(profile, profile->current_name, profile->current_began_us, now_us);
+  profile->current_name = NULL;
+}
+
+void startup_profile_add(startup_profile *profile, const char *name, int64_t began_us, int64_t ended_us) {
+  if (profile->len >= STARTUP_PROFILE_MAX_PHASES) {
+    return;
+  }
+  startup_phase *phase = profile->phases + profile->len++;
+  phase->name = name;
+  phase->began_us = began_us;
+  phase->ended_us = ended_us;
+}
+
+void startup_profile_finish(startup_profile *profile, int64_t now_us) {
+  startup_profile_end(profile, now_us);
+  profile->ended_us = now_us;
+}
+
+int startup_profile_write(const startup_profile *profile, FILE *out, const char *version, time_t started_at) {
+  fprintf(out, "{\"version\":\"%s\",\"startedAt\":%lld,\"totalMs\":%.3f,\"phases\":[", version,
+          (long long)started_at, to_ms(profile->ended_us - profile->began_us));
+  for (size_t i = 0; i < profile->len; i++) {
+    const startup_phase *phase = profile->phases + i;
+    fprintf(out, "%s{\"name\":\"%s\",\"startMs\":%.3f,\"durationMs\":%.3f}", i == 0 ? "" : ",", phase->name,
+            to_ms(phase->began_us - profile->began_us), to_ms(phase->ended_us - phase->began_us));
+  }
+  fprintf(out, "]}\n");
+  return ferror(out) ? 1 : 0;
+}
+
+int startup_profile_append(const startup_profile *profile, const char *path, const char *version, time_t started_at) {
+  if (strcmp(path, "-") == 0) {
+    return startup_profile_write(profile, stderr, version, started_at);
+  }
+
+  FILE *file = fopen(path, "a");
+  if (file == NULL) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  int ret = startup_profile_write(profile, file, version, started_at);
+  if (fclose(file) != 0) {
+    ret = 1;
+  }
+  if (ret != 0) {
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_WARN, "Failed to write the startup profile to %s\n", path);
+  }
+  return ret;
+}
+
+void startup_profile_log(const startup_profile *profile) {
+  if (!log_enabled(ATLOGGER_LOGGING_LEVEL_DEBUG)) {
+    return;
+  }
+  for (size_t i = 0; i < profile->len; i++) {
+    const startup_phase *phase = profile->phases + i;
+    lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "%-22s +%9.3f ms %9.3f ms\n", phase->name,
+             to_ms(phase->began_us - profile->began_us), to_ms(phase->ended_us - phase->began_us));
+  }
+  lazy_log(LOGGER_TAG, ATLOGGER_LOGGING_LEVEL_DEBUG, "Ready after %.3f ms\n",
+           to_ms(profile->ended_us - profile->began_us));
+}
@@ -0,0 +1,101 @@
+#include "sshnpd/address_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int round_trip_test();
+int missing_test();
+int malformed_test();
+
+static char storage_path[] = "/tmp/test_address_cache_XXXXXX";
+
+int main() {
+  if (mkdtemp(storage_path) == NULL) {
+    printf("Failed to create a temporary directory\n");
+    return 1;
+  }
+
+  int ret = 0;
+
+  if (round_trip_test()) {
+    printf("round trip test failed\n");
+    ret++;
+  }
+  if (missing_test()) {
+    printf("missing test failed\n");
+    ret++;
+  }
+  if (malformed_test()) {
+    printf("malformed test failed\n");
+    ret++;
+  }
+
+  atserver_address_cache_remove(storage_path, "@alice");
+  rmdir(storage_path);
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+int round_trip_test() {
+  if (atserver_address_cache_store(storage_path, "@alice", "abc123.swarm0001.atsign.zone", 6464, 1000) != 0) {
+    return 1;
+  }
+
+  char *host = NULL;
+  int port = 0;
+  time_t stored_at = 0;
+  if (atserver_address_cache_load(storage_path, "@alice", &host, &port, &stored_at) != 0) {
+    return 1;
+  }
+  int ret = strcmp(host, "abc123.swarm0001.atsign.zone") != 0 || port != 6464 || stored_at != 1000;
+  free(host);
+
+  // Storing again replaces the old address
+  if (atserver_address_cache_store(storage_path, "@alice", "def456.swarm0002.atsign.zone", 1234, 2000) != 0 ||
+      atserver_address_cache_load(storage_path, "@alice", &host, &port, &stored_at) != 0) {
+    return 1;
+  }
+  ret |= strcmp(host, "def456.swarm0002.atsign.zone") != 0 || port != 1234 || stored_at != 2000;
+  free(host);
+  return ret;
+}
+
+int missing_test() {
+  char *host = NULL;
+  int port = 0;
+  time_t stored_at = 0;
+  // Each atsign has its own cache
+  if (atserver_address_cache_load(storage_path, "@bob", &host, &port, &stored_at) == 0) {
+    free(host);
+    return 1;
+  }
+
+  atserver_address_cache_store(storage_path, "@alice", "abc123.swarm0001.atsign.zone", 6464, 1000);
+  atserver_address_cache_remove(storage_path, "@alice");
+  if (atserver_address_cache_load(storage_path, "@alice", &host, &port, &stored_at) == 0) {
+    free(host);
+    return 1;
+  }
+  return 0;
+}
+
+int malformed_test() {
+  char path[sizeof(storage_path) + 32];
+  snprintf(path, sizeof(path), "%s/@alice.atserver_address", storage_path);
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    return 1;
+  }
+  fputs("abc123.swarm0001.atsign.zone not-a-port\n", file);
+  fclose(file);
+
+  char *host = NULL;
+  int port = 0;
+  time_t stored_at = 0;
+  if (atserver_address_cache_load(storage_path, "@alice", &host, &port, &stored_at) == 0) {
+    free(host);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,203 @@
+#include "sshnpd/file_utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define KEY_A "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIA1 alice@laptop"
+#define KEY_B "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIB2 bob@laptop\n"
+#define KEY_C "ecdsa-sha2-nistp256 AAAAE2VjZHNhLXNoYTItbmlzdHAyNTYC3 carol@laptop"
+
+int duplicate_test();
+int batch_test();
+int external_change_test();
+int read_only_test();
+
+static char filename[] = "/tmp/test_authorized_keys_XXXXXX";
+
+static int write_file(const char *contents) {
+  FILE *file = fopen(filename, "w");
+  if (file == NULL) {
+    return 1;
+  }
+  fputs(contents, file);
+  return fclose(file);
+}
+
+static char *read_file() {
+  static char buf[4096];
+  FILE *file = fopen(filename, "r");
+  if (file == NULL) {
+    return "";
+  }
+  size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+  buf[len] = '\0';
+  fclose(file);
+  return buf;
+}
+
+int main() {
+  int fd = mkstemp(filename);
+  if (fd < 0) {
+    printf("Failed to create a temporary file\n");
+    return 1;
+  }
+  close(fd);
+
+  int ret = 0;
+
+  if (duplicate_test()) {
+    printf("duplicate test failed\n");
+    ret++;
+  }
+  if (batch_test()) {
+    printf("batch test failed\n");
+    ret++;
+  }
+  if (external_change_test()) {
+    printf("external change test failed\n");
+    ret++;
+  }
+  if (read_only_test()) {
+    printf("read only test failed\n");
+    ret++;
+  }
+
+  unlink(filename);
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+int duplicate_test() {
+  // The same key material with options in front, or a different comment, is still the same key
+  if (write_file("# a comment\n\ncommand=\"echo hi there\",no-pty " KEY_A "\n" KEY_B)) {
+    return 1;
+  }
+  authorized_keys keys;
+  if (authorized_keys_init(&keys, filename) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  bool added = true;
+  if (keys.len != 2 || authorized_keys_add(&keys, "", KEY_A, &added) != 0 || added) {
+    ret = 1;
+  }
+  if (authorized_keys_add(&keys, "", "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIB2 other comment", &added) != 0 || added) {
+    ret = 1;
+  }
+  if (authorized_keys_add(&keys, "", "not a key", &added) == 0 || added) {
+    ret = 1;
+  }
+
+  authorized_keys_free(&keys);
+  return ret;
+}
+
+int batch_test() {
+  // The last line has no newline, so the first append has to add one
+  if (write_file(KEY_A)) {
+    return 1;
+  }
+  authorized_keys keys;
+  if (authorized_keys_init(&keys, filename) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  bool added = false;
+  if (authorized_keys_add(&keys, "", KEY_B, &added) != 0 || !added) {
+    ret = 1;
+  }
+  if (authorized_keys_add(&keys, "no-pty", KEY_C, &added) != 0 || !added) {
+    ret = 1;
+  }
+  // Queued keys count as duplicates too
+  if (authorized_keys_add(&keys, "", KEY_C, &added) != 0 || added) {
+    ret = 1;
+  }
+  // Nothing is written until the batch is flushed
+  if (strcmp(read_file(), KEY_A) != 0) {
+    ret = 1;
+  }
+  if (authorized_keys_flush(&keys) != 0 || keys.pending_keys != 0) {
+    ret = 1;
+  }
+  if (strcmp(read_file(), KEY_A "\n" KEY_B "no-pty " KEY_C "\n") != 0) {
+    ret = 1;
+  }
+
+  authorized_keys_free(&keys);
+  return ret;
+}
+
+int external_change_test() {
+  if (write_file(KEY_A "\n")) {
+    return 1;
+  }
+  authorized_keys keys;
+  if (authorized_keys_init(&keys, filename) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  bool added = false;
+  if (authorized_keys_add(&keys, "", KEY_B, &added) != 0 || !added) {
+    ret = 1;
+  }
+  // Someone else replaces the file while B is queued, and happens to add B themselves
+  char replacement[sizeof(filename) + 4];
+  sprintf(replacement, "%s.new", filename);
+  FILE *file = fopen(replacement, "w");
+  if (file == NULL) {
+    authorized_keys_free(&keys);
+    return 1;
+  }
+  fputs(KEY_C "\n" KEY_B, file);
+  fclose(file);
+  if (rename(replacement, filename) != 0) {
+    ret = 1;
+  }
+
+  // A is gone now, so it can be added again, and B isn't written twice
+  if (authorized_keys_add(&keys, "", KEY_A, &added) != 0 || !added || authorized_keys_flush(&keys) != 0) {
+    ret = 1;
+  }
+  if (strcmp(read_file(), KEY_C "\n" KEY_B KEY_A "\n") != 0) {
+    ret = 1;
+  }
+
+  authorized_keys_free(&keys);
+  return ret;
+}
+
+int read_only_test() {
+  if (geteuid() == 0) {
+    // root can open it for writing anyway
+    return 0;
+  }
+  if (write_file(KEY_A "\n") || chmod(filename, 0400) != 0) {
+    return 1;
+  }
+  authorized_keys keys;
+  if (authorized_keys_init(&keys, filename) != 0) {
+    chmod(filename, 0600);
+    return 1;
+  }
+
+  // Keys can still be looked up, but new ones are refused rather than queued
+  int ret = 0;
+  bool added = true;
+  if (!keys.read_only || authorized_keys_add(&keys, "", KEY_A, &added) != 0 || added) {
+    ret = 1;
+  }
+  if (authorized_keys_add(&keys, "", KEY_B, &added) != EACCES || added || keys.pending_keys != 0) {
+    ret = 1;
+  }
+
+  authorized_keys_free(&keys);
+  chmod(filename, 0600);
+  return ret;
+}
@@ -0,0 +1,95 @@
+#include "sshnpd/backoff.h"
+#include <stdint.h>
+#include <stdio.h>
+
+int ceiling_test();
+int cap_test();
+int reset_test();
+int jitter_test();
+
+int main() {
+  int ret = 0;
+
+  if (ceiling_test()) {
+    printf("ceiling test failed\n");
+    ret++;
+  }
+  if (cap_test()) {
+    printf("cap test failed\n");
+    ret++;
+  }
+  if (reset_test()) {
+    printf("reset test failed\n");
+    ret++;
+  }
+  if (jitter_test()) {
+    printf("jitter test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+// every delay stays between 0 and base * 2^attempt
+int ceiling_test() {
+  backoff b;
+  backoff_init(&b, 100, 100000, 1);
+  int64_t ceiling = 100;
+  for (int i = 0; i < 8; i++) {
+    int64_t delay = backoff_next_ms(&b);
+    if (delay < 0 || delay > ceiling) {
+      return 1;
+    }
+    ceiling *= 2;
+  }
+  return 0;
+}
+
+// the ceiling never goes past max_ms, however many failures there are
+int cap_test() {
+  backoff b;
+  backoff_init(&b, 100, 5000, 2);
+  for (int i = 0; i < 100; i++) {
+    int64_t delay = backoff_next_ms(&b);
+    if (delay < 0 || delay > 5000) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// after a reset the next delay is back within base_ms
+int reset_test() {
+  backoff b;
+  backoff_init(&b, 100, 100000, 3);
+  for (int i = 0; i < 10; i++) {
+    backoff_next_ms(&b);
+  }
+  backoff_reset(&b);
+  if (b.attempts != 0) {
+    return 1;
+  }
+  int64_t delay = backoff_next_ms(&b);
+  if (delay < 0 || delay > 100) {
+    return 1;
+  }
+  return 0;
+}
+
+// with a large ceiling, delays are spread out rather than all the same
+int jitter_test() {
+  backoff b;
+  backoff_init(&b, 60000, 60000, 4);
+  int64_t min = 60000, max = 0;
+  for (int i = 0; i < 200; i++) {
+    int64_t delay = backoff_next_ms(&b);
+    if (delay < min) {
+      min = delay;
+    }
+    if (delay > max) {
+      max = delay;
+    }
+  }
+  return max - min < 30000;
+}
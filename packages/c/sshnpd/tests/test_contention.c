@@ -0,0 +1,106 @@
+#include "sshnpd/contention.h"
+#include <stdio.h>
+#include <string.h>
+
+int site_test();
+int overflow_test();
+int acquire_release_test();
+int reset_test();
+
+int main() {
+  int ret = 0;
+
+  if (site_test()) {
+    printf("site test failed\n");
+    ret++;
+  }
+  if (overflow_test()) {
+    printf("overflow test failed\n");
+    ret++;
+  }
+  if (acquire_release_test()) {
+    printf("acquire release test failed\n");
+    ret++;
+  }
+  if (reset_test()) {
+    printf("reset test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+// the same name always maps to the same slot, even from a different copy of the string
+int site_test() {
+  contention_stats stats;
+  contention_stats_init(&stats, 1000);
+  char copy[] = "notify_queue";
+  size_t a = contention_stats_site(&stats, "notify_queue");
+  size_t b = contention_stats_site(&stats, "refresh_device_entry");
+  if (a == b || contention_stats_site(&stats, copy) != a || stats.len != 2) {
+    return 1;
+  }
+  return 0;
+}
+
+// sites past the last slot are counted together rather than dropped
+int overflow_test() {
+  contention_stats stats;
+  contention_stats_init(&stats, 1000);
+  const char *names[] = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j"};
+  size_t last = 0;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    last = contention_stats_site(&stats, names[i]);
+  }
+  if (stats.len != CONTENTION_MAX_SITES || last != CONTENTION_MAX_SITES - 1) {
+    return 1;
+  }
+  if (strcmp(stats.sites[last].name, "(other)") != 0 || contention_stats_site(&stats, "a") != 0) {
+    return 1;
+  }
+  return 0;
+}
+
+int acquire_release_test() {
+  contention_stats stats;
+  contention_stats_init(&stats, 1000);
+  size_t site = contention_stats_site(&stats, "verify_envelope_signature");
+
+  contention_stats_acquired(&stats, site, 0, false);
+  if (contention_stats_released(&stats, site, 400)) {
+    return 1;
+  }
+  contention_stats_acquired(&stats, site, 250, true);
+  if (!contention_stats_released(&stats, site, 1500)) {
+    return 1;
+  }
+
+  contention_site *s = stats.sites + site;
+  if (s->acquisitions != 2 || s->contended != 1 || s->long_holds != 1) {
+    return 1;
+  }
+  if (s->wait_us != 250 || s->max_wait_us != 250 || s->hold_us != 1900 || s->max_hold_us != 1500) {
+    return 1;
+  }
+  return 0;
+}
+
+// reset clears the numbers but keeps the sites, so call sites can hold on to their index
+int reset_test() {
+  contention_stats stats;
+  contention_stats_init(&stats, 1000);
+  size_t site = contention_stats_site(&stats, "notify_queue");
+  contention_stats_acquired(&stats, site, 10, true);
+  contention_stats_released(&stats, site, 5000);
+  contention_stats_reset(&stats);
+
+  contention_site *s = stats.sites + site;
+  if (stats.len != 1 || strcmp(s->name, "notify_queue") != 0 || stats.long_hold_us != 1000) {
+    return 1;
+  }
+  if (s->acquisitions != 0 || s->contended != 0 || s->hold_us != 0 || s->max_hold_us != 0 || s->long_holds != 0) {
+    return 1;
+  }
+  return 0;
+}
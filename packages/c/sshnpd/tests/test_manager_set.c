@@ -0,0 +1,143 @@
+#include "sshnpd/manager_set.h"
+#include <stdio.h>
+
+int single_manager_test();
+int many_managers_test();
+int duplicate_manager_test();
+int empty_set_test();
+int normalize_test();
+
+int main() {
+  int ret = 0;
+
+  if (single_manager_test()) {
+    printf("single manager test failed\n");
+    ret++;
+  }
+  if (many_managers_test()) {
+    printf("many managers test failed\n");
+    ret++;
+  }
+  if (duplicate_manager_test()) {
+    printf("duplicate manager test failed\n");
+    ret++;
+  }
+  if (empty_set_test()) {
+    printf("empty set test failed\n");
+    ret++;
+  }
+  if (normalize_test()) {
+    printf("normalize test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+int single_manager_test() {
+  char *managers[] = {"@alice"};
+  manager_set set;
+  if (manager_set_init(&set, managers, 1) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (!manager_set_contains(&set, "@alice")) {
+    ret = 1;
+  }
+  if (manager_set_contains(&set, "@alic") || manager_set_contains(&set, "@alice2") ||
+      manager_set_contains(&set, "alice") || manager_set_contains(&set, "")) {
+    ret = 1;
+  }
+
+  manager_set_free(&set);
+  return ret;
+}
+
+int many_managers_test() {
+  char names[40][16];
+  char *managers[40];
+  for (int i = 0; i < 40; i++) {
+    snprintf(names[i], sizeof(names[i]), "@manager%d", i);
+    managers[i] = names[i];
+  }
+
+  manager_set set;
+  if (manager_set_init(&set, managers, 40) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (set.len != 40) {
+    ret = 1;
+  }
+  for (int i = 0; i < 40; i++) {
+    if (!manager_set_contains(&set, names[i])) {
+      ret = 1;
+    }
+  }
+  if (manager_set_contains(&set, "@manager40") || manager_set_contains(&set, "@manager")) {
+    ret = 1;
+  }
+
+  manager_set_free(&set);
+  return ret;
+}
+
+int duplicate_manager_test() {
+  char *managers[] = {"@alice", "@bob", "@alice"};
+  manager_set set;
+  if (manager_set_init(&set, managers, 3) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (set.len != 2 || !manager_set_contains(&set, "@alice") || !manager_set_contains(&set, "@bob")) {
+    ret = 1;
+  }
+
+  manager_set_free(&set);
+  return ret;
+}
+
+int empty_set_test() {
+  manager_set set;
+  if (manager_set_init(&set, NULL, 0) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (manager_set_contains(&set, "@alice") || manager_set_contains(&set, NULL)) {
+    ret = 1;
+  }
+
+  manager_set_free(&set);
+  return ret;
+}
+
+// --manager alice and --manager @Alice both allow notifications from @alice, atSigns are case insensitive
+int normalize_test() {
+  char *managers[] = {"alice", "@Bob", "@bob", "CAROL"};
+  manager_set set;
+  if (manager_set_init(&set, managers, 4) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (set.len != 3) {
+    ret = 1;
+  }
+  if (!manager_set_contains(&set, "@alice") || !manager_set_contains(&set, "@ALICE") ||
+      !manager_set_contains(&set, "@bob") || !manager_set_contains(&set, "@Bob") ||
+      !manager_set_contains(&set, "@carol")) {
+    ret = 1;
+  }
+  if (manager_set_contains(&set, "alice") || manager_set_contains(&set, "@alice2") ||
+      manager_set_contains(&set, "@dave")) {
+    ret = 1;
+  }
+
+  manager_set_free(&set);
+  return ret;
+}
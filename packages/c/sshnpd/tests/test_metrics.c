@@ -0,0 +1,224 @@
+#include "sshnpd/metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int write_test();
+int histogram_test();
+int server_test();
+
+int main() {
+  int ret = 0;
+
+  if (write_test()) {
+    printf("write test failed\n");
+    ret++;
+  }
+  if (histogram_test()) {
+    printf("histogram test failed\n");
+    ret++;
+  }
+  if (server_test()) {
+    printf("server test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+// The caller frees the returned text
+static char *render() {
+  char *text = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&text, &len);
+  if (out == NULL) {
+    return NULL;
+  }
+  if (metrics_write(out) != 0) {
+    fclose(out);
+    free(text);
+    return NULL;
+  }
+  fclose(out);
+  return text;
+}
+
+static int expect(const char *text, const char *line) {
+  if (strstr(text, line) == NULL) {
+    printf("missing: %s", line);
+    return 1;
+  }
+  return 0;
+}
+
+int write_test() {
+  metrics_inc(METRIC_NOTIFICATIONS_PING);
+  metrics_inc(METRIC_NOTIFICATIONS_PING);
+  metrics_add(METRIC_REQUESTS_REJECTED_STALE, 5);
+  metrics_set(METRIC_LIVE_SESSIONS, 3);
+
+  char *text = render();
+  if (text == NULL) {
+    return 1;
+  }
+  int ret = 0;
+  ret += expect(text, "# HELP sshnpd_notifications_total Notifications received from managers, by type\n"
+                      "# TYPE sshnpd_notifications_total counter\n"
+                      "sshnpd_notifications_total{type=\"sshpublickey\"} 0\n"
+                      "sshnpd_notifications_total{type=\"ping\"} 2\n");
+  ret += expect(text, "sshnpd_requests_rejected_total{reason=\"stale\"} 5\n");
+  ret += expect(text, "# TYPE sshnpd_live_sessions gauge\nsshnpd_live_sessions 3\n");
+  ret += expect(text, "# TYPE sshnpd_handler_seconds histogram\n");
+  // Each family's HELP is only written once
+  const char *help = strstr(text, "# HELP sshnpd_requests_rejected_total");
+  if (help == NULL || strstr(help + 1, "# HELP sshnpd_requests_rejected_total") != NULL) {
+    ret++;
+  }
+  free(text);
+  return ret;
+}
+
+int histogram_test() {
+  metrics_observe_us(METRIC_HANDLER_NPT_REQUEST, 500);      // le 0.001
+  metrics_observe_us(METRIC_HANDLER_NPT_REQUEST, 1000);     // le 0.001, bounds are inclusive
+  metrics_observe_us(METRIC_HANDLER_NPT_REQUEST, 70000);    // le 0.1
+  metrics_observe_us(METRIC_HANDLER_NPT_REQUEST, 60000000); // +Inf
+  metrics_observe_us(METRIC_HANDLER_NPT_REQUEST, -5);       // counted as 0
+
+  char *text = render();
+  if (text == NULL) {
+    return 1;
+  }
+  int ret = 0;
+  ret += expect(text, "sshnpd_handler_seconds_bucket{type=\"npt_request\",le=\"0.001\"} 3\n");
+  ret += expect(text, "sshnpd_handler_seconds_bucket{type=\"npt_request\",le=\"0.05\"} 3\n");
+  ret += expect(text, "sshnpd_handler_seconds_bucket{type=\"npt_request\",le=\"0.1\"} 4\n");
+  ret += expect(text, "sshnpd_handler_seconds_bucket{type=\"npt_request\",le=\"10\"} 4\n");
+  ret += expect(text, "sshnpd_handler_seconds_bucket{type=\"npt_request\",le=\"+Inf\"} 5\n");
+  ret += expect(text, "sshnpd_handler_seconds_sum{type=\"npt_request\"} 60.071500\n");
+  ret += expect(text, "sshnpd_handler_seconds_count{type=\"npt_request\"} 5\n");
+  ret += expect(text, "sshnpd_pool_wait_seconds_bucket{le=\"+Inf\"} 0\n");
+  free(text);
+  return ret;
+}
+
+// Connects to the metrics socket, sends request (if any) and returns everything it sends back
+static char *fetch(const char *path, const char *request) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if (request != NULL && write(fd, request, strlen(request)) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t cap = 65536;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  ssize_t n;
+  while (buf != NULL && len < cap - 1 && (n = read(fd, buf + len, cap - 1 - len)) > 0) {
+    len += (size_t)n;
+  }
+  close(fd);
+  if (buf != NULL) {
+    buf[len] = '\0';
+  }
+  return buf;
+}
+
+int server_test() {
+  char dir[] = "/tmp/test_metrics_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    return 1;
+  }
+  char path[64];
+  snprintf(path, sizeof(path), "%s/metrics.sock", dir);
+
+  metrics_server server;
+  int ret = 1;
+  if (metrics_server_start(&server, path, 0) != 0) {
+    goto exit;
+  }
+
+  // A second daemon can't take over a socket which is still being listened on
+  metrics_server other;
+  bool took_over = metrics_server_start(&other, path, 0) == 0;
+  if (took_over) {
+    metrics_server_stop(&other);
+  }
+
+  char *http = fetch(path, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  char *plain = fetch(path, "metrics\n");
+  metrics_server_stop(&server);
+
+  ret = 0;
+  if (took_over) {
+    printf("took over a live socket\n");
+    ret++;
+  }
+  if (http == NULL || strncmp(http, "HTTP/1.0 200 OK\r\n", 17) != 0 || strstr(http, "\r\n\r\n# HELP") == NULL) {
+    printf("http response: %.80s\n", http != NULL ? http : "(none)");
+    ret++;
+  }
+  if (plain == NULL || strncmp(plain, "# HELP", 6) != 0) {
+    printf("plain response: %.80s\n", plain != NULL ? plain : "(none)");
+    ret++;
+  }
+  // The socket is removed once the server stops
+  if (access(path, F_OK) == 0) {
+    printf("socket left behind\n");
+    ret++;
+  }
+  free(http);
+  free(plain);
+
+  // Anything but a stale socket at the path is left alone
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    ret++;
+    goto exit;
+  }
+  fclose(file);
+  if (metrics_server_start(&server, path, 0) == 0) {
+    printf("replaced a regular file\n");
+    metrics_server_stop(&server);
+    ret++;
+  } else if (access(path, F_OK) != 0) {
+    printf("removed a regular file\n");
+    ret++;
+  }
+
+  // A socket nobody listens on any more is replaced
+  unlink(path);
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strcpy(addr.sun_path, path);
+  int stale = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (stale < 0 || bind(stale, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    ret++;
+    goto exit;
+  }
+  close(stale);
+  if (metrics_server_start(&server, path, 0) != 0) {
+    printf("didn't replace a stale socket\n");
+    ret++;
+  } else {
+    metrics_server_stop(&server);
+  }
+
+exit:
+  unlink(path);
+  rmdir(dir);
+  return ret;
+}
@@ -1,11 +1,17 @@
 #include "sshnpd/permitopen.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 int star_star_test();
 int localhost_star_test();
 int star_port_test();
 int localhost_port_test();
 int list_test();
+int index_list_test();
+int index_range_test();
+int index_wildcard_test();
+int index_cidr_test();
 
 int main() {
   int ret = 0;
@@ -31,6 +37,22 @@ int main() {
     printf("localhost:22,foo.bar.com:3389 test failed\n");
     ret++;
   }
+  if (index_list_test()) {
+    printf("index localhost:22,foo.bar.com:3389 test failed\n");
+    ret++;
+  }
+  if (index_range_test()) {
+    printf("index port range test failed\n");
+    ret++;
+  }
+  if (index_wildcard_test()) {
+    printf("index wildcard host test failed\n");
+    ret++;
+  }
+  if (index_cidr_test()) {
+    printf("index CIDR test failed\n");
+    ret++;
+  }
 
   printf("Tests failed: %d\n", ret);
   return ret;
@@ -221,3 +243,144 @@ int list_test() {
 
   return 0;
 }
+
+int index_list_test() {
+  permitopen_index index;
+  char *hosts[] = {"localhost", "foo.bar.com"};
+  uint16_t ports[] = {22, 3389};
+  if (permitopen_index_init(&index, hosts, ports, NULL, 2) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (!permitopen_index_allows(&index, "localhost", 22) ||
+      !permitopen_index_allows(&index, "foo.bar.com", 3389)) {
+    ret = 1;
+  }
+  // Hostnames are case insensitive
+  if (!permitopen_index_allows(&index, "Foo.Bar.COM", 3389)) {
+    ret = 1;
+  }
+  if (permitopen_index_allows(&index, "localhost", 3389) || permitopen_index_allows(&index, "foo.bar.com", 22) ||
+      permitopen_index_allows(&index, "123.123.123.123", 22) ||
+      permitopen_index_allows(&index, "bar.com", 3389)) {
+    ret = 1;
+  }
+
+  permitopen_index_free(&index);
+  return ret;
+}
+
+int index_range_test() {
+  char **hosts = NULL;
+  uint16_t *ports = NULL;
+  uint16_t *port_ends = NULL;
+  size_t len;
+  char *input = strdup("localhost:8000-8100,localhost:8050-8200,localhost:22,*:53");
+  if (parse_permitopen_ranges(input, &hosts, &ports, &port_ends, &len, false) != 0 || len != 4 || ports[0] != 8000 ||
+      port_ends[0] != 8100 || ports[2] != 22 || port_ends[2] != 22) {
+    free(input);
+    return 1;
+  }
+
+  int ret = 0;
+  permitopen_index index;
+  if (permitopen_index_init(&index, hosts, ports, port_ends, len) != 0) {
+    free(input);
+    return 1;
+  }
+  // Overlapping ranges are merged
+  if (!permitopen_index_allows(&index, "localhost", 8000) ||
+      !permitopen_index_allows(&index, "localhost", 8150) ||
+      !permitopen_index_allows(&index, "localhost", 8200) || !permitopen_index_allows(&index, "localhost", 22)) {
+    ret = 1;
+  }
+  if (permitopen_index_allows(&index, "localhost", 7999) || permitopen_index_allows(&index, "localhost", 8201) ||
+      permitopen_index_allows(&index, "localhost", 23)) {
+    ret = 1;
+  }
+  if (!permitopen_index_allows(&index, "foo.bar.com", 53) || permitopen_index_allows(&index, "foo.bar.com", 22)) {
+    ret = 1;
+  }
+  permitopen_index_free(&index);
+  free(hosts);
+  free(ports);
+  free(port_ends);
+
+  // Ranges must be ascending, and parse_permitopen doesn't accept them at all
+  char *backwards = strdup("localhost:8100-8000");
+  if (parse_permitopen_ranges(backwards, &hosts, &ports, &port_ends, &len, false) == 0) {
+    ret = 1;
+  }
+  free(backwards);
+  char *range = strdup("localhost:8000-8100");
+  char **hosts2 = NULL;
+  uint16_t *ports2 = NULL;
+  if (parse_permitopen(range, &hosts2, &ports2, &len, false) == 0) {
+    ret = 1;
+  }
+  free(range);
+  free(input);
+  return ret;
+}
+
+int index_wildcard_test() {
+  permitopen_index index;
+  char *hosts[] = {"*.example.com", "exact.example.org"};
+  uint16_t ports[] = {0, 443};
+  if (permitopen_index_init(&index, hosts, ports, NULL, 2) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (!permitopen_index_allows(&index, "a.example.com", 22) ||
+      !permitopen_index_allows(&index, "b.a.example.com", 8080)) {
+    ret = 1;
+  }
+  // The wildcard only covers subdomains
+  if (permitopen_index_allows(&index, "example.com", 22) ||
+      permitopen_index_allows(&index, "a.example.com.evil.net", 22) ||
+      permitopen_index_allows(&index, "notexample.com", 22)) {
+    ret = 1;
+  }
+  if (!permitopen_index_allows(&index, "exact.example.org", 443) ||
+      permitopen_index_allows(&index, "sub.exact.example.org", 443)) {
+    ret = 1;
+  }
+
+  permitopen_index_free(&index);
+  return ret;
+}
+
+int index_cidr_test() {
+  permitopen_index index;
+  char *hosts[] = {"10.0.0.0/8", "192.168.1.0/24", "192.168.1.7/32"};
+  uint16_t ports[] = {22, 0, 22};
+  uint16_t port_ends[] = {22, 0, 25};
+  if (permitopen_index_init(&index, hosts, ports, port_ends, 3) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (!permitopen_index_allows(&index, "10.1.2.3", 22) ||
+      !permitopen_index_allows(&index, "192.168.1.200", 3389) ||
+      !permitopen_index_allows(&index, "192.168.1.7", 24)) {
+    ret = 1;
+  }
+  if (permitopen_index_allows(&index, "10.1.2.3", 3389) || permitopen_index_allows(&index, "11.1.2.3", 22) ||
+      permitopen_index_allows(&index, "192.168.2.1", 22)) {
+    ret = 1;
+  }
+  // Hostnames aren't resolved to match CIDR rules, srv would resolve them again itself
+  if (permitopen_index_allows(&index, "localhost", 22)) {
+    ret = 1;
+  }
+  permitopen_index_free(&index);
+
+  char *bad_hosts[] = {"10.0.0.0/33"};
+  if (permitopen_index_init(&index, bad_hosts, ports, NULL, 1) == 0) {
+    permitopen_index_free(&index);
+    ret = 1;
+  }
+  return ret;
+}
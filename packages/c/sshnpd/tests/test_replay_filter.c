@@ -0,0 +1,104 @@
+#include "sshnpd/replay_filter.h"
+#include <stdio.h>
+#include <time.h>
+
+int seen_test();
+int expiry_test();
+int bounded_test();
+
+int main() {
+  int ret = 0;
+
+  if (seen_test()) {
+    printf("seen test failed\n");
+    ret++;
+  }
+  if (expiry_test()) {
+    printf("expiry test failed\n");
+    ret++;
+  }
+  if (bounded_test()) {
+    printf("bounded test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+int seen_test() {
+  replay_filter filter;
+  if (replay_filter_init(&filter, 16, 60, 1000) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (replay_filter_contains(&filter, "session-a", 1000)) {
+    ret = 1;
+  }
+  replay_filter_insert(&filter, "session-a", 1000);
+  if (!replay_filter_contains(&filter, "session-a", 1001)) {
+    ret = 1;
+  }
+  if (replay_filter_contains(&filter, "session-b", 1001)) {
+    ret = 1;
+  }
+
+  replay_filter_free(&filter);
+  return ret;
+}
+
+// an id is remembered for at least one window, and forgotten after two
+int expiry_test() {
+  replay_filter filter;
+  if (replay_filter_init(&filter, 16, 60, 1000) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  replay_filter_insert(&filter, "session-a", 1030);
+  if (!replay_filter_contains(&filter, "session-a", 1089)) {
+    ret = 1;
+  }
+  if (!replay_filter_contains(&filter, "session-a", 1100)) {
+    ret = 1; // rotated once, still in the previous generation
+  }
+  if (replay_filter_contains(&filter, "session-a", 1161)) {
+    ret = 1;
+  }
+
+  replay_filter_insert(&filter, "session-b", 2000);
+  if (replay_filter_contains(&filter, "session-b", 2500)) {
+    ret = 1; // many windows later
+  }
+
+  replay_filter_free(&filter);
+  return ret;
+}
+
+// inserting far more ids than the capacity keeps working, and keeps the most recent ones
+int bounded_test() {
+  replay_filter filter;
+  if (replay_filter_init(&filter, 16, 60, 1000) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  char id[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(id, sizeof(id), "session-%d", i);
+    replay_filter_insert(&filter, id, 1000);
+  }
+  if (filter.len[0] * 2 > filter.capacity || filter.len[1] * 2 > filter.capacity) {
+    ret = 1;
+  }
+  for (int i = 990; i < 1000; i++) {
+    snprintf(id, sizeof(id), "session-%d", i);
+    if (!replay_filter_contains(&filter, id, 1000)) {
+      ret = 1;
+    }
+  }
+
+  replay_filter_free(&filter);
+  return ret;
+}
@@ -0,0 +1,191 @@
+#include "sshnpd/request_queue.h"
+#include <stdio.h>
+
+int priority_order_test();
+int class_capacity_test();
+int shed_lowest_test();
+int no_shed_upwards_test();
+int key_before_connect_test();
+
+int main() {
+  int ret = 0;
+
+  if (priority_order_test()) {
+    printf("priority order test failed\n");
+    ret++;
+  }
+  if (class_capacity_test()) {
+    printf("class capacity test failed\n");
+    ret++;
+  }
+  if (shed_lowest_test()) {
+    printf("shed lowest test failed\n");
+    ret++;
+  }
+  if (no_shed_upwards_test()) {
+    printf("no shed upwards test failed\n");
+    ret++;
+  }
+  if (key_before_connect_test()) {
+    printf("key before connect test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+// higher classes come out first, FIFO within a class
+int priority_order_test() {
+  size_t capacity[REQUEST_QUEUE_CLASSES] = {4, 4, 4};
+  request_queue queue;
+  if (request_queue_init(&queue, capacity, 12) != 0) {
+    return 1;
+  }
+
+  int items[5] = {0, 1, 2, 3, 4};
+  void *shed;
+  int shed_cls;
+  request_queue_push(&queue, 2, &items[0], &shed, &shed_cls);
+  request_queue_push(&queue, 1, &items[1], &shed, &shed_cls);
+  request_queue_push(&queue, 0, &items[2], &shed, &shed_cls);
+  request_queue_push(&queue, 1, &items[3], &shed, &shed_cls);
+  request_queue_push(&queue, 0, &items[4], &shed, &shed_cls);
+
+  int expected[5] = {2, 4, 1, 3, 0};
+  int ret = 0;
+  for (int i = 0; i < 5; i++) {
+    int *item = request_queue_pop(&queue, NULL);
+    if (item == NULL || *item != expected[i]) {
+      ret = 1;
+    }
+  }
+  if (request_queue_pop(&queue, NULL) != NULL) {
+    ret = 1;
+  }
+
+  request_queue_free(&queue);
+  return ret;
+}
+
+// a full class rejects new items, even with room elsewhere, and wraps around once drained
+int class_capacity_test() {
+  size_t capacity[REQUEST_QUEUE_CLASSES] = {2, 2, 2};
+  request_queue queue;
+  if (request_queue_init(&queue, capacity, 6) != 0) {
+    return 1;
+  }
+
+  int items[4];
+  void *shed;
+  int shed_cls;
+  int ret = 0;
+  if (!request_queue_push(&queue, 1, &items[0], &shed, &shed_cls) ||
+      !request_queue_push(&queue, 1, &items[1], &shed, &shed_cls)) {
+    ret = 1;
+  }
+  if (request_queue_push(&queue, 1, &items[2], &shed, &shed_cls) || shed != NULL) {
+    ret = 1;
+  }
+  if (request_queue_pop(&queue, NULL) != &items[0]) {
+    ret = 1;
+  }
+  if (!request_queue_push(&queue, 1, &items[3], &shed, &shed_cls)) {
+    ret = 1;
+  }
+  if (request_queue_pop(&queue, NULL) != &items[1] || request_queue_pop(&queue, NULL) != &items[3]) {
+    ret = 1;
+  }
+
+  request_queue_free(&queue);
+  return ret;
+}
+
+// when the queue as a whole is full, a more important item pushes out the newest least important one
+int shed_lowest_test() {
+  size_t capacity[REQUEST_QUEUE_CLASSES] = {4, 4, 4};
+  request_queue queue;
+  if (request_queue_init(&queue, capacity, 3) != 0) {
+    return 1;
+  }
+
+  int items[4];
+  void *shed;
+  int shed_cls = -1;
+  int ret = 0;
+  request_queue_push(&queue, 1, &items[0], &shed, &shed_cls);
+  request_queue_push(&queue, 2, &items[1], &shed, &shed_cls);
+  request_queue_push(&queue, 2, &items[2], &shed, &shed_cls);
+  if (!request_queue_push(&queue, 0, &items[3], &shed, &shed_cls) || shed != &items[2] || shed_cls != 2) {
+    ret = 1;
+  }
+  int cls;
+  if (request_queue_pop(&queue, &cls) != &items[3] || cls != 0) {
+    ret = 1;
+  }
+  if (request_queue_pop(&queue, &cls) != &items[0] || cls != 1) {
+    ret = 1;
+  }
+  if (request_queue_pop(&queue, &cls) != &items[1] || cls != 2) {
+    ret = 1;
+  }
+
+  request_queue_free(&queue);
+  return ret;
+}
+
+// a less important item never pushes out a more important one
+int no_shed_upwards_test() {
+  size_t capacity[REQUEST_QUEUE_CLASSES] = {4, 4, 4};
+  request_queue queue;
+  if (request_queue_init(&queue, capacity, 2) != 0) {
+    return 1;
+  }
+
+  int items[3];
+  void *shed;
+  int shed_cls;
+  int ret = 0;
+  request_queue_push(&queue, 0, &items[0], &shed, &shed_cls);
+  request_queue_push(&queue, 1, &items[1], &shed, &shed_cls);
+  if (request_queue_push(&queue, 2, &items[2], &shed, &shed_cls) || shed != NULL) {
+    ret = 1;
+  }
+  if (request_queue_push(&queue, 1, &items[2], &shed, &shed_cls) || shed != NULL) {
+    ret = 1;
+  }
+
+  request_queue_free(&queue);
+  return ret;
+}
+
+// a client's public key is handled before the ssh_request it sent next, and pings arriving in between can't shed it
+int key_before_connect_test() {
+  size_t capacity[REQUEST_QUEUE_CLASSES] = {4, 4, 4};
+  request_queue queue;
+  if (request_queue_init(&queue, capacity, 4) != 0) {
+    return 1;
+  }
+
+  int ping, key, request;
+  void *shed;
+  int shed_cls;
+  int ret = 0;
+  request_queue_push(&queue, request_class_of(NK_PING), &ping, &shed, &shed_cls);
+  request_queue_push(&queue, request_class_of(NK_SSHPUBLICKEY), &key, &shed, &shed_cls);
+  for (int i = 0; i < 3; i++) {
+    request_queue_push(&queue, request_class_of(NK_PING), &ping, &shed, &shed_cls);
+    if (shed == &key) {
+      ret = 1;
+    }
+  }
+  if (!request_queue_push(&queue, request_class_of(NK_SSH_REQUEST), &request, &shed, &shed_cls) || shed == &key) {
+    ret = 1;
+  }
+  if (request_queue_pop(&queue, NULL) != &key || request_queue_pop(&queue, NULL) != &request) {
+    ret = 1;
+  }
+
+  request_queue_free(&queue);
+  return ret;
+}
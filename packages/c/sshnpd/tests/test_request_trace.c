@@ -0,0 +1,221 @@
+#include "sshnpd/request_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int disabled_test();
+int sampling_test();
+int spans_test();
+int write_test();
+int file_test();
+
+int main() {
+  int ret = 0;
+
+  if (disabled_test()) {
+    printf("disabled test failed\n");
+    ret++;
+  }
+  if (sampling_test()) {
+    printf("sampling test failed\n");
+    ret++;
+  }
+  if (spans_test()) {
+    printf("spans test failed\n");
+    ret++;
+  }
+  if (write_test()) {
+    printf("write test failed\n");
+    ret++;
+  }
+  if (file_test()) {
+    printf("file test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+int disabled_test() {
+  request_tracer tracer;
+  if (request_tracer_open(&tracer, NULL, 1) != 0 || request_tracer_now_us(&tracer) != 0) {
+    return 1;
+  }
+
+  request_trace trace;
+  request_trace_start(&tracer, &trace, "ssh_request", "id", 0);
+  request_trace_begin(&trace, "stage");
+  request_trace_finish(&tracer, &trace);
+  // NULL traces are accepted too
+  request_trace_begin(NULL, "stage");
+  request_trace_end(NULL);
+  request_tracer_close(&tracer);
+  return trace.sampled || trace.len != 0 ? 1 : 0;
+}
+
+int sampling_test() {
+  char path[] = "/tmp/test_request_trace_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return 1;
+  }
+  close(fd);
+
+  int ret = 1;
+  request_tracer tracer;
+  if (request_tracer_open(&tracer, path, 3) != 0) {
+    goto exit;
+  }
+
+  // The first of every three requests is sampled
+  int sampled = 0;
+  for (int i = 0; i < 9; i++) {
+    request_trace trace;
+    request_trace_start(&tracer, &trace, "npt_request", "id", request_tracer_now_us(&tracer));
+    if (trace.sampled != (i % 3 == 0)) {
+      printf("request %d sampled: %d\n", i, trace.sampled);
+      goto close;
+    }
+    sampled += trace.sampled;
+    request_trace_finish(&tracer, &trace);
+  }
+  ret = sampled == 3 && tracer.events == 3 ? 0 : 1;
+
+close:
+  request_tracer_close(&tracer);
+exit:
+  unlink(path);
+  return ret;
+}
+
+int spans_test() {
+  char path[] = "/tmp/test_request_trace_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return 1;
+  }
+  close(fd);
+
+  int ret = 1;
+  request_tracer tracer;
+  if (request_tracer_open(&tracer, path, 1) != 0) {
+    goto exit;
+  }
+
+  request_trace trace;
+  // As main does, with the read which delivered the request already over
+  int64_t received = request_tracer_now_us(&tracer) - 10;
+  request_trace_start(&tracer, &trace, "ssh_request", "id", received);
+  request_trace_span(&trace, "monitor_read", received, received + 10);
+  request_trace_begin(&trace, "queued");
+  request_trace_begin(&trace, "verify_signature");
+  request_trace_end(&trace);
+  request_trace_end(&trace); // no current stage, nothing recorded
+  request_trace_begin(&trace, "fork");
+  request_trace_finish(&tracer, &trace);
+
+  const char *names[] = {"monitor_read", "queued", "verify_signature", "fork"};
+  if (trace.len != 4) {
+    goto close;
+  }
+  int64_t last_end = received;
+  for (size_t i = 0; i < trace.len; i++) {
+    if (strcmp(trace.spans[i].name, names[i]) != 0 || trace.spans[i].ended_us < trace.spans[i].began_us ||
+        trace.spans[i].began_us < received || trace.ended_us < trace.spans[i].ended_us) {
+      printf("span %lu: %s\n", i, trace.spans[i].name);
+      goto close;
+    }
+    last_end = trace.spans[i].ended_us;
+  }
+  // Finished traces can't be added to or written again
+  request_trace_begin(&trace, "late");
+  request_trace_finish(&tracer, &trace);
+  ret = trace.len == 4 && tracer.events == 5 && last_end <= trace.ended_us ? 0 : 1;
+
+close:
+  request_tracer_close(&tracer);
+exit:
+  unlink(path);
+  return ret;
+}
+
+int write_test() {
+  request_trace trace;
+  memset(&trace, 0, sizeof(trace));
+  trace.sampled = true;
+  trace.id = 7;
+  trace.name = "ssh_request";
+  strcpy(trace.notification_id, "a\"b\\c\n");
+  trace.began_us = 1000;
+  trace.ended_us = 5000;
+  request_trace_span(&trace, "verify_signature", 1500, 4000);
+
+  char buf[1024] = {0};
+  FILE *out = fmemopen(buf, sizeof(buf) - 1, "w");
+  if (out == NULL || request_trace_write(out, &trace, 42, false) != 0) {
+    return 1;
+  }
+  fclose(out);
+
+  const char *expected = ",\n{\"name\":\"ssh_request\",\"cat\":\"sshnpd\",\"ph\":\"X\",\"ts\":1000,\"dur\":4000,"
+                         "\"pid\":42,\"tid\":7,\"args\":{\"notificationId\":\"a\\\"b\\\\c\\u000a\"}},\n"
+                         "{\"name\":\"verify_signature\",\"cat\":\"sshnpd\",\"ph\":\"X\",\"ts\":1500,\"dur\":2500,"
+                         "\"pid\":42,\"tid\":7}";
+  if (strcmp(buf, expected) != 0) {
+    printf("got %s\n", buf);
+    return 1;
+  }
+  return 0;
+}
+
+int file_test() {
+  char path[] = "/tmp/test_request_trace_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return 1;
+  }
+  close(fd);
+
+  int ret = 1;
+  request_tracer tracer;
+  if (request_tracer_open(&tracer, path, 1) != 0) {
+    goto exit;
+  }
+  for (int i = 0; i < 2; i++) {
+    request_trace trace;
+    request_trace_start(&tracer, &trace, "ssh_request", "id", 0);
+    request_trace_begin(&trace, "fork");
+    request_trace_finish(&tracer, &trace);
+  }
+  request_tracer_close(&tracer);
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    goto exit;
+  }
+  char buf[2048] = {0};
+  size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+
+  // A JSON array of 4 events, with a comma between each of them
+  int events = 0;
+  int commas = 0;
+  for (const char *c = buf; (c = strstr(c, "{\"name\"")) != NULL; c++) {
+    events++;
+  }
+  for (const char *c = buf; (c = strstr(c, "},\n{")) != NULL; c++) {
+    commas++;
+  }
+  ret = len > 4 && strncmp(buf, "[\n", 2) == 0 && strcmp(buf + len - 3, "\n]\n") == 0 && events == 4 && commas == 3
+            ? 0
+            : 1;
+  if (ret != 0) {
+    printf("got %s\n", buf);
+  }
+
+exit:
+  unlink(path);
+  return ret;
+}
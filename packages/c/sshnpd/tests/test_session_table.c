@@ -0,0 +1,145 @@
+#include "sshnpd/session_table.h"
+#include <stdio.h>
+
+int concurrency_test();
+int rate_limit_test();
+int unlimited_test();
+int remove_unknown_test();
+
+int main() {
+  int ret = 0;
+
+  if (concurrency_test()) {
+    printf("concurrency test failed\n");
+    ret++;
+  }
+  if (rate_limit_test()) {
+    printf("rate limit test failed\n");
+    ret++;
+  }
+  if (unlimited_test()) {
+    printf("unlimited test failed\n");
+    ret++;
+  }
+  if (remove_unknown_test()) {
+    printf("remove unknown test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+int concurrency_test() {
+  session_table table;
+  if (session_table_init(&table, 3, 2, 0, 1) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  time_t now = 1000;
+  // @alice may have two live sessions, but not three
+  if (session_table_admit(&table, "@alice", now) != SESSION_ADMITTED || session_table_add(&table, 101, "@alice")) {
+    ret = 1;
+  }
+  if (session_table_admit(&table, "@alice", now) != SESSION_ADMITTED || session_table_add(&table, 102, "@alice")) {
+    ret = 1;
+  }
+  if (session_table_admit(&table, "@alice", now) != SESSION_REQUESTER_AT_MAX) {
+    ret = 1;
+  }
+  // @bob takes the last slot on the device
+  if (session_table_admit(&table, "@bob", now) != SESSION_ADMITTED || session_table_add(&table, 201, "@bob")) {
+    ret = 1;
+  }
+  if (session_table_admit(&table, "@bob", now) != SESSION_TABLE_AT_MAX) {
+    ret = 1;
+  }
+  // Once one of @alice's sessions ends, there is room for either of them again
+  if (!session_table_remove(&table, 101) || table.sessions_len != 2) {
+    ret = 1;
+  }
+  if (session_table_admit(&table, "@alice", now) != SESSION_ADMITTED) {
+    ret = 1;
+  }
+
+  session_table_free(&table);
+  return ret;
+}
+
+int rate_limit_test() {
+  session_table table;
+  // 6 a minute, i.e. one every 10 seconds, with bursts of up to 2
+  if (session_table_init(&table, 0, 0, 6, 2) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  time_t now = 1000;
+  if (session_table_admit(&table, "@alice", now) != SESSION_ADMITTED ||
+      session_table_admit(&table, "@alice", now) != SESSION_ADMITTED) {
+    ret = 1;
+  }
+  if (session_table_admit(&table, "@alice", now + 5) != SESSION_RATE_LIMITED) {
+    ret = 1;
+  }
+  // Other requesters have their own bucket
+  if (session_table_admit(&table, "@bob", now + 5) != SESSION_ADMITTED) {
+    ret = 1;
+  }
+  if (session_table_admit(&table, "@alice", now + 10) != SESSION_ADMITTED ||
+      session_table_admit(&table, "@alice", now + 10) != SESSION_RATE_LIMITED) {
+    ret = 1;
+  }
+  // A long quiet period refills the bucket, but only up to the burst
+  if (session_table_admit(&table, "@alice", now + 3600) != SESSION_ADMITTED ||
+      session_table_admit(&table, "@alice", now + 3600) != SESSION_ADMITTED ||
+      session_table_admit(&table, "@alice", now + 3600) != SESSION_RATE_LIMITED) {
+    ret = 1;
+  }
+
+  session_table_free(&table);
+  return ret;
+}
+
+int unlimited_test() {
+  session_table table;
+  if (session_table_init(&table, 0, 0, 0, 1) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  for (int i = 0; i < 100; i++) {
+    if (session_table_admit(&table, "@alice", 1000) != SESSION_ADMITTED || session_table_add(&table, i + 1, "@alice")) {
+      ret = 1;
+    }
+  }
+  if (table.sessions_len != 100 || table.requesters_len != 1 || table.requesters[0].live != 100) {
+    ret = 1;
+  }
+
+  session_table_free(&table);
+  return ret;
+}
+
+int remove_unknown_test() {
+  session_table table;
+  if (session_table_init(&table, 4, 4, 0, 1) != 0) {
+    return 1;
+  }
+
+  int ret = 0;
+  if (session_table_remove(&table, 42)) {
+    ret = 1;
+  }
+  if (session_table_add(&table, 42, "@alice") != 0 || !session_table_remove(&table, 42) ||
+      session_table_remove(&table, 42)) {
+    ret = 1;
+  }
+  if (table.requesters[0].live != 0) {
+    ret = 1;
+  }
+
+  session_table_free(&table);
+  return ret;
+}
@@ -66,6 +66,15 @@ int default_values_test() {
   if (params->local_sshd_port != 22) {
     ret = 1;
   }
+  if (params->request_max_age != 300) {
+    ret = 1;
+  }
+  if (params->max_sessions != 32 || params->max_sessions_per_atsign != 8) {
+    ret = 1;
+  }
+  if (params->session_rate != 20 || params->session_burst != 5) {
+    ret = 1;
+  }
 
   free(params);
   return ret;
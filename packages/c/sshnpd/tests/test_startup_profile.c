@@ -0,0 +1,138 @@
+#include "sshnpd/startup_profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int phases_test();
+int overflow_test();
+int write_test();
+int append_test();
+
+int main() {
+  int ret = 0;
+
+  if (phases_test()) {
+    printf("phases test failed\n");
+    ret++;
+  }
+  if (overflow_test()) {
+    printf("overflow test failed\n");
+    ret++;
+  }
+  if (write_test()) {
+    printf("write test failed\n");
+    ret++;
+  }
+  if (append_test()) {
+    printf("append test failed\n");
+    ret++;
+  }
+
+  printf("Tests failed: %d\n", ret);
+  return ret;
+}
+
+int phases_test() {
+  startup_profile profile;
+  startup_profile_init(&profile, 1000);
+
+  // ending with no current phase does nothing
+  startup_profile_end(&profile, 1500);
+  if (profile.len != 0) {
+    return 1;
+  }
+
+  startup_profile_begin(&profile, "first", 2000);
+  startup_profile_begin(&profile, "second", 3000);
+  startup_profile_end(&profile, 4500);
+  startup_profile_add(&profile, "threaded", 2500, 6000);
+  startup_profile_begin(&profile, "last", 7000);
+  startup_profile_finish(&profile, 9000);
+
+  if (profile.len != 4 || profile.ended_us != 9000 || profile.current_name != NULL) {
+    return 1;
+  }
+  const char *names[] = {"first", "second", "threaded", "last"};
+  const int64_t began[] = {2000, 3000, 2500, 7000};
+  const int64_t ended[] = {3000, 4500, 6000, 9000};
+  for (size_t i = 0; i < 4; i++) {
+    if (strcmp(profile.phases[i].name, names[i]) != 0 || profile.phases[i].began_us != began[i] ||
+        profile.phases[i].ended_us != ended[i]) {
+      printf("phase %lu: %s %lld-%lld\n", i, profile.phases[i].name, (long long)profile.phases[i].began_us,
+             (long long)profile.phases[i].ended_us);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int overflow_test() {
+  startup_profile profile;
+  startup_profile_init(&profile, 0);
+  for (int i = 0; i < STARTUP_PROFILE_MAX_PHASES + 5; i++) {
+    startup_profile_begin(&profile, "phase", i);
+  }
+  startup_profile_finish(&profile, 1000);
+  return profile.len == STARTUP_PROFILE_MAX_PHASES ? 0 : 1;
+}
+
+int write_test() {
+  startup_profile profile;
+  startup_profile_init(&profile, 1000);
+  startup_profile_begin(&profile, "load_atkeys", 1500);
+  startup_profile_add(&profile, "pkam_monitor", 2000, 252000);
+  startup_profile_finish(&profile, 301000);
+
+  char buf[512] = {0};
+  FILE *out = fmemopen(buf, sizeof(buf) - 1, "w");
+  if (out == NULL || startup_profile_write(&profile, out, "1.2.3", 1700000000) != 0) {
+    return 1;
+  }
+  fclose(out);
+
+  const char *expected = "{\"version\":\"1.2.3\",\"startedAt\":1700000000,\"totalMs\":300.000,\"phases\":["
+                         "{\"name\":\"pkam_monitor\",\"startMs\":1.000,\"durationMs\":250.000},"
+                         "{\"name\":\"load_atkeys\",\"startMs\":0.500,\"durationMs\":299.500}]}\n";
+  if (strcmp(buf, expected) != 0) {
+    printf("got %s", buf);
+    return 1;
+  }
+  return 0;
+}
+
+int append_test() {
+  char path[] = "/tmp/test_startup_profile_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return 1;
+  }
+  close(fd);
+
+  startup_profile profile;
+  startup_profile_init(&profile, 0);
+  startup_profile_finish(&profile, 1000);
+
+  int ret = 1;
+  if (startup_profile_append(&profile, path, "1.0.0", 1) != 0 ||
+      startup_profile_append(&profile, path, "1.0.1", 2) != 0) {
+    goto exit;
+  }
+
+  // Each run adds a line, so runs can be compared across versions
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    goto exit;
+  }
+  char line[256];
+  int lines = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    lines++;
+  }
+  fclose(file);
+  ret = lines == 2 && strstr(line, "\"version\":\"1.0.1\"") != NULL ? 0 : 1;
+
+exit:
+  unlink(path);
+  return ret;
+}